@@ -0,0 +1,46 @@
+/*
+ * Ahead-of-time compiled guest code - see cpm_aot.h
+ */
+
+#include "cpm_aot.h"
+#include "cpm_emulator.h"
+#include <string.h>
+
+// Function-local so registrations from other files' static initializers
+// never see it unconstructed
+static std::vector<const CPMAotProgram*>& programs() {
+  static std::vector<const CPMAotProgram*> list;
+  return list;
+}
+
+CPMAotRegistration::CPMAotRegistration(const CPMAotProgram* program) {
+  programs().push_back(program);
+}
+
+const CPMAotProgram* CPMAotCode::find(const qkz80_uint8* image, size_t size,
+                                      bool mode_8080) {
+  for (const CPMAotProgram* p : programs()) {
+    if (p->size == size && p->mode_8080 == mode_8080 &&
+        memcmp(p->image, image, size) == 0) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+size_t CPMAotCode::registered() {
+  return programs().size();
+}
+
+CPMAotCode::CPMAotCode(const CPMAotProgram* aprogram)
+  : blocks_run(0), instructions(0), stale(0),
+    program(aprogram), block_at(0x10000, -1) {
+  for (size_t i = 0; i < program->block_count; i++) {
+    block_at[program->blocks[i].addr] = (int)i;
+  }
+}
+
+bool CPMAotCode::matches(qkz80* cpu, const CPMAotBlock& b) const {
+  return memcmp(cpu->get_mem() + b.addr,
+                program->image + (b.addr - TPA_START), b.length) == 0;
+}
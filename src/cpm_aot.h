@@ -0,0 +1,96 @@
+/*
+ * Ahead-of-time compiled guest code
+ *
+ * cpmaot (cpm_aot_gen.cc) disassembles a .COM file from its entry point
+ * and writes C++ for each basic block it finds. Linked into cpmemu, that
+ * file registers a CPMAotProgram; when the same image is loaded, run()
+ * executes a block natively whenever PC reaches its start. Everything
+ * else stays with the interpreter: addresses reached only through
+ * computed jumps, instructions the generator leaves to execute(), and any
+ * block whose bytes no longer match the image (self-modifying code,
+ * overlays loaded over the program). Blocks end after stores that can
+ * reach their own code, so a block never runs bytes changed after its
+ * check.
+ *
+ * A native block does exactly what the interpreter would do for the same
+ * instructions, with the same cycle counts, so output and instruction
+ * counts are the same either way.
+ */
+
+#ifndef CPM_AOT_H
+#define CPM_AOT_H
+
+#include "qkz80.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Native code for the instructions at addr..addr+length-1. Returns the
+// instructions executed, with PC and cycles updated as execute() would.
+typedef int (*CPMAotFunction)(qkz80* cpu);
+
+struct CPMAotBlock {
+  qkz80_uint16 addr;
+  qkz80_uint16 length;       // Bytes of guest code the block covers
+  int instructions;          // Most instructions one call can execute
+  CPMAotFunction fn;
+};
+
+// A compiled program, as written by cpmaot
+struct CPMAotProgram {
+  const char* name;
+  const qkz80_uint8* image;  // The .COM file, loaded at TPA_START
+  size_t size;
+  bool mode_8080;            // Compiled for --8080
+  const CPMAotBlock* blocks;
+  size_t block_count;
+};
+
+// Generated files register their program from a static initializer
+struct CPMAotRegistration {
+  explicit CPMAotRegistration(const CPMAotProgram* program);
+};
+
+class CPMAotCode {
+public:
+  // Registered program matching the loaded image and CPU mode, or nullptr
+  static const CPMAotProgram* find(const qkz80_uint8* image, size_t size,
+                                   bool mode_8080);
+
+  // Programs linked into this binary
+  static size_t registered();
+
+  explicit CPMAotCode(const CPMAotProgram* program);
+
+  // Run the block starting at pc if there is one, it still matches the
+  // image and it fits in budget instructions. Returns the instructions
+  // executed, or 0 to interpret the next instruction instead.
+  int run(qkz80* cpu, qkz80_uint16 pc, long long budget) {
+    int index = block_at[pc];
+    if (index < 0) return 0;
+    const CPMAotBlock& b = program->blocks[index];
+    if (b.instructions > budget) return 0;
+    if (!matches(cpu, b)) {
+      stale++;
+      return 0;
+    }
+    int n = b.fn(cpu);
+    blocks_run++;
+    instructions += n;
+    return n;
+  }
+
+  const CPMAotProgram* get_program() const { return program; }
+
+  uint64_t blocks_run;      // Native block calls
+  uint64_t instructions;    // Instructions executed in native blocks
+  uint64_t stale;           // Blocks skipped because memory changed
+
+private:
+  bool matches(qkz80* cpu, const CPMAotBlock& b) const;
+
+  const CPMAotProgram* program;
+  std::vector<int> block_at;  // Per address: block index, or -1
+};
+
+#endif // CPM_AOT_H
@@ -0,0 +1,583 @@
+/*
+ * cpmaot: compile a CP/M .COM program to C++ ahead of time
+ *
+ * Follows the program's control flow from TPA_START through jumps,
+ * calls, restarts and conditional fall-throughs, splits what it reaches
+ * into basic blocks and writes one C++ function per block. Instructions
+ * are emitted as the interpreter's own register, memory and flag
+ * operations with their operands folded in; the rare ones (DAA, HALT,
+ * port I/O, DI/EI and the Z80 prefixed groups) call execute() at their
+ * address instead and end the block. Code reached only through computed
+ * jumps is never seen here and stays with the interpreter, as does any
+ * block whose bytes change at run time (see cpm_aot.h). A block also ends
+ * after a store that can reach its own later bytes, so the next block's
+ * entry check sees the change.
+ *
+ * The output defines a CPMAotProgram; link it into cpmemu with the
+ * application objects ("make aot AOT=PROG.COM").
+ */
+
+#include "cpm_emulator.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Instructions in one block before it is cut
+static const int MAX_BLOCK_INSTRUCTIONS = 64;
+
+static std::vector<qkz80_uint8> image;
+static bool mode_8080 = false;
+
+static const char* const R16_NAME[4] = { "BC", "DE", "HL", "SP" };
+
+// Image byte at a guest address, or -1 outside the image
+static int byte_at(int addr) {
+  int off = addr - TPA_START;
+  if (off < 0 || off >= (int)image.size()) return -1;
+  return image[off];
+}
+
+static int word_at(int addr) {
+  return byte_at(addr) | (byte_at(addr + 1) << 8);
+}
+
+// One decoded instruction
+struct Insn {
+  int addr;
+  int length;
+  int op;              // First byte
+  bool native;         // Emitted as C++, otherwise execute()
+  bool branch;         // Native control transfer, always ends a block
+  bool falls_through;  // Execution can continue at addr + length
+  int target;          // Static jump or call target, or -1
+};
+
+// Length of an unprefixed instruction as execute() decodes it
+static int base_length(int op) {
+  switch (op) {
+  case 0x06: case 0x0e: case 0x16: case 0x1e:
+  case 0x26: case 0x2e: case 0x36: case 0x3e:
+  case 0xc6: case 0xce: case 0xd6: case 0xde:
+  case 0xe6: case 0xee: case 0xf6: case 0xfe:
+  case 0xd3: case 0xdb:
+    return 2;
+  case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    return mode_8080 ? 1 : 2;  // Relative jumps are NOPs on the 8080
+  case 0x01: case 0x11: case 0x21: case 0x31:
+  case 0x22: case 0x2a: case 0x32: case 0x3a:
+  case 0xc3: case 0xcd:
+    return 3;
+  default:
+    if ((op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4) return 3;  // Jcc, Ccc
+    return 1;
+  }
+}
+
+// Prefixed opcode that takes an (IX+d) displacement
+static bool uses_index_memory(int op) {
+  if (op == 0x34 || op == 0x35 || op == 0x36) return true;
+  if (op >= 0x40 && op < 0x80 && op != 0x76) {
+    return (op & 7) == 6 || ((op >> 3) & 7) == 6;
+  }
+  return op >= 0x80 && op < 0xc0 && (op & 7) == 6;
+}
+
+static bool decode(int addr, Insn* in) {
+  int op = byte_at(addr);
+  if (op < 0) return false;
+  in->addr = addr;
+  in->op = op;
+  in->native = true;
+  in->branch = false;
+  in->falls_through = true;
+  in->target = -1;
+  in->length = base_length(op);
+
+  if (mode_8080) {
+    // CB xx and ED xx are two-byte NOPs, DD and FD one-byte NOPs
+    if (op == 0xcb || op == 0xed) in->length = 2;
+  } else if (op == 0xcb) {
+    in->length = 2;
+    in->native = false;
+  } else if (op == 0xed) {
+    int op2 = byte_at(addr + 1);
+    in->length = ((op2 & 0xc7) == 0x43) ? 4 : 2;  // LD (nn),rr / LD rr,(nn)
+    in->native = false;
+    if ((op2 & 0xc7) == 0x45) in->falls_through = false;  // RETN, RETI
+  } else if (op == 0xdd || op == 0xfd) {
+    int op2 = byte_at(addr + 1);
+    in->native = false;
+    if (op2 == 0xcb) {
+      in->length = 4;
+    } else if (op2 == 0xdd || op2 == 0xfd || op2 == 0xed || op2 < 0) {
+      // Prefix chains: leave the length to the interpreter
+      in->length = 1;
+      in->falls_through = false;
+    } else {
+      in->length = 1 + base_length(op2) + (uses_index_memory(op2) ? 1 : 0);
+      if (op2 == 0xe9) in->falls_through = false;  // JP (IX)
+    }
+  }
+
+  switch (op) {
+  case 0x27: case 0x76: case 0xd3: case 0xdb: case 0xf3: case 0xfb:
+    in->native = false;
+    break;
+  case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    if (!mode_8080) {
+      in->branch = true;
+      in->target = (addr + 2 + (qkz80_int8)byte_at(addr + 1)) & 0xffff;
+      in->falls_through = (op != 0x18);
+    }
+    break;
+  case 0xc3:
+    in->branch = true;
+    in->target = word_at(addr + 1);
+    in->falls_through = false;
+    break;
+  case 0xcd:
+    in->branch = true;
+    in->target = word_at(addr + 1);
+    break;
+  case 0xc9: case 0xe9:
+    in->branch = true;
+    in->falls_through = false;
+    break;
+  default:
+    if ((op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4) {  // Jcc, Ccc
+      in->branch = true;
+      in->target = word_at(addr + 1);
+    } else if ((op & 0xc7) == 0xc0) {                   // Rcc
+      in->branch = true;
+    } else if ((op & 0xc7) == 0xc7) {                   // RST
+      in->branch = true;
+      in->target = op & 0x38;
+    }
+    break;
+  }
+
+  return byte_at(addr + in->length - 1) >= 0;
+}
+
+// Addresses reachable from the entry point, and the block leaders among them
+static void discover(std::vector<bool>* leader) {
+  std::vector<bool> visited(0x10000, false);
+  std::vector<int> work(1, TPA_START);
+  (*leader)[TPA_START] = true;
+
+  while (!work.empty()) {
+    int addr = work.back();
+    work.pop_back();
+    Insn in;
+    while (!visited[addr] && decode(addr, &in)) {
+      visited[addr] = true;
+      if (in.target >= 0 && byte_at(in.target) >= 0) {
+        (*leader)[in.target] = true;
+        work.push_back(in.target);
+      }
+      if (!in.falls_through) break;
+      addr = (addr + in.length) & 0xffff;
+      // Execution can come back here after a branch or an interpreted
+      // instruction, so a block starts here
+      if (in.branch || !in.native) (*leader)[addr] = true;
+    }
+  }
+}
+
+// Native store through a register (HL, BC, DE or SP), which can hit any
+// address including the code that follows it
+static bool stores_indirect(const Insn& in) {
+  const int op = in.op;
+  if (op >= 0x70 && op < 0x78) return true;            // MOV M,r
+  if (op == 0x34 || op == 0x35 || op == 0x36) return true;  // INR M, DCR M, MVI M
+  if (op == 0x02 || op == 0x12) return true;           // STAX
+  return (op & 0xcf) == 0xc5 || op == 0xe3;            // PUSH, XTHL
+}
+
+// Bytes written by a native STA or SHLD, or 0
+static int stores_direct(const Insn& in, int* target) {
+  if (in.op != 0x32 && in.op != 0x22) return 0;
+  *target = word_at(in.addr + 1);
+  return in.op == 0x22 ? 2 : 1;
+}
+
+// Emitters: C++ for the interpreter's operations, CPU in "c"
+
+static std::string get8(int r) {
+  static const char* const get[8] = {
+    "c->regs.BC.get_high()", "c->regs.BC.get_low()",
+    "c->regs.DE.get_high()", "c->regs.DE.get_low()",
+    "c->regs.HL.get_high()", "c->regs.HL.get_low()",
+    "c->mem->fetch_mem(c->regs.HL.get_pair16())", "c->regs.AF.get_high()"
+  };
+  return get[r];
+}
+
+static std::string set8(int r, const std::string& v) {
+  static const char* const pair[3] = { "BC", "DE", "HL" };
+  if (r == 6) return "c->mem->store_mem(c->regs.HL.get_pair16(), " + v + ");";
+  if (r == 7) return "c->regs.AF.set_high(" + v + ");";
+  return std::string("c->regs.") + pair[r >> 1] + ((r & 1) ? ".set_low(" : ".set_high(") + v + ");";
+}
+
+static std::string pair16(int rp) {
+  return std::string("c->regs.") + R16_NAME[rp];
+}
+
+static std::string hex(int v, int digits) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "0x%0*x", digits, v);
+  return buf;
+}
+
+static std::string condition(int cc) {
+  return "c->regs.condition_code(" + std::to_string(cc) + ", c->regs.get_flags())";
+}
+
+static std::string set_pc(int addr) {
+  return "c->regs.PC.set_pair16(" + hex(addr & 0xffff, 4) + ");";
+}
+
+// X and Y come from the operand for CP
+static const char* const CP_XY =
+  "qkz80_uint8 f = c->regs.get_flags(); "
+  "f &= ~(qkz80_cpu_flags::X | qkz80_cpu_flags::Y); "
+  "if (b & 0x08) f |= qkz80_cpu_flags::X; "
+  "if (b & 0x20) f |= qkz80_cpu_flags::Y; "
+  "c->regs.set_flags(f);";
+
+// ADD..CP of A with operand expression b
+static std::string alu(int group, const std::string& b) {
+  const std::string a = "c->regs.AF.get_high()";
+  switch (group) {
+  case 0:
+    return "qkz80_uint16 a = " + a + "; qkz80_uint16 b = " + b + "; "
+           "qkz80_big_uint s = a + b; c->regs.set_flags_from_sum8(s, a, b, 0); c->regs.AF.set_high(s);";
+  case 1:
+    return "qkz80_uint16 a = " + a + "; qkz80_uint16 b = " + b + "; "
+           "qkz80_uint16 cy = c->fetch_carry_as_int(); qkz80_big_uint s = a + b + cy; "
+           "c->regs.set_flags_from_sum8(s, a, b, cy); c->regs.AF.set_high(s);";
+  case 2:
+    return "qkz80_uint16 a = " + a + "; qkz80_uint16 b = " + b + "; "
+           "qkz80_big_uint d = a - b; c->regs.set_flags_from_diff8(d, a, b, 0); c->regs.AF.set_high(d);";
+  case 3:
+    return "qkz80_uint16 a = " + a + "; qkz80_uint16 b = " + b + "; "
+           "qkz80_uint16 cy = c->fetch_carry_as_int(); qkz80_big_uint d = a - b - cy; "
+           "c->regs.set_flags_from_diff8(d, a, b, cy); c->regs.AF.set_high(d);";
+  case 4:
+    return "qkz80_uint8 a = " + a + "; qkz80_uint8 b = " + b + "; qkz80_uint8 r = a & b; "
+           "c->regs.AF.set_high(r); c->regs.set_flags_from_logic8(r, 0, " +
+           (mode_8080 ? "((a | b) & 0x08) != 0" : "1") + ");";
+  case 5:
+    return "qkz80_uint8 r = " + a + " ^ " + b + "; c->regs.AF.set_high(r); c->regs.set_flags_from_logic8(r, 0, 0);";
+  case 6:
+    return "qkz80_uint8 r = " + a + " | " + b + "; c->regs.AF.set_high(r); c->regs.set_flags_from_logic8(r, 0, 0);";
+  default:
+    return "qkz80_uint16 a = " + a + "; qkz80_uint16 b = " + b + "; "
+           "qkz80_big_uint d = a - b; c->regs.set_flags_from_diff8(d, a, b, 0); " + CP_XY;
+  }
+}
+
+// Native code for one instruction; next is the address after it. Branches
+// set PC themselves and return n.
+static std::string emit(const Insn& in, int n) {
+  const int op = in.op;
+  const int next = (in.addr + in.length) & 0xffff;
+  const int r = (op >> 3) & 7;
+  const int rp = (op >> 4) & 3;
+  const std::string ret = " return " + std::to_string(n) + ";";
+
+  if (op >= 0x40 && op < 0x80) {                       // MOV
+    return "{ qkz80_uint8 v = " + get8(op & 7) + "; " + set8(r, "v") + " }";
+  }
+  if (op >= 0x80 && op < 0xc0) {                       // ALU r
+    return "{ " + alu(r, get8(op & 7)) + " }";
+  }
+  if ((op & 0xc7) == 0xc6) {                           // ALU n
+    return "{ " + alu(r, hex(byte_at(in.addr + 1), 2)) + " }";
+  }
+
+  switch (op & 0xcf) {
+  case 0x01:                                           // LXI
+    return pair16(rp) + ".set_pair16(" + hex(word_at(in.addr + 1), 4) + ");";
+  case 0x03:                                           // INX
+    return pair16(rp) + ".set_pair16(" + pair16(rp) + ".get_pair16() + 1);";
+  case 0x0b:                                           // DCX
+    return pair16(rp) + ".set_pair16(" + pair16(rp) + ".get_pair16() - 1);";
+  case 0x09:                                           // DAD
+    return "{ qkz80_big_uint p1 = " + pair16(rp) + ".get_pair16(); "
+           "qkz80_big_uint p2 = c->regs.HL.get_pair16(); qkz80_big_uint s = p1 + p2; "
+           "c->regs.HL.set_pair16(s); " +
+           (mode_8080 ? std::string("c->regs.set_carry_from_int((s & ~0x0ffff) != 0);")
+                      : std::string("c->regs.set_flags_from_add16(s, p2, p1);")) + " }";
+  case 0xc1:                                           // POP
+    if (rp == 3) return "c->set_reg16(c->pop_word(), qkz80::regp_AF);";
+    return pair16(rp) + ".set_pair16(c->pop_word());";
+  case 0xc5:                                           // PUSH
+    if (rp == 3) return "c->push_word(c->get_reg16(qkz80::regp_AF));";
+    return "c->push_word(" + pair16(rp) + ".get_pair16());";
+  }
+
+  switch (op & 0xc7) {
+  case 0x04:                                           // INR
+    return "{ qkz80_uint8 v = " + get8(r) + "; v++; " + set8(r, "v") +
+           " c->regs.set_zspa_from_inr(v, (v & 0xf) == 0); }";
+  case 0x05:                                           // DCR
+    return "{ qkz80_uint8 v = " + get8(r) + "; v--; " + set8(r, "v") +
+           " c->regs.set_zspa_from_inr(v, (v & 0xf) " + (mode_8080 ? "!=" : "==") +
+           " 0xf, false); }";
+  case 0x06:                                           // MVI
+    return set8(r, hex(byte_at(in.addr + 1), 2));
+  case 0xc0:                                           // Rcc
+    return "if (" + condition(r) + ") c->regs.PC.set_pair16(c->pop_word()); else " +
+           set_pc(next) + ret;
+  case 0xc2:                                           // Jcc
+    return "if (" + condition(r) + ") " + set_pc(word_at(in.addr + 1)) + " else " +
+           set_pc(next) + ret;
+  case 0xc4:                                           // Ccc
+    return "if (" + condition(r) + ") { c->push_word(" + hex(next, 4) + "); " +
+           set_pc(word_at(in.addr + 1)) + " } else " + set_pc(next) + ret;
+  case 0xc7:                                           // RST
+    return "c->push_word(" + hex(next, 4) + "); " + set_pc(op & 0x38) + ret;
+  }
+
+  const std::string a = "c->regs.AF.get_high()";
+  switch (op) {
+  case 0x02: case 0x12:                                // STAX
+    return "c->mem->store_mem(" + pair16(rp) + ".get_pair16(), " + a + ");";
+  case 0x0a: case 0x1a:                                // LDAX
+    return "c->regs.AF.set_high(c->mem->fetch_mem(" + pair16(rp) + ".get_pair16()));";
+  case 0x07:                                           // RLCA
+    return "{ qkz80_big_uint v = " + a + "; qkz80_big_uint cy = (v & 0x80) != 0; "
+           "v = (v << 1) | cy; c->regs.AF.set_high(v); c->regs.set_flags_from_rotate_acc(v, cy); }";
+  case 0x0f:                                           // RRCA
+    return "{ qkz80_big_uint v = " + a + "; qkz80_uint8 lo = v & 1; "
+           "v = (v >> 1) | (lo ? 0x80 : 0); c->regs.AF.set_high(v); c->regs.set_flags_from_rotate_acc(v, lo); }";
+  case 0x17:                                           // RLA
+    return "{ qkz80_big_uint v = " + a + "; qkz80_uint8 cy = (v & 0x80) != 0; "
+           "v = (v << 1) | c->regs.get_carry_as_int(); c->regs.AF.set_high(v); "
+           "c->regs.set_flags_from_rotate_acc(v, cy); }";
+  case 0x1f:                                           // RRA
+    return "{ qkz80_big_uint v = " + a + "; qkz80_uint8 cy = v & 1; "
+           "v = (v >> 1) | (c->regs.get_carry_as_int() ? 0x80 : 0); c->regs.AF.set_high(v); "
+           "c->regs.set_flags_from_rotate_acc(v, cy); }";
+  case 0x22:                                           // SHLD
+    return "c->write_2_bytes(c->regs.HL.get_pair16(), " + hex(word_at(in.addr + 1), 4) + ");";
+  case 0x2a:                                           // LHLD
+    return "c->regs.HL.set_pair16(c->read_word(" + hex(word_at(in.addr + 1), 4) + "));";
+  case 0x32:                                           // STA
+    return "c->mem->store_mem(" + hex(word_at(in.addr + 1), 4) + ", " + a + ");";
+  case 0x3a:                                           // LDA
+    return "c->regs.AF.set_high(c->mem->fetch_mem(" + hex(word_at(in.addr + 1), 4) + "));";
+  case 0x2f:                                           // CPL
+    return "{ qkz80_uint8 v = " + a + " ^ 0xff; c->regs.AF.set_high(v); c->regs.set_flags_from_cpl(v); }";
+  case 0x37:                                           // SCF
+    return "c->regs.set_flags_from_scf(" + a + ");";
+  case 0x3f:                                           // CCF
+    return "c->regs.set_flags_from_ccf(" + a + ");";
+  case 0xc3:                                           // JMP
+    return set_pc(word_at(in.addr + 1)) + ret;
+  case 0xc9:                                           // RET
+    return "c->regs.PC.set_pair16(c->pop_word());" + ret;
+  case 0xcd:                                           // CALL
+    return "c->push_word(" + hex(next, 4) + "); " + set_pc(word_at(in.addr + 1)) + ret;
+  case 0xe3:                                           // XTHL
+    return "{ qkz80_uint16 sp = c->regs.SP.get_pair16(); qkz80_uint16 v = c->mem->fetch_mem16(sp); "
+           "qkz80_uint16 hl = c->regs.HL.get_pair16(); c->regs.HL.set_pair16(v); c->mem->store_mem16(sp, hl); }";
+  case 0xe9:                                           // PCHL
+    return "c->regs.PC.set_pair16(c->regs.HL.get_pair16());" + ret;
+  case 0xeb:                                           // XCHG
+    return "{ qkz80_uint16 de = c->regs.DE.get_pair16(); c->regs.DE.set_pair16(c->regs.HL.get_pair16()); "
+           "c->regs.HL.set_pair16(de); }";
+  case 0xf9:                                           // SPHL
+    return "c->regs.SP.set_pair16(c->regs.HL.get_pair16());";
+  }
+
+  if (mode_8080) return "";                            // NOP and the Z80 opcodes
+
+  switch (op) {
+  case 0x08:                                           // EX AF,AF'
+    return "{ qkz80_uint16 af = c->regs.AF.get_pair16(); c->regs.AF.set_pair16(c->regs.AF_.get_pair16()); "
+           "c->regs.AF_.set_pair16(af); }";
+  case 0xd9:                                           // EXX
+    return "{ qkz80_uint16 bc = c->regs.BC.get_pair16(), de = c->regs.DE.get_pair16(), "
+           "hl = c->regs.HL.get_pair16(); c->regs.BC.set_pair16(c->regs.BC_.get_pair16()); "
+           "c->regs.DE.set_pair16(c->regs.DE_.get_pair16()); c->regs.HL.set_pair16(c->regs.HL_.get_pair16()); "
+           "c->regs.BC_.set_pair16(bc); c->regs.DE_.set_pair16(de); c->regs.HL_.set_pair16(hl); }";
+  case 0x10:                                           // DJNZ
+    return "{ qkz80_uint8 b = c->regs.BC.get_high() - 1; c->regs.BC.set_high(b); "
+           "if (b != 0) " + set_pc(in.target) + " else " + set_pc(next) + " }" + ret;
+  case 0x18:                                           // JR
+    return set_pc(in.target) + ret;
+  case 0x20: case 0x28: case 0x30: case 0x38:          // JR cc
+    return std::string("if (") + ((op & 0x08) ? "" : "!") + condition((op & 0x10) ? 3 : 1) + ") " +
+           set_pc(in.target) + " else " + set_pc(next) + ret;
+  }
+  return "";                                           // NOP
+}
+
+// A basic block: native instructions, ended by a branch, an interpreted
+// instruction, a store that can change the rest of the block, the next
+// leader or the size limit. Cutting a block makes a new leader.
+struct Block {
+  int addr;
+  int length;
+  int native;
+  std::vector<Insn> insns;
+};
+
+static bool build_block(int addr, std::vector<bool>* leader, Block* b) {
+  b->addr = addr;
+  b->native = 0;
+  b->insns.clear();
+  Insn in;
+  int pc = addr;
+  int stored_lo = 0x10000, stored_hi = -1;  // Span written by STA/SHLD so far
+  while ((int)b->insns.size() < MAX_BLOCK_INSTRUCTIONS && decode(pc, &in)) {
+    if (!in.native && b->insns.empty()) return false;
+    if (in.addr <= stored_hi && in.addr + in.length > stored_lo) {
+      (*leader)[pc] = true;
+      break;
+    }
+    b->insns.push_back(in);
+    if (!in.native || in.branch) break;
+    b->native++;
+    pc = (pc + in.length) & 0xffff;
+    if (stores_indirect(in)) {
+      (*leader)[pc] = true;
+      break;
+    }
+    int target;
+    int bytes = stores_direct(in, &target);
+    if (bytes > 0) {
+      stored_lo = std::min(stored_lo, target);
+      stored_hi = std::max(stored_hi, target + bytes - 1);
+    }
+    if ((*leader)[pc]) break;
+  }
+  if (b->insns.empty()) return false;
+  const Insn& last = b->insns.back();
+  if (last.native && last.branch) b->native++;
+  b->length = last.addr + last.length - addr;
+  return true;
+}
+
+static void write_block(FILE* out, const Block& b) {
+  const int n = (int)b.insns.size();
+  const Insn& last = b.insns.back();
+  fprintf(out, "// %04X-%04X\n", b.addr, b.addr + b.length - 1);
+  fprintf(out, "int b_%04x(qkz80* c) {\n", b.addr);
+  fprintf(out, "  c->cycles += %d;\n", 5 * b.native);
+  for (const Insn& in : b.insns) {
+    fprintf(out, "  // %04X:", in.addr);
+    for (int i = 0; i < in.length; i++) fprintf(out, " %02X", byte_at(in.addr + i));
+    fprintf(out, "\n");
+    if (!in.native) {
+      fprintf(out, "  %s c->execute(); return %d;\n", set_pc(in.addr).c_str(), n);
+    } else {
+      std::string code = emit(in, n);
+      if (!code.empty()) fprintf(out, "  %s\n", code.c_str());
+    }
+  }
+  if (last.native && !last.branch) {
+    fprintf(out, "  %s return %d;\n", set_pc(last.addr + last.length).c_str(), n);
+  }
+  fprintf(out, "}\n\n");
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "Usage: %s [options] PROGRAM.COM\n", prog);
+  fprintf(stderr, "Write C++ for the reachable code of a CP/M program\n\n");
+  fprintf(stderr, "  --8080            Compile for cpmemu --8080\n");
+  fprintf(stderr, "  --output=FILE     Write to FILE instead of stdout\n");
+}
+
+int main(int argc, char** argv) {
+  const char* output = nullptr;
+  const char* program = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--8080") == 0) {
+      mode_8080 = true;
+    } else if (strncmp(argv[i], "--output=", 9) == 0) {
+      output = argv[i] + 9;
+    } else if (argv[i][0] != '-' && !program) {
+      program = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!program) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Same limit as cpmemu's loader
+  FILE* fp = fopen(program, "rb");
+  if (!fp) {
+    fprintf(stderr, "Cannot open %s: %s\n", program, strerror(errno));
+    return 1;
+  }
+  image.resize(0xE000);
+  image.resize(fread(&image[0], 1, image.size(), fp));
+  fclose(fp);
+  if (image.empty()) {
+    fprintf(stderr, "%s is empty\n", program);
+    return 1;
+  }
+
+  std::vector<bool> leader(0x10000, false);
+  discover(&leader);
+
+  std::vector<Block> blocks;
+  Block b;
+  for (int addr = TPA_START; addr < TPA_START + (int)image.size(); addr++) {
+    if (leader[addr] && build_block(addr, &leader, &b)) blocks.push_back(b);
+  }
+
+  FILE* out = stdout;
+  if (output && !(out = fopen(output, "w"))) {
+    fprintf(stderr, "Cannot create %s: %s\n", output, strerror(errno));
+    return 1;
+  }
+
+  const char* name = strrchr(program, '/');
+  name = name ? name + 1 : program;
+  fprintf(out, "// Generated by cpmaot from %s%s - do not edit\n\n", name, mode_8080 ? " (8080)" : "");
+  fprintf(out, "#include \"cpm_aot.h\"\n#include \"qkz80_cpu_flags.h\"\n\nnamespace {\n\n");
+  fprintf(out, "const qkz80_uint8 image[%zu] = {", image.size());
+  for (size_t i = 0; i < image.size(); i++) {
+    fprintf(out, "%s0x%02x,", (i % 16) ? " " : "\n  ", image[i]);
+  }
+  fprintf(out, "\n};\n\n");
+
+  size_t covered = 0;
+  for (const Block& blk : blocks) {
+    write_block(out, blk);
+    covered += blk.length;
+  }
+
+  fprintf(out, "const CPMAotBlock blocks[] = {\n");
+  for (const Block& blk : blocks) {
+    fprintf(out, "  { 0x%04x, %d, %d, b_%04x },\n", blk.addr, blk.length,
+            (int)blk.insns.size(), blk.addr);
+  }
+  fprintf(out, "};\n\n");
+  fprintf(out, "const CPMAotProgram program = {\n  \"%s\", image, sizeof(image), %s,\n"
+               "  blocks, sizeof(blocks) / sizeof(blocks[0])\n};\n\n", name,
+          mode_8080 ? "true" : "false");
+  fprintf(out, "CPMAotRegistration registration(&program);\n\n}  // namespace\n");
+
+  if (out != stdout && fclose(out) != 0) {
+    fprintf(stderr, "Cannot write %s: %s\n", output, strerror(errno));
+    return 1;
+  }
+  fprintf(stderr, "%s: %zu blocks over %zu of %zu bytes\n", name, blocks.size(),
+          covered, image.size());
+  return 0;
+}
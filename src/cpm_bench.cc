@@ -0,0 +1,449 @@
+/*
+ * BDOS file I/O benchmark
+ *
+ * Measures the CP/M layer on its own: each test calls CPMEmulator's BDOS
+ * entry directly, the way a guest's CALL 5 arrives, with no Z80 code in
+ * between. Results are operations per second and host read/write system
+ * calls per operation, so a change to buffering or handle caching shows
+ * up as a number.
+ *
+ * Tests run in a scratch directory under the current one, which is
+ * removed afterwards.
+ */
+
+#include "cpm_emulator.h"
+#include "os/platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+static const qkz80_uint16 FCB_ADDR = 0x005C;
+static const qkz80_uint16 DMA_ADDR = 0x0080;
+static const qkz80_uint16 STACK_TOP = 0xF000;
+
+#ifdef _WIN32
+static const char* NULL_DEVICE = "NUL";
+#else
+static const char* NULL_DEVICE = "/dev/null";
+#endif
+
+// Emulator whose console goes to the null device, written the same way
+// the real console writes stdout
+class BenchEmulator : public CPMEmulator {
+public:
+  BenchEmulator(qkz80* acpu, FILE* asink)
+    : CPMEmulator(acpu, false), sink(asink) {}
+
+  void console_out(qkz80_uint8 ch) override { fputc(ch, sink); }
+  void console_flush() override { fflush(sink); }
+
+private:
+  FILE* sink;
+};
+
+// One emulator with its own CPU and memory, driven through the BDOS
+class BenchMachine {
+public:
+  BenchMachine(FILE* sink, CPMFileCache* cache)
+    : failed(false), cpu(&memory), cpm(&cpu, sink) {
+    cpm.setup_memory();
+    cpm.quiet = true;
+    cpm.file_cache = cache;
+    cpu.regs.SP.set_pair16(STACK_TOP);
+  }
+
+  qkz80_uint8* mem() { return cpu.get_mem(); }
+
+  // Set by a test that stopped on an unexpected BDOS error
+  bool failed;
+
+  // Call BDOS function func with DE=de and return A
+  qkz80_uint8 bdos(qkz80_uint8 func, qkz80_uint16 de) {
+    cpu.set_reg8(func, qkz80::reg_C);
+    cpu.set_reg16(de, qkz80::regp_DE);
+    cpu.push_word(TPA_START);
+    cpm.handle_pc(BDOS_BASE);
+    return cpu.get_reg8(qkz80::reg_A);
+  }
+
+  // Fill the FCB with an 11 character "NAME    EXT" name, all else zero
+  void set_fcb(const char* name83) {
+    memset(&mem()[FCB_ADDR], 0, 36);
+    memcpy(&mem()[FCB_ADDR + 1], name83, 11);
+  }
+
+  void set_random_record(unsigned record) {
+    mem()[FCB_ADDR + 33] = record & 0xFF;
+    mem()[FCB_ADDR + 34] = (record >> 8) & 0xFF;
+    mem()[FCB_ADDR + 35] = 0;
+  }
+
+private:
+  qkz80_cpu_mem memory;
+  qkz80 cpu;
+  BenchEmulator cpm;
+};
+
+struct BenchConfig {
+  long records;                  // Records per file test
+  std::vector<long> dir_sizes;   // Files in the directory for search tests
+  FILE* sink;
+  CPMFileCache* cache;
+};
+
+// A test: set-up is not timed; run() returns the operations it did
+struct BenchCase {
+  std::string name;
+  void (*setup)(const BenchConfig& config, long param);
+  long (*run)(BenchMachine& m, const BenchConfig& config, long param);
+  void (*cleanup)(long param);
+  long param;
+};
+
+// Deterministic record order for the random tests
+static unsigned next_random(unsigned* state) {
+  *state = *state * 1103515245u + 12345u;
+  return (*state >> 8) & 0xFFFFFF;
+}
+
+static void write_host_file(const char* path, long records, bool text) {
+  FILE* fp = fopen(path, "wb");
+  if (!fp) return;
+  char record[128];
+  char line[80];
+  for (long r = 0; r < records; r++) {
+    if (text) {
+      // Two 64 byte lines per record
+      for (int half = 0; half < 2; half++) {
+        snprintf(line, sizeof(line), "%08ld %-54s\n", r * 2 + half, "The quick brown fox");
+        memcpy(record + half * 64, line, 64);
+      }
+    } else {
+      for (int i = 0; i < 128; i++) record[i] = (char)(r + i);
+    }
+    fwrite(record, 1, sizeof(record), fp);
+  }
+  fclose(fp);
+}
+
+static void fill_dma(BenchMachine& m, bool text, long r) {
+  qkz80_uint8* dma = &m.mem()[DMA_ADDR];
+  if (text) {
+    char line[80];
+    for (int half = 0; half < 2; half++) {
+      snprintf(line, sizeof(line), "%08ld %-53s\r\n", r * 2 + half, "The quick brown fox");
+      memcpy(dma + half * 64, line, 64);
+    }
+  } else {
+    for (int i = 0; i < 128; i++) dma[i] = (qkz80_uint8)(r + i);
+  }
+}
+
+// ============================================================================
+// Tests
+// ============================================================================
+
+static void setup_none(const BenchConfig& config, long param) {
+  (void)config;
+  (void)param;
+}
+
+static void setup_binary(const BenchConfig& config, long param) {
+  (void)param;
+  write_host_file("bench.dat", config.records, false);
+}
+
+static void setup_text(const BenchConfig& config, long param) {
+  (void)param;
+  write_host_file("bench.txt", config.records, true);
+}
+
+static void cleanup_bench_files(long param) {
+  (void)param;
+  platform::delete_file("bench.dat");
+  platform::delete_file("bench.txt");
+}
+
+// param: 1 = text file
+static long run_seq_write(BenchMachine& m, const BenchConfig& config, long param) {
+  m.set_fcb(param ? "BENCH   TXT" : "BENCH   DAT");
+  if (m.bdos(22, FCB_ADDR) != 0) {
+    m.failed = true;
+    return 0;
+  }
+  m.bdos(26, DMA_ADDR);
+  long done = 0;
+  for (; done < config.records; done++) {
+    fill_dma(m, param != 0, done);
+    if (m.bdos(21, FCB_ADDR) != 0) {
+      m.failed = true;
+      break;
+    }
+  }
+  m.bdos(16, FCB_ADDR);
+  return done;
+}
+
+static long run_seq_read(BenchMachine& m, const BenchConfig& config, long param) {
+  (void)config;
+  m.set_fcb(param ? "BENCH   TXT" : "BENCH   DAT");
+  if (m.bdos(15, FCB_ADDR) != 0) {
+    m.failed = true;
+    return 0;
+  }
+  m.bdos(26, DMA_ADDR);
+  long done = 0;
+  while (m.bdos(20, FCB_ADDR) == 0) {
+    done++;
+  }
+  m.bdos(16, FCB_ADDR);
+  return done;
+}
+
+// param: 1 = write
+static long run_random(BenchMachine& m, const BenchConfig& config, long param) {
+  m.set_fcb("BENCH   DAT");
+  if (m.bdos(15, FCB_ADDR) != 0) {
+    m.failed = true;
+    return 0;
+  }
+  m.bdos(26, DMA_ADDR);
+  unsigned state = 1;
+  long limit = config.records < 65536 ? config.records : 65536;
+  long done = 0;
+  for (; done < config.records; done++) {
+    m.set_random_record(next_random(&state) % limit);
+    if (param) fill_dma(m, false, done);
+    if (m.bdos(param ? 34 : 33, FCB_ADDR) != 0) {
+      m.failed = true;
+      break;
+    }
+  }
+  m.bdos(16, FCB_ADDR);
+  return done;
+}
+
+static long run_open_close(BenchMachine& m, const BenchConfig& config, long param) {
+  (void)param;
+  long done = 0;
+  for (; done < config.records; done++) {
+    m.set_fcb("BENCH   DAT");
+    if (m.bdos(15, FCB_ADDR) != 0) {
+      m.failed = true;
+      break;
+    }
+    m.bdos(16, FCB_ADDR);
+  }
+  return done;
+}
+
+// param: number of files in the directory
+static void setup_directory(const BenchConfig& config, long param) {
+  (void)config;
+  char name[32];
+  for (long i = 0; i < param; i++) {
+    snprintf(name, sizeof(name), "f%07ld.dat", i);
+    FILE* fp = fopen(name, "wb");
+    if (fp) fclose(fp);
+  }
+}
+
+static void cleanup_directory(long param) {
+  char name[32];
+  for (long i = 0; i < param; i++) {
+    snprintf(name, sizeof(name), "f%07ld.dat", i);
+    platform::delete_file(name);
+  }
+}
+
+// Search first/next over the whole directory, repeated for small ones
+static long run_search(BenchMachine& m, const BenchConfig& config, long param) {
+  (void)config;
+  long passes = param >= 100000 ? 1 : 100000 / param;
+  m.bdos(26, DMA_ADDR);
+  long found = 0;
+  for (long pass = 0; pass < passes; pass++) {
+    m.set_fcb("???????????");
+    for (qkz80_uint8 a = m.bdos(17, FCB_ADDR); a != 0xFF; a = m.bdos(18, FCB_ADDR)) {
+      found++;
+    }
+  }
+  return found;
+}
+
+// param: 0 = BDOS 2 per character, 1 = BDOS 9 strings of 64
+static long run_console(BenchMachine& m, const BenchConfig& config, long param) {
+  long chars = config.records * 128;
+  if (param == 0) {
+    for (long i = 0; i < chars; i++) {
+      m.bdos(2, (qkz80_uint16)('A' + i % 26));
+    }
+    return chars;
+  }
+
+  qkz80_uint16 text = 0x1000;
+  for (int i = 0; i < 62; i++) m.mem()[text + i] = 'A' + i % 26;
+  m.mem()[text + 62] = '\r';
+  m.mem()[text + 63] = '\n';
+  m.mem()[text + 64] = '$';
+  for (long i = 0; i < chars; i += 64) {
+    m.bdos(9, text);
+  }
+  return chars;
+}
+
+// ============================================================================
+// Driver
+// ============================================================================
+
+static std::vector<BenchCase> make_cases(const BenchConfig& config) {
+  std::vector<BenchCase> cases;
+  BenchCase c;
+
+  c = { "seq write binary (.DAT)", setup_none, run_seq_write, cleanup_bench_files, 0 };
+  cases.push_back(c);
+  c = { "seq write text (.TXT)", setup_none, run_seq_write, cleanup_bench_files, 1 };
+  cases.push_back(c);
+  c = { "seq read binary (.DAT)", setup_binary, run_seq_read, cleanup_bench_files, 0 };
+  cases.push_back(c);
+  c = { "seq read text (.TXT)", setup_text, run_seq_read, cleanup_bench_files, 1 };
+  cases.push_back(c);
+  c = { "random read", setup_binary, run_random, cleanup_bench_files, 0 };
+  cases.push_back(c);
+  c = { "random write", setup_binary, run_random, cleanup_bench_files, 1 };
+  cases.push_back(c);
+  c = { "open/close", setup_binary, run_open_close, cleanup_bench_files, 0 };
+  cases.push_back(c);
+  for (size_t i = 0; i < config.dir_sizes.size(); i++) {
+    c = { "search, " + std::to_string(config.dir_sizes[i]) + " files", setup_directory,
+          run_search, cleanup_directory, config.dir_sizes[i] };
+    cases.push_back(c);
+  }
+  c = { "console chars (BDOS 2)", setup_none, run_console, cleanup_bench_files, 0 };
+  cases.push_back(c);
+  c = { "console strings (BDOS 9)", setup_none, run_console, cleanup_bench_files, 1 };
+  cases.push_back(c);
+  return cases;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "Usage: %s [options]\n", prog);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --records=N         128-byte records per file test (default 20000)\n");
+  fprintf(stderr, "  --files=N,N,...     Directory sizes for the search tests\n");
+  fprintf(stderr, "                      (default 10,1000,100000)\n");
+  fprintf(stderr, "  --only=TEXT         Run only tests whose name contains TEXT\n");
+  fprintf(stderr, "  --dir=NAME          Scratch directory made in the current one\n");
+  fprintf(stderr, "                      (default cpmbench.tmp)\n");
+  fprintf(stderr, "  --file-cache=MB     Use a file content cache of MB megabytes\n");
+}
+
+int main(int argc, char** argv) {
+  BenchConfig config;
+  config.records = 20000;
+  config.sink = nullptr;
+  config.cache = nullptr;
+  const char* only = nullptr;
+  std::string dir = "cpmbench.tmp";
+  long long cache_mb = 0;
+  bool sizes_given = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--records=", 10) == 0) {
+      config.records = atol(argv[i] + 10);
+    } else if (strncmp(argv[i], "--files=", 8) == 0) {
+      sizes_given = true;
+      for (const char* p = argv[i] + 8; *p; ) {
+        char* end;
+        long n = strtol(p, &end, 10);
+        if (end == p) break;
+        if (n > 0) config.dir_sizes.push_back(n);
+        p = (*end == ',') ? end + 1 : end;
+      }
+    } else if (strncmp(argv[i], "--only=", 7) == 0) {
+      only = argv[i] + 7;
+    } else if (strncmp(argv[i], "--dir=", 6) == 0 && !strpbrk(argv[i] + 6, "/\\")) {
+      dir = argv[i] + 6;
+    } else if (strncmp(argv[i], "--file-cache=", 13) == 0) {
+      cache_mb = atoll(argv[i] + 13);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!sizes_given) {
+    config.dir_sizes.push_back(10);
+    config.dir_sizes.push_back(1000);
+    config.dir_sizes.push_back(100000);
+  }
+  if (config.records <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::unique_ptr<CPMFileCache> cache;
+  if (cache_mb > 0) {
+    cache.reset(new CPMFileCache((size_t)cache_mb << 20));
+    config.cache = cache.get();
+  }
+  config.sink = fopen(NULL_DEVICE, "wb");
+  if (!config.sink) {
+    fprintf(stderr, "Cannot open %s\n", NULL_DEVICE);
+    return 1;
+  }
+
+  if (!platform::create_directory(dir.c_str()) || platform::change_directory(dir.c_str()) != 0) {
+    fprintf(stderr, "Cannot create scratch directory %s (remove it if left over)\n", dir.c_str());
+    return 1;
+  }
+
+  uint64_t reads, writes;
+  bool have_calls = platform::get_io_call_counts(&reads, &writes);
+  printf("%ld records per file test%s\n", config.records,
+         have_calls ? "" : ", system call counts not available");
+  printf("%-28s %10s %9s %12s %10s\n", "test", "ops", "seconds", "ops/sec", "calls/op");
+
+  std::vector<BenchCase> cases = make_cases(config);
+  for (size_t i = 0; i < cases.size(); i++) {
+    const BenchCase& c = cases[i];
+    if (only && c.name.find(only) == std::string::npos) continue;
+
+    c.setup(config, c.param);
+    long ops;
+    double seconds;
+    uint64_t calls = 0;
+    bool failed;
+    {
+      BenchMachine machine(config.sink, config.cache);
+      uint64_t reads0 = 0, writes0 = 0, reads1 = 0, writes1 = 0;
+      platform::get_io_call_counts(&reads0, &writes0);
+      uint64_t start = platform::monotonic_usec();
+      ops = c.run(machine, config, c.param);
+      fflush(config.sink);
+      seconds = (platform::monotonic_usec() - start) / 1e6;
+      platform::get_io_call_counts(&reads1, &writes1);
+      calls = (reads1 - reads0) + (writes1 - writes0);
+      failed = machine.failed;
+    }
+    c.cleanup(c.param);
+
+    printf("%-28s %10ld %9.3f %12.0f", c.name.c_str(), ops, seconds,
+           seconds > 0 ? ops / seconds : 0.0);
+    if (have_calls && ops > 0) {
+      printf(" %10.3f", (double)calls / ops);
+    } else {
+      printf(" %10s", "-");
+    }
+    printf("%s\n", failed ? "  stopped on a BDOS error" : "");
+    fflush(stdout);
+  }
+
+  fclose(config.sink);
+  platform::change_directory("..");
+  platform::remove_directory(dir.c_str());
+  return 0;
+}
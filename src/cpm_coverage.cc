@@ -0,0 +1,121 @@
+/*
+ * Guest code coverage
+ */
+
+#include "cpm_coverage.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+CPMCoverageMemory::CPMCoverageMemory() : counts(0x10000, 0) {
+}
+
+qkz80_uint8 CPMCoverageMemory::fetch_mem(qkz80_uint16 addr, bool is_instruction) {
+  if (is_instruction && counts[addr] != 0xFF) {
+    counts[addr]++;
+  }
+  return qkz80_cpu_mem::fetch_mem(addr, is_instruction);
+}
+
+unsigned CPMCoverageMemory::executed_bytes() const {
+  unsigned n = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i]) n++;
+  }
+  return n;
+}
+
+bool CPMCoverageMemory::write_bitmap(const char* path) const {
+  std::vector<qkz80_uint8> bits(counts.size() / 8, 0);
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i]) bits[i / 8] |= (qkz80_uint8)(1 << (i % 8));
+  }
+
+  FILE* fp = fopen(path, "wb");
+  if (!fp) return false;
+  bool ok = fwrite(bits.data(), 1, bits.size(), fp) == bits.size();
+  return fclose(fp) == 0 && ok;
+}
+
+// Length of the hex digit run at p
+static size_t hex_run(const char* p) {
+  size_t n = 0;
+  while (isxdigit((unsigned char)p[n])) n++;
+  return n;
+}
+
+// Find the address of a listing line that carries object code.
+// ASM, MAC, RMAC and M80 all start such lines with a 4-digit hex address
+// (M80 adds ' or " for relocatable ones) followed by the code bytes,
+// optionally after a line number. Returns false for other lines.
+static bool parse_listing_address(const char* line, qkz80_uint16* addr) {
+  const char* p = line;
+  for (int field = 0; field < 2; field++) {
+    while (*p == ' ' || *p == '\t') p++;
+    size_t n = hex_run(p);
+    const char* end = p + n;
+    if (n == 4 && (*end == '\'' || *end == '"' || *end == '*')) end++;
+
+    if (n == 4 && (*end == ' ' || *end == '\t')) {
+      const char* q = end;
+      while (*q == ' ' || *q == '\t') q++;
+      size_t code = hex_run(q);
+      char after = q[code];
+      if (code >= 2 && code % 2 == 0 &&
+          (after == ' ' || after == '\t' || after == '\r' || after == '\n' || after == '\0')) {
+        unsigned value;
+        sscanf(p, "%4x", &value);
+        *addr = (qkz80_uint16)value;
+        return true;
+      }
+      return false;
+    }
+
+    // Skip a leading line number and try again
+    if (!isdigit((unsigned char)*p)) return false;
+    while (isdigit((unsigned char)*p)) p++;
+    if (*p == ':') p++;
+  }
+  return false;
+}
+
+bool CPMCoverageMemory::annotate_listing(const char* prn_path, const char* out_path,
+                                         unsigned* lines_hit, unsigned* lines_code) const {
+  FILE* in = fopen(prn_path, "rb");
+  if (!in) return false;
+  FILE* out = fopen(out_path, "wb");
+  if (!out) {
+    fclose(in);
+    return false;
+  }
+
+  *lines_hit = 0;
+  *lines_code = 0;
+
+  char line[1024];
+  bool at_line_start = true;
+  while (fgets(line, sizeof(line), in)) {
+    // Continuations of over-long lines are copied without a new column
+    if (at_line_start) {
+      qkz80_uint16 addr;
+      if (strchr(line, 0x1A) == line) {
+        break;  // ^Z: end of a CP/M text file
+      } else if (parse_listing_address(line, &addr)) {
+        (*lines_code)++;
+        if (counts[addr]) {
+          (*lines_hit)++;
+          fprintf(out, "%6u%s:", counts[addr], counts[addr] == 0xFF ? "+" : " ");
+        } else {
+          fprintf(out, " ##### :");
+        }
+      } else {
+        fprintf(out, "     - :");
+      }
+    }
+    fputs(line, out);
+    at_line_start = strchr(line, '\n') != nullptr;
+  }
+
+  fclose(in);
+  return fclose(out) == 0;
+}
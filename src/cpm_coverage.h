@@ -0,0 +1,45 @@
+/*
+ * Guest code coverage
+ *
+ * CPMCoverageMemory counts instruction fetches per guest address in a
+ * saturating 8-bit counter, using the is_instruction flag the CPU passes
+ * to fetch_mem(). Operand bytes are fetched through the same path, so
+ * every byte of an executed instruction is marked.
+ *
+ * At exit the counters can be written as a compact bitmap (one bit per
+ * address, 8K for 64K) and merged with an assembler .PRN listing to show
+ * which source lines ran.
+ */
+
+#ifndef CPM_COVERAGE_H
+#define CPM_COVERAGE_H
+
+#include "qkz80_mem.h"
+#include <string>
+#include <vector>
+
+class CPMCoverageMemory : public qkz80_cpu_mem {
+  std::vector<qkz80_uint8> counts;   // Saturates at 255
+
+public:
+  CPMCoverageMemory();
+
+  qkz80_uint8 fetch_mem(qkz80_uint16 addr, bool is_instruction = false) override;
+
+  // Number of times addr was fetched as an instruction byte (max 255)
+  qkz80_uint8 get_count(qkz80_uint16 addr) const { return counts[addr]; }
+
+  // Number of distinct addresses executed
+  unsigned executed_bytes() const;
+
+  // Write one bit per address, bit 0 of byte 0 = address 0000
+  bool write_bitmap(const char* path) const;
+
+  // Copy a .PRN listing to out_path with an execution count column.
+  // Lines with object code that never ran are marked with #####.
+  // lines_hit/lines_code receive the summary; false on I/O error.
+  bool annotate_listing(const char* prn_path, const char* out_path,
+                        unsigned* lines_hit, unsigned* lines_code) const;
+};
+
+#endif // CPM_COVERAGE_H
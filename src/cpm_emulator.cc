@@ -0,0 +1,2990 @@
+/*
+ * CP/M 2.2 Emulator - CP/M system layer
+ *
+ * BDOS and BIOS emulation, file mapping and EOL conversion.
+ */
+
+#include "cpm_emulator.h"
+#include "cpm_aot.h"
+#include "cpm_loops.h"
+#include "cpm_peripherals.h"
+#include "cpm_terminal.h"
+#include "os/platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <time.h>
+
+// Helper function to expand environment variables in strings
+// Supports both $VAR and ${VAR} syntax
+static std::string expand_env_vars(const std::string& str) {
+  std::string result;
+  size_t i = 0;
+
+  while (i < str.length()) {
+    if (str[i] == '$') {
+      // Found a variable reference
+      i++;  // Skip the $
+
+      std::string var_name;
+
+      // Check for ${VAR} syntax
+      if (i < str.length() && str[i] == '{') {
+        i++;  // Skip the {
+
+        // Read until }
+        while (i < str.length() && str[i] != '}') {
+          var_name += str[i++];
+        }
+        if (i < str.length() && str[i] == '}') {
+          i++;  // Skip the }
+        }
+      } else {
+        // $VAR syntax - read alphanumeric and underscore
+        while (i < str.length() && (isalnum(str[i]) || str[i] == '_')) {
+          var_name += str[i++];
+        }
+      }
+
+      // Get environment variable value
+      const char* env_value = getenv(var_name.c_str());
+      if (env_value) {
+        result += env_value;
+      }
+      // If variable not found, leave it empty (or could keep original)
+    } else {
+      result += str[i++];
+    }
+  }
+
+  return result;
+}
+// ^C exit handling - 5 consecutive ^C characters exit the emulator
+static const int CTRL_C_EXIT_COUNT = 5;
+
+// Console status polls without input before an instance is considered idle
+static const int IDLE_POLL_LIMIT = 64;
+
+// Polls further apart than this many cycles are a busy program checking
+// for ^C, not an idle one
+static const unsigned long long IDLE_POLL_CYCLES = 1000;
+
+// How long an idle single instance waits for console input
+static const int IDLE_WAIT_MS = 10;
+
+// Pacing: emulated time between clock checks, and how far behind real
+// time the guest may fall before pacing restarts from the current time
+static const uint64_t PACE_BATCH_USEC = 2000;
+static const uint64_t PACE_MAX_LAG_USEC = 50000;
+
+// Random record prefetch: strides covered by one window, and its size limit
+static const long PREFETCH_STRIDES = 64;
+static const long PREFETCH_MAX = 16384;
+
+// Largest run of adjacent random writes held before writing it out
+static const size_t WRITE_BATCH_MAX = 16384;
+
+CPMEmulator::~CPMEmulator() {
+  // Close any files the program left open
+  for (auto& pair : open_files) {
+    close_open_file(pair.second);
+  }
+
+  // Close device files
+  if (printer_file) fclose(printer_file);
+  if (aux_in_file) fclose(aux_in_file);
+  if (aux_out_file) fclose(aux_out_file);
+}
+
+void CPMEmulator::request_exit(int status) {
+  exit_requested = true;
+  exit_status = status;
+}
+
+void CPMEmulator::enable_timer_interrupt(unsigned long long cycles, int rst) {
+  int_cycles = cycles;
+  int_rst = rst & 7;
+  next_tick_cycles = cpu->cycles + cycles;
+  cpu->regs.IFF1 = 1;  // Enable interrupts
+  cpu->regs.IFF2 = 1;
+  cpu->regs.IM = 1;    // IM 1 mode (RST 38H style)
+}
+
+CPMEmulator::RunStatus CPMEmulator::run(long long max_instructions) {
+  RunStatus status = RUN_BUDGET;
+  long long executed = 0;
+  input_wait = WAIT_NONE;
+
+  while (executed < max_instructions) {
+    qkz80_uint16 pc = cpu->regs.PC.get_pair16();
+
+    // Check for CP/M system calls
+    if (handle_pc(pc)) {
+      trap_count++;
+      if (exit_requested) {
+        status = RUN_EXITED;
+        break;
+      }
+      if (input_wait != WAIT_NONE) {
+        status = RUN_BLOCKED;
+        break;
+      }
+      continue;
+    }
+
+    // Check for timer interrupt (cycle-based)
+    if (int_cycles > 0 && cpu->cycles >= next_tick_cycles) {
+      next_tick_cycles = cpu->cycles + int_cycles;
+      cpu->request_rst(int_rst);
+    }
+
+    // Peripheral events (timer zero counts, serial characters)
+    if (peripherals && cpu->cycles >= peripherals->next_event) {
+      // Pacing already sleeps while halted; otherwise host polls may wait
+      peripherals->cpu_halted = cpu->is_halted() && pace_hz == 0;
+      peripherals->service();
+      peripherals->cpu_halted = false;
+    }
+
+    // Real-time pacing (never true when running at full speed)
+    if (cpu->cycles >= pace_next_cycles) {
+      pace();
+    }
+
+    // Deliver any pending interrupts
+    cpu->check_interrupts();
+
+    if (cpu->is_halted()) {
+      skip_halt();
+      executed++;
+      continue;
+    }
+
+    // Whole iterations of a recognized loop, up to the next event
+    if (loop_idioms) {
+      int n = loop_idioms->run(cpu, cpu->regs.PC.get_pair16(), max_instructions - executed,
+                               next_event_cycles());
+      if (n > 0) {
+        executed += n;
+        continue;
+      }
+    }
+
+    // Run a compiled block if one starts here
+    if (aot) {
+      int n = aot->run(cpu, cpu->regs.PC.get_pair16(), max_instructions - executed);
+      if (n > 0) {
+        executed += n;
+        continue;
+      }
+    }
+
+    // Execute one instruction
+    cpu->execute();
+    executed++;
+  }
+
+  instruction_count += executed;
+  return status;
+}
+
+// HALT waits for an interrupt, so move the cycle counter straight to the
+// next event that can raise one. With no interrupt source, or interrupts
+// disabled, the HALT is passed over as before.
+void CPMEmulator::skip_halt() {
+  unsigned long long wake = CPM_NO_EVENT;
+  if (int_cycles > 0) wake = next_tick_cycles;
+  if (peripherals && peripherals->next_event < wake) wake = peripherals->next_event;
+
+  if (wake == CPM_NO_EVENT || !cpu->regs.IFF1) {
+    cpu->clear_halted();
+    return;
+  }
+  if (wake > cpu->cycles) cpu->cycles = wake;
+}
+
+// Cycle count at which run() must next look at the timer, peripherals or
+// pacing
+unsigned long long CPMEmulator::next_event_cycles() const {
+  unsigned long long next = pace_next_cycles;
+  if (int_cycles > 0 && next_tick_cycles < next) next = next_tick_cycles;
+  if (peripherals && peripherals->next_event < next) next = peripherals->next_event;
+  return next;
+}
+
+// Check for ^C and handle exit logic
+// Returns true if we should exit, false if character should be passed through
+bool CPMEmulator::check_ctrl_c_exit(int ch) {
+  if (ch == 0x03) {  // ^C
+    consecutive_ctrl_c++;
+    if (consecutive_ctrl_c >= CTRL_C_EXIT_COUNT) {
+      fprintf(stderr, "\n[Exiting: %d consecutive ^C received]\n", CTRL_C_EXIT_COUNT);
+      request_exit(0);
+      return true;
+    }
+    return false;  // Pass ^C through to CP/M program
+  } else {
+    consecutive_ctrl_c = 0;  // Reset counter on any other input
+    return false;
+  }
+}
+
+// When parking is enabled, a console read with no input pending is not
+// performed; the trap is left in place and retried once input arrives
+bool CPMEmulator::input_would_block() {
+  if (park_on_input && !console_ready()) {
+    input_wait = WAIT_RETRY;
+    return true;
+  }
+  return false;
+}
+
+// Track console status polls so a guest spinning on CONST can be parked,
+// or, for a single instance, put to sleep until input arrives
+void CPMEmulator::note_console_poll(bool ready) {
+  unsigned long long since = cpu->cycles - last_poll_cycles;
+  last_poll_cycles = cpu->cycles;
+  if (ready || since > IDLE_POLL_CYCLES) {
+    idle_polls = 0;
+    return;
+  }
+  if (++idle_polls < IDLE_POLL_LIMIT) {
+    return;
+  }
+
+  idle_polls = 0;
+  if (park_on_input) {
+    input_wait = WAIT_IDLE;
+  } else {
+    console_idle(IDLE_WAIT_MS);
+  }
+}
+
+void CPMEmulator::set_clock_rate(double hz) {
+  pace_hz = hz;
+  if (hz <= 0) {
+    pace_next_cycles = ~0ULL;
+    return;
+  }
+  pace_batch_cycles = (unsigned long long)(hz * PACE_BATCH_USEC / 1000000);
+  if (pace_batch_cycles < 1) pace_batch_cycles = 1;
+  pace_anchor_cycles = cpu->cycles;
+  pace_anchor_usec = platform::monotonic_usec();
+  pace_next_cycles = cpu->cycles + pace_batch_cycles;
+}
+
+// Sleep until real time catches up with the cycles executed. Time is
+// measured from a fixed anchor, so rounding in individual sleeps never
+// accumulates into drift.
+void CPMEmulator::pace() {
+  uint64_t now = platform::monotonic_usec();
+  double elapsed = (double)(cpu->cycles - pace_anchor_cycles) * 1000000.0 / pace_hz;
+  uint64_t due = pace_anchor_usec + (uint64_t)elapsed;
+
+  if (due > now) {
+    platform::sleep_usec(due - now);
+  } else if (now - due > PACE_MAX_LAG_USEC) {
+    // Host was too slow or the guest was blocked on input: restart from
+    // here instead of running flat out to catch up
+    pace_anchor_cycles = cpu->cycles;
+    pace_anchor_usec = now;
+  }
+  pace_next_cycles = cpu->cycles + pace_batch_cycles;
+}
+
+void CPMEmulator::console_out(qkz80_uint8 ch) {
+  if (terminal) {
+    terminal->write(ch);
+    return;
+  }
+  putchar(ch);
+}
+
+// With a screen model, flushes and status polls draw frames at its rate,
+// and anything still pending is drawn before waiting for input
+void CPMEmulator::console_flush() {
+  if (terminal) {
+    terminal->update();
+    return;
+  }
+  fflush(stdout);
+}
+
+int CPMEmulator::console_in() {
+  if (terminal) terminal->present();
+  return platform::console_getchar();
+}
+
+bool CPMEmulator::console_ready() {
+  if (terminal) terminal->update();
+  return platform::stdin_has_data();
+}
+
+void CPMEmulator::console_idle(int ms) {
+  if (terminal) terminal->present();
+  platform::stdin_wait(ms);
+}
+
+void CPMEmulator::list_out(qkz80_uint8 ch) {
+  if (printer_file) {
+    fputc(ch, printer_file);
+    fflush(printer_file);
+  } else {
+    // No printer file - output to stdout with prefix
+    fprintf(stdout, "[PRINTER] %c", ch);
+    fflush(stdout);
+  }
+}
+
+void CPMEmulator::setup_memory() {
+  qkz80_uint8* mem = cpu->get_mem();
+
+  // Setup jump at 0x0000 to WBOOT (warm boot)
+  mem[0x0000] = 0xC3;  // JMP opcode
+  mem[0x0001] = (BIOS_BASE + BIOS_WBOOT) & 0xFF;
+  mem[0x0002] = ((BIOS_BASE + BIOS_WBOOT) >> 8) & 0xFF;
+
+  // IOBYTE
+  mem[IOBYTE_ADDR] = 0x00;
+
+  // Current drive and user (drive 0 = A:, user 0)
+  mem[DRVUSER_ADDR] = 0x00;
+
+  // Setup jump at 0x0005 to BDOS
+  mem[BDOS_ENTRY] = 0xC3;  // JMP opcode
+  mem[BDOS_ENTRY + 1] = BDOS_BASE & 0xFF;
+  mem[BDOS_ENTRY + 2] = (BDOS_BASE >> 8) & 0xFF;
+
+  // Setup BIOS jump table at BIOS_BASE
+  // Each BIOS function is a 3-byte JMP to a magic address
+  // We'll use addresses starting at 0xFF00 for BIOS traps
+  qkz80_uint16 bios_magic = 0xFF00;
+  for (int i = 0; i < 17; i++) {
+    qkz80_uint16 addr = BIOS_BASE + (i * 3);
+    mem[addr] = 0xC3;  // JMP opcode
+    mem[addr + 1] = (bios_magic + i) & 0xFF;
+    mem[addr + 2] = ((bios_magic + i) >> 8) & 0xFF;
+  }
+
+  // Initialize DMA to default
+  current_dma = DEFAULT_DMA;
+
+  // Clear default FCBs
+  memset(&mem[DEFAULT_FCB], 0, 36);
+  memset(&mem[DEFAULT_FCB2], 0, 20);
+
+  // Initialize Disk Parameter Header (DPH) - 16 bytes
+  // This is what BIOS SELDSK returns a pointer to
+  uint8_t* dph = (uint8_t*)&mem[DPH_ADDR];
+  dph[0] = 0x00; dph[1] = 0x00;  // XLT - no sector translation
+  dph[2] = 0x00; dph[3] = 0x00;  // Scratch area (BDOS workspace)
+  dph[4] = 0x00; dph[5] = 0x00;
+  dph[6] = 0x00; dph[7] = 0x00;
+  dph[8] = DIRBUF_ADDR & 0xFF;          // DIRBUF low
+  dph[9] = (DIRBUF_ADDR >> 8) & 0xFF;   // DIRBUF high
+  dph[10] = DPB_ADDR & 0xFF;            // DPB low
+  dph[11] = (DPB_ADDR >> 8) & 0xFF;     // DPB high
+  dph[12] = CSV_ADDR & 0xFF;            // CSV low
+  dph[13] = (CSV_ADDR >> 8) & 0xFF;     // CSV high
+  dph[14] = ALV_ADDR & 0xFF;            // ALV low
+  dph[15] = (ALV_ADDR >> 8) & 0xFF;     // ALV high
+
+  // Initialize Disk Parameter Block (DPB) for a simulated 8MB drive
+  // This is a standard CP/M 2.2 DPB structure
+  // Format: SPT, BSH, BLM, EXM, DSM, DRM, AL0, AL1, CKS, OFF
+  uint8_t* dpb = (uint8_t*)&mem[DPB_ADDR];
+  dpb[0] = 128;  // SPT - sectors per track (low byte)
+  dpb[1] = 0;    // SPT high byte
+  dpb[2] = 4;    // BSH - block shift factor (2KB blocks = 2^(7+4) = 2048)
+  dpb[3] = 15;   // BLM - block mask (2^BSH - 1 = 15)
+  dpb[4] = 0;    // EXM - extent mask
+  dpb[5] = 0xFF; // DSM - max block number (low) - 4095 blocks = ~8MB
+  dpb[6] = 0x0F; // DSM high byte
+  dpb[7] = 0xFF; // DRM - max directory entry (low) - 1024 entries
+  dpb[8] = 0x03; // DRM high byte
+  dpb[9] = 0xFF; // AL0 - allocation bitmap for directory
+  dpb[10] = 0x00; // AL1
+  dpb[11] = 0x00; // CKS - check vector size (low) - no removable media
+  dpb[12] = 0x00; // CKS high byte
+  dpb[13] = 0x00; // OFF - track offset (low)
+  dpb[14] = 0x00; // OFF high byte
+
+  // Initialize directory buffer
+  memset(&mem[DIRBUF_ADDR], 0xE5, 128);  // Empty directory entries
+
+  // Initialize allocation vector - mark everything as free
+  // Each bit represents one block, 0=free, 1=allocated
+  // For 4096 blocks we need 512 bytes, but we'll just init first 64
+  memset(&mem[ALV_ADDR], 0x00, 64);  // All blocks free
+
+  // Set stack pointer
+  cpu->regs.SP.set_pair16(0xFFF0);
+}
+
+void CPMEmulator::setup_command_line(int argc, char** argv, int program_arg_index) {
+  qkz80_uint8* mem = cpu->get_mem();
+
+  if (argc < program_arg_index + 1) {
+    mem[DEFAULT_DMA] = 0;  // No command line
+    return;
+  }
+
+  // Build command line from arguments
+  // CP/M requires a leading space before the first argument
+  // Also, filenames must be in 8.3 format (truncated if needed)
+  std::string cmdline;
+  for (int i = program_arg_index + 1; i < argc; i++) {  // Skip program name and any switches
+    cmdline += " ";  // Space before each argument (CP/M convention)
+
+    // Get basename and convert to 8.3 format
+    const char* arg_base = strrchr(argv[i], '/');
+    arg_base = arg_base ? arg_base + 1 : argv[i];
+    std::string arg_upper;
+    for (const char* p = arg_base; *p; p++) {
+      arg_upper += toupper(*p);
+    }
+
+    // Truncate to 8.3 format for command line
+    size_t dot_pos = arg_upper.find('.');
+    if (dot_pos != std::string::npos && dot_pos > 8) {
+      // Long filename - truncate to 8.3
+      std::string name_83 = arg_upper.substr(0, 8) + arg_upper.substr(dot_pos);
+      cmdline += name_83;
+    } else {
+      cmdline += arg_upper;
+    }
+
+    args.push_back(argv[i]);
+  }
+
+  // Store command line at DEFAULT_DMA
+  mem[DEFAULT_DMA] = std::min((int)cmdline.length(), 127);
+  for (size_t i = 0; i < cmdline.length() && i < 127; i++) {
+    mem[DEFAULT_DMA + 1 + i] = toupper(cmdline[i]);
+  }
+
+
+  // Parse first filename into DEFAULT_FCB
+  if (argc >= program_arg_index + 2) {
+    filename_to_fcb(argv[program_arg_index + 1], DEFAULT_FCB);
+  }
+
+  // Parse second filename into DEFAULT_FCB2
+  if (argc >= program_arg_index + 3) {
+    filename_to_fcb(argv[program_arg_index + 2], DEFAULT_FCB2);
+  }
+}
+
+void CPMEmulator::add_file_mapping(const std::string& cpm_name, const std::string& unix_path) {
+  std::string normalized = normalize_cpm_filename(cpm_name);
+  file_map[normalized] = unix_path;
+
+  if (debug) {
+    fprintf(stderr, "File mapping: '%s' -> '%s'\n", normalized.c_str(), unix_path.c_str());
+  }
+}
+
+void CPMEmulator::add_file_mapping_ex(const std::string& cpm_pattern, const std::string& unix_pattern,
+                                      FileMode mode, bool eol_convert) {
+  FileMapping mapping;
+  mapping.cpm_pattern = normalize_cpm_filename(cpm_pattern);
+  mapping.unix_pattern = unix_pattern;
+  mapping.mode = mode;
+  mapping.eol_convert = eol_convert;
+  file_mappings.push_back(mapping);
+
+  if (debug) {
+    fprintf(stderr, "File mapping: '%s' -> '%s' (mode: %s, eol: %s)\n",
+            mapping.cpm_pattern.c_str(), unix_pattern.c_str(),
+            mode == MODE_TEXT ? "text" : mode == MODE_BINARY ? "binary" : "auto",
+            eol_convert ? "yes" : "no");
+  }
+}
+
+FileMode CPMEmulator::detect_file_mode(const std::string& filename, const std::string& unix_path) {
+  // Check extension
+  std::string upper = filename;
+  for (char& c : upper) c = toupper(c);
+
+  // Known text extensions
+  const char* text_exts[] = {".BAS", ".MAC", ".ASM", ".TXT", ".DOC", ".LST", ".PRN", nullptr};
+  for (int i = 0; text_exts[i]; i++) {
+    if (upper.find(text_exts[i]) != std::string::npos) {
+      return MODE_TEXT;
+    }
+  }
+
+  // Known binary extensions
+  const char* binary_exts[] = {".COM", ".EXE", ".OVL", ".OVR", ".SYS", ".BIN", ".DAT",
+                               ".SPR", ".REL", ".PRL", ".RSP", nullptr};
+  for (int i = 0; binary_exts[i]; i++) {
+    if (upper.find(binary_exts[i]) != std::string::npos) {
+      return MODE_BINARY;
+    }
+  }
+
+  // Default to binary for unknown extensions - safer than heuristic detection
+  // which can misidentify binary files with low control char counts
+  return MODE_BINARY;
+}
+
+bool CPMEmulator::match_pattern(const std::string& pattern, const std::string& text) {
+  // Simple wildcard matching (case-insensitive)
+  std::string pat_upper = pattern;
+  std::string text_upper = text;
+  for (char& c : pat_upper) c = toupper(c);
+  for (char& c : text_upper) c = toupper(c);
+
+  // Simple implementation - just check for exact match or * wildcard
+  if (pat_upper == text_upper) return true;
+  if (pat_upper == "*" || pat_upper == "*.*") return true;
+
+  // Check for *.EXT pattern
+  if (pat_upper[0] == '*' && pat_upper.find('.') != std::string::npos) {
+    size_t dot = text_upper.find('.');
+    if (dot != std::string::npos) {
+      std::string text_ext = text_upper.substr(dot);
+      std::string pat_ext = pat_upper.substr(pat_upper.find('.'));
+      return text_ext == pat_ext;
+    }
+  }
+
+  return false;
+}
+
+std::string CPMEmulator::find_unix_file_ex(const std::string& cpm_name, FileMode* mode_out, bool* eol_out) {
+  std::string normalized = normalize_cpm_filename(cpm_name);
+
+  // Check new file mappings with patterns
+  for (const auto& mapping : file_mappings) {
+    if (match_pattern(mapping.cpm_pattern, normalized)) {
+      if (platform::get_file_type(mapping.unix_pattern.c_str()) != platform::FileType::NotFound) {
+        *mode_out = mapping.mode;
+        *eol_out = mapping.eol_convert;
+
+        // Auto-detect if needed
+        if (*mode_out == MODE_AUTO) {
+          *mode_out = detect_file_mode(normalized, mapping.unix_pattern);
+        }
+
+        return mapping.unix_pattern;
+      }
+    }
+  }
+
+  // Check legacy file map
+  auto it = file_map.find(normalized);
+  if (it != file_map.end()) {
+    *mode_out = detect_file_mode(normalized, it->second);
+    *eol_out = default_eol_convert;
+    return it->second;
+  }
+
+  // Try lowercase version in current directory
+  std::string lowercase;
+  for (char c : normalized) {
+    lowercase += tolower(c);
+  }
+
+  if (platform::get_file_type(lowercase.c_str()) != platform::FileType::NotFound) {
+    *mode_out = detect_file_mode(normalized, lowercase);
+    *eol_out = default_eol_convert;
+    return lowercase;
+  }
+
+  // Try as-is
+  if (platform::get_file_type(normalized.c_str()) != platform::FileType::NotFound) {
+    *mode_out = detect_file_mode(normalized, normalized);
+    *eol_out = default_eol_convert;
+    return normalized;
+  }
+
+  return "";  // Not found
+}
+
+size_t CPMEmulator::read_with_conversion(OpenFile& of, uint8_t* buffer, size_t size) {
+  if (of.eof_seen) {
+    return 0;
+  }
+
+  if (of.mode == MODE_BINARY || !of.eol_convert || of.text_view) {
+    // Binary mode, no conversion or already converted - read directly
+    size_t nread = fread(buffer, 1, size, of.fp);
+
+    // Check for ^Z EOF in text mode. A text view already ends at the
+    // first ^Z, and the ^Z padding its last record is part of that record.
+    if (of.mode == MODE_TEXT && !of.text_view) {
+      for (size_t i = 0; i < nread; i++) {
+        if (buffer[i] == CPM_EOF) {
+          of.eof_seen = true;
+          return i;  // Return only data up to ^Z
+        }
+      }
+    }
+
+    return nread;
+  }
+
+  // Text mode with EOL conversion: Unix \n -> CP/M \r\n
+  size_t out_pos = 0;
+
+  while (out_pos < size) {
+    int ch = fgetc(of.fp);
+
+    if (ch == EOF) {
+      break;
+    }
+
+    if (ch == '\n') {
+      // Convert \n to \r\n
+      if (out_pos + 1 < size) {
+        buffer[out_pos++] = '\r';
+        buffer[out_pos++] = '\n';
+      } else {
+        // Not enough space, put back
+        ungetc(ch, of.fp);
+        break;
+      }
+    } else if (ch == CPM_EOF) {
+      // EOF marker
+      of.eof_seen = true;
+      break;
+    } else {
+      buffer[out_pos++] = (uint8_t)ch;
+    }
+  }
+
+  return out_pos;
+}
+
+int64_t CPMEmulator::text_file_size(const std::string& unix_path) {
+  CPMFileCache::Content view;
+  if (file_cache && (view = file_cache->get_text(unix_path))) {
+    return (int64_t)view->size();
+  }
+
+  // Too large for the cache, or no cache: count what read_with_conversion()
+  // would return without keeping a copy
+  FILE* fp = fopen(unix_path.c_str(), "rb");
+  if (!fp) {
+    return -1;
+  }
+  int64_t size = 0;
+  uint8_t chunk[4096];
+  size_t n;
+  bool eof = false;
+  while (!eof && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      if (chunk[i] == CPM_EOF) {
+        eof = true;
+        break;
+      }
+      size += chunk[i] == '\n' ? 2 : 1;
+    }
+  }
+  fclose(fp);
+  return size;
+}
+
+size_t CPMEmulator::write_with_conversion(OpenFile& of, const uint8_t* buffer, size_t size) {
+  if (of.mode == MODE_BINARY || !of.eol_convert) {
+    // Binary mode - write directly
+    return fwrite(buffer, 1, size, of.fp);
+  }
+
+  // Text mode with EOL conversion: CP/M \r\n -> Unix \n
+  size_t written = 0;
+
+  for (size_t i = 0; i < size; i++) {
+    uint8_t ch = buffer[i];
+
+    if (ch == CPM_EOF) {
+      // Stop at ^Z in text files
+      break;
+    }
+
+    if (ch == '\r') {
+      // Skip \r if next char is \n
+      if (i + 1 < size && buffer[i + 1] == '\n') {
+        continue;  // Skip the \r
+      }
+      // Otherwise write it
+      if (fputc(ch, of.fp) == EOF) break;
+      written++;
+    } else {
+      if (fputc(ch, of.fp) == EOF) break;
+      written++;
+    }
+  }
+
+  fflush(of.fp);
+  return written;
+}
+
+size_t CPMEmulator::dma_read(OpenFile& of, qkz80_uint16 addr, size_t size, bool convert) {
+  qkz80_uint8* mem = cpu->get_mem();
+
+  // Common case: read straight into guest memory
+  if (addr + size <= 0x10000) {
+    return convert ? read_with_conversion(of, &mem[addr], size)
+                   : fread(&mem[addr], 1, size, of.fp);
+  }
+
+  std::vector<uint8_t> buffer(size);
+  size_t nread = convert ? read_with_conversion(of, buffer.data(), size)
+                         : fread(buffer.data(), 1, size, of.fp);
+  for (size_t i = 0; i < nread; i++) {
+    mem[(qkz80_uint16)(addr + i)] = buffer[i];
+  }
+  return nread;
+}
+
+size_t CPMEmulator::dma_write(OpenFile& of, qkz80_uint16 addr, size_t size, bool convert) {
+  qkz80_uint8* mem = cpu->get_mem();
+
+  if (addr + size <= 0x10000) {
+    return convert ? write_with_conversion(of, &mem[addr], size)
+                   : fwrite(&mem[addr], 1, size, of.fp);
+  }
+
+  std::vector<uint8_t> buffer(size);
+  for (size_t i = 0; i < size; i++) {
+    buffer[i] = mem[(qkz80_uint16)(addr + i)];
+  }
+  return convert ? write_with_conversion(of, buffer.data(), size)
+                 : fwrite(buffer.data(), 1, size, of.fp);
+}
+
+void CPMEmulator::dma_fill(qkz80_uint16 addr, qkz80_uint8 value, size_t size) {
+  qkz80_uint8* mem = cpu->get_mem();
+  for (size_t i = 0; i < size; i++) {
+    mem[(qkz80_uint16)(addr + i)] = value;
+  }
+}
+
+// Return code for a file transfer. With a multi-sector count set, CP/M 3
+// also reports in H how many records were transferred before an error.
+void CPMEmulator::set_transfer_result(qkz80_uint8 code, unsigned records) {
+  cpu->set_reg8(code, qkz80::reg_A);
+  if (multi_sector_count > 1) {
+    cpu->set_reg8(code ? records : 0, qkz80::reg_H);
+  }
+}
+
+// Position the stream, skipping the seek when it is already there
+bool CPMEmulator::file_seek(OpenFile& of, long pos) {
+  if (of.host_pos == pos) {
+    return true;
+  }
+  if (fseek(of.fp, pos, SEEK_SET) != 0) {
+    of.host_pos = -1;
+    return false;
+  }
+  of.host_pos = pos;
+  return true;
+}
+
+bool CPMEmulator::flush_random_writes(OpenFile& of) {
+  if (of.write_batch.empty()) {
+    return true;
+  }
+
+  bool ok = file_seek(of, of.batch_pos);
+  if (ok) {
+    size_t n = fwrite(of.write_batch.data(), 1, of.write_batch.size(), of.fp);
+    ok = (n == of.write_batch.size()) && fflush(of.fp) == 0;
+    of.host_pos = ok ? of.batch_pos + (long)n : -1;
+  }
+  if (!ok) {
+    fprintf(stderr, "Write error on %s\n", of.cpm_name.c_str());
+    of.write_error = true;
+  }
+  of.write_batch.clear();
+  return ok;
+}
+
+// Batches are also flushed for other FCBs' calls, so the guest learns of
+// a failure from the next call on the FCB that wrote the data
+bool CPMEmulator::take_write_error(OpenFile& of) {
+  bool failed = of.write_error;
+  of.write_error = false;
+  return failed;
+}
+
+void CPMEmulator::flush_all_random_writes() {
+  for (auto& pair : open_files) {
+    flush_random_writes(pair.second);
+  }
+}
+
+// Sequential calls use the stdio position directly, so put it where the
+// last random call left off and forget what we know about it
+bool CPMEmulator::begin_stream_io(OpenFile& of, bool writing) {
+  if (!ensure_open(of, writing)) {
+    return false;
+  }
+  flush_random_writes(of);
+  if (take_write_error(of)) {
+    return false;
+  }
+  if (of.logical_pos >= 0) {
+    file_seek(of, of.logical_pos);
+    of.logical_pos = -1;
+  }
+  of.host_pos = -1;
+  if (writing) {
+    of.window.clear();
+  }
+  return true;
+}
+
+// Returns false if data written through the handle did not reach the file
+bool CPMEmulator::close_open_file(OpenFile& of) {
+  if (!of.fp) {
+    return !take_write_error(of);  // Evicted: nothing else was pending
+  }
+  flush_random_writes(of);
+  // Flush any pending writes
+  if (of.write_mode && of.write_buffer.size() > 0) {
+    write_with_conversion(of, of.write_buffer.data(), of.write_buffer.size());
+  }
+  bool ok = fclose(of.fp) == 0;
+  of.fp = nullptr;
+  if (of.pooled) {
+    handle_lru.erase(of.lru_pos);
+    of.pooled = false;
+  }
+  return !take_write_error(of) && ok;
+}
+
+void CPMEmulator::add_open_file(qkz80_uint16 fcb_addr, const OpenFile& of) {
+  // Reopening through the same FCB replaces the old stream
+  auto old = open_files.find(fcb_addr);
+  if (old != open_files.end()) {
+    close_open_file(old->second);
+  }
+  OpenFile& entry = open_files[fcb_addr];
+  entry = of;
+  entry.pooled = false;
+  touch_handle(entry);
+}
+
+// Mark a handle most recently used, closing the oldest if over the limit
+void CPMEmulator::touch_handle(OpenFile& of) {
+  if (of.pooled) {
+    handle_lru.splice(handle_lru.begin(), handle_lru, of.lru_pos);
+  } else {
+    handle_lru.push_front(&of);
+    of.lru_pos = handle_lru.begin();
+    of.pooled = true;
+  }
+
+  while (handle_lru.size() > std::max(max_host_files, (size_t)1)) {
+    evict_handle(*handle_lru.back());
+  }
+}
+
+void CPMEmulator::evict_handle(OpenFile& of) {
+  flush_random_writes(of);
+  if (of.write_mode && of.write_buffer.size() > 0) {
+    write_with_conversion(of, of.write_buffer.data(), of.write_buffer.size());
+    of.write_buffer.clear();
+  }
+
+  // Remember where the next call would continue
+  if (of.logical_pos >= 0) {
+    of.saved_pos = of.logical_pos;
+    of.logical_pos = -1;
+  } else {
+    of.saved_pos = ftell(of.fp);
+  }
+
+  if (debug) {
+    fprintf(stderr, "Evicting host handle for %s at offset %ld\n",
+            of.cpm_name.c_str(), of.saved_pos);
+  }
+  fclose(of.fp);
+  of.fp = nullptr;
+  of.host_pos = -1;
+  handle_lru.erase(of.lru_pos);
+  of.pooled = false;
+}
+
+// Reopen an evicted handle at its saved offset
+bool CPMEmulator::ensure_open(OpenFile& of, bool writing) {
+  if (writing && !of.modified) {
+    of.modified = true;
+    if (file_cache) file_cache->invalidate(of.unix_path);
+
+    // Every open of a cached file moves to a host handle at the same
+    // offset, so the others see this write too. Text views go back to
+    // converting on the fly from the matching host offset.
+    for (auto& pair : open_files) {
+      OpenFile& other = pair.second;
+      if (other.cache_data && other.unix_path == of.unix_path) {
+        if (other.fp) evict_handle(other);
+        if (other.text_view) {
+          other.saved_pos = CPMFileCache::host_offset(*other.cache_data, other.saved_pos);
+          other.window.clear();
+          other.last_random_pos = -1;
+          other.text_view = false;
+        }
+        other.cache_data.reset();
+      }
+    }
+  }
+
+  if (!of.fp) {
+    if (of.cache_data) {
+      of.fp = platform::open_memory_stream(of.cache_data->data(), of.cache_data->size());
+    } else {
+      of.fp = fopen(of.unix_path.c_str(), of.writable ? "r+b" : "rb");
+      if (!of.fp && of.writable && errno == EACCES) {
+        // Opened from the cache without knowing it is read-only
+        of.writable = false;
+        of.fp = fopen(of.unix_path.c_str(), "rb");
+      }
+    }
+    if (!of.fp) {
+      fprintf(stderr, "Cannot reopen %s: %s\n", of.unix_path.c_str(), strerror(errno));
+      return false;
+    }
+    if (of.saved_pos > 0 && fseek(of.fp, of.saved_pos, SEEK_SET) != 0) {
+      fclose(of.fp);
+      of.fp = nullptr;
+      return false;
+    }
+    of.host_pos = of.saved_pos;
+  }
+  touch_handle(of);
+  return true;
+}
+
+bool CPMEmulator::random_read(OpenFile& of, long pos, qkz80_uint16 dma, size_t size,
+                              size_t* nread) {
+  if (!ensure_open(of) || take_write_error(of)) {
+    return false;
+  }
+
+  // Track the distance between reads to spot sequential or strided access
+  long step = (of.last_random_pos >= 0) ? pos - of.last_random_pos : 0;
+  if (step > 0 && step == of.stride) {
+    of.stride_hits++;
+  } else {
+    of.stride = step;
+    of.stride_hits = 0;
+  }
+  of.last_random_pos = pos;
+
+  // Pending writes in the range must reach the file before it is read
+  long window_len = of.stride * PREFETCH_STRIDES;
+  bool prefetch = of.stride_hits > 0 && of.stride * 2 <= PREFETCH_MAX;
+  long read_end = pos + (prefetch ? std::max(std::min(window_len, PREFETCH_MAX), (long)size) : (long)size);
+  if (!of.write_batch.empty() && of.batch_pos < read_end &&
+      pos < of.batch_pos + (long)of.write_batch.size()) {
+    if (!flush_random_writes(of)) {
+      take_write_error(of);
+      return false;
+    }
+  }
+
+  long window_end = of.window_pos + (long)of.window.size();
+  bool in_window = pos >= of.window_pos && pos < window_end &&
+                   (pos + (long)size <= window_end || of.window_eof);
+
+  if (!in_window && prefetch) {
+    // Read ahead enough to cover the next strides
+    size_t len = (size_t)(read_end - pos);
+    if (!file_seek(of, pos)) {
+      return false;
+    }
+    of.window.resize(len);
+    size_t n = fread(of.window.data(), 1, len, of.fp);
+    of.window.resize(n);
+    of.window_pos = pos;
+    of.window_eof = n < len;
+    of.host_pos = pos + (long)n;
+    in_window = n > 0;
+    if (!in_window) {
+      *nread = 0;
+      of.logical_pos = -1;
+      return true;
+    }
+  }
+
+  if (in_window) {
+    size_t avail = (size_t)(of.window_pos + (long)of.window.size() - pos);
+    size_t n = std::min(avail, size);
+    const uint8_t* src = &of.window[pos - of.window_pos];
+    qkz80_uint8* mem = cpu->get_mem();
+    if (dma + n <= 0x10000) {
+      memcpy(&mem[dma], src, n);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        mem[(qkz80_uint16)(dma + i)] = src[i];
+      }
+    }
+    *nread = n;
+    of.logical_pos = pos + (long)n;
+    return true;
+  }
+
+  // No pattern yet: read straight into guest memory
+  if (!file_seek(of, pos)) {
+    return false;
+  }
+  *nread = dma_read(of, dma, size, false);
+  of.host_pos = pos + (long)*nread;
+  of.logical_pos = -1;
+  return true;
+}
+
+bool CPMEmulator::random_write(OpenFile& of, long pos, qkz80_uint16 dma, size_t size) {
+  if (!ensure_open(of, true) || take_write_error(of)) {
+    return false;
+  }
+  qkz80_uint8* mem = cpu->get_mem();
+
+  // Batch writes that continue the previous one
+  if (of.write_batch.empty() ||
+      pos != of.batch_pos + (long)of.write_batch.size() ||
+      of.write_batch.size() + size > WRITE_BATCH_MAX) {
+    if (!flush_random_writes(of)) {
+      take_write_error(of);
+      return false;
+    }
+    of.batch_pos = pos;
+  }
+
+  // Keep the prefetch window coherent with what is being written
+  long window_end = of.window_pos + (long)of.window.size();
+  if (pos + (long)size > window_end && of.window_eof) {
+    of.window.clear();  // File grows past what the window knows about
+  } else {
+    for (size_t i = 0; i < size; i++) {
+      long off = pos + (long)i;
+      if (off >= of.window_pos && off < window_end) {
+        of.window[off - of.window_pos] = mem[(qkz80_uint16)(dma + i)];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    of.write_batch.push_back(mem[(qkz80_uint16)(dma + i)]);
+  }
+  of.logical_pos = pos + (long)size;
+  return true;
+}
+
+bool CPMEmulator::load_config_file(const std::string& cfg_path) {
+  std::ifstream cfg(cfg_path.c_str());
+  if (!cfg.is_open()) {
+    fprintf(stderr, "Cannot open config file: %s\n", cfg_path.c_str());
+    return false;
+  }
+
+  std::string line;
+  int line_num = 0;
+
+  while (std::getline(cfg, line)) {
+    line_num++;
+
+    // Remove comments
+    size_t comment = line.find('#');
+    if (comment != std::string::npos) {
+      line = line.substr(0, comment);
+    }
+
+    // Trim whitespace
+    size_t start = line.find_first_not_of(" \t\r\n");
+    size_t end = line.find_last_not_of(" \t\r\n");
+    if (start == std::string::npos) continue;  // Empty line
+    line = line.substr(start, end - start + 1);
+
+    // Parse key = value
+    size_t eq = line.find('=');
+    if (eq == std::string::npos) {
+      fprintf(stderr, "Config line %d: invalid format (missing =)\n", line_num);
+      continue;
+    }
+
+    std::string key = line.substr(0, eq);
+    std::string value = line.substr(eq + 1);
+
+    // Trim key and value
+    key = key.substr(0, key.find_last_not_of(" \t") + 1);
+    key = key.substr(key.find_first_not_of(" \t"));
+    value = value.substr(value.find_first_not_of(" \t"));
+    value = value.substr(0, value.find_last_not_of(" \t") + 1);
+
+    // Expand environment variables in value
+    value = expand_env_vars(value);
+
+    // Parse configuration directives
+    if (key == "program") {
+      // Store program name for retrieval by main()
+      config_program = value;
+    } else if (key == "cd" || key == "chdir") {
+      // Change working directory
+      if (platform::change_directory(value.c_str()) != 0) {
+        fprintf(stderr, "Config line %d: Cannot change directory to '%s': %s\n",
+                line_num, value.c_str(), strerror(errno));
+      } else if (debug) {
+        fprintf(stderr, "Changed directory to: %s\n", value.c_str());
+      }
+    } else if (key == "default_mode") {
+      if (value == "text") default_mode = MODE_TEXT;
+      else if (value == "binary") default_mode = MODE_BINARY;
+      else default_mode = MODE_AUTO;
+    } else if (key == "debug") {
+      debug = (value == "true" || value == "1" || value == "yes");
+    } else if (key == "eol_convert") {
+      default_eol_convert = (value == "true" || value == "1" || value == "yes");
+    } else if (key == "printer") {
+      set_printer_file(value);
+    } else if (key == "aux_input") {
+      set_aux_input_file(value);
+    } else if (key == "aux_output") {
+      set_aux_output_file(value);
+    } else {
+      // Assume it's a file mapping: pattern = path [mode]
+      FileMode mode = default_mode;
+      bool eol_convert = default_eol_convert;
+
+      // Check for mode specification
+      size_t space = value.find_last_of(' ');
+      if (space != std::string::npos) {
+        std::string mode_str = value.substr(space + 1);
+        if (mode_str == "text") {
+          mode = MODE_TEXT;
+          value = value.substr(0, space);
+        } else if (mode_str == "binary") {
+          mode = MODE_BINARY;
+          value = value.substr(0, space);
+          eol_convert = false;
+        }
+      }
+
+      add_file_mapping_ex(key, value, mode, eol_convert);
+    }
+  }
+
+  return true;
+}
+
+void CPMEmulator::set_printer_file(const std::string& path) {
+  if (printer_file) fclose(printer_file);
+  printer_file = fopen(path.c_str(), "w");
+  if (!printer_file) {
+    fprintf(stderr, "Warning: Cannot open printer file '%s': %s\n",
+            path.c_str(), strerror(errno));
+  } else if (debug) {
+    fprintf(stderr, "Printer output redirected to: %s\n", path.c_str());
+  }
+}
+
+void CPMEmulator::set_aux_input_file(const std::string& path) {
+  if (aux_in_file) fclose(aux_in_file);
+  aux_in_file = fopen(path.c_str(), "r");
+  if (!aux_in_file) {
+    fprintf(stderr, "Warning: Cannot open aux input file '%s': %s\n",
+            path.c_str(), strerror(errno));
+  } else if (debug) {
+    fprintf(stderr, "Auxiliary input redirected from: %s\n", path.c_str());
+  }
+}
+
+void CPMEmulator::set_aux_output_file(const std::string& path) {
+  if (aux_out_file) fclose(aux_out_file);
+  aux_out_file = fopen(path.c_str(), "w");
+  if (!aux_out_file) {
+    fprintf(stderr, "Warning: Cannot open aux output file '%s': %s\n",
+            path.c_str(), strerror(errno));
+  } else if (debug) {
+    fprintf(stderr, "Auxiliary output redirected to: %s\n", path.c_str());
+  }
+}
+
+std::string CPMEmulator::normalize_cpm_filename(const std::string& name) {
+  std::string result;
+
+  // Convert to uppercase and trim
+  for (char c : name) {
+    if (c != ' ') {
+      result += toupper(c);
+    }
+  }
+
+  return result;
+}
+
+std::string CPMEmulator::fcb_to_filename(qkz80_uint16 fcb_addr) {
+  qkz80_uint8* mem = cpu->get_mem();
+  std::string filename;
+
+  // Extract name (8 chars)
+  for (int i = 0; i < 8; i++) {
+    char c = mem[fcb_addr + 1 + i] & 0x7F;  // Strip high bit
+    if (c != ' ') {
+      filename += c;
+    }
+  }
+
+  // Check for extension
+  bool has_ext = false;
+  for (int i = 0; i < 3; i++) {
+    if ((mem[fcb_addr + 9 + i] & 0x7F) != ' ') {
+      has_ext = true;
+      break;
+    }
+  }
+
+  if (has_ext) {
+    filename += '.';
+    for (int i = 0; i < 3; i++) {
+      char c = mem[fcb_addr + 9 + i] & 0x7F;
+      if (c != ' ') {
+        filename += c;
+      }
+    }
+  }
+
+  return filename;
+}
+
+void CPMEmulator::filename_to_fcb(const std::string& filename, qkz80_uint16 fcb_addr) {
+  qkz80_uint8* mem = cpu->get_mem();
+
+  // Clear FCB
+  memset(&mem[fcb_addr], 0, 36);
+
+  // Parse filename
+  std::string upper_name;
+  for (char c : filename) {
+    upper_name += toupper(c);
+  }
+
+  // Check for drive letter
+  size_t name_start = 0;
+  if (upper_name.length() >= 2 && upper_name[1] == ':') {
+    char drive = upper_name[0];
+    if (drive >= 'A' && drive <= 'P') {
+      mem[fcb_addr] = drive - 'A' + 1;
+      name_start = 2;
+    }
+  }
+
+  // Find extension
+  size_t dot_pos = upper_name.find('.', name_start);
+
+  // Fill name field (8 chars, space-padded)
+  size_t name_len = (dot_pos != std::string::npos) ? (dot_pos - name_start) : (upper_name.length() - name_start);
+  name_len = std::min(name_len, (size_t)8);
+
+  for (size_t i = 0; i < 8; i++) {
+    if (i < name_len) {
+      mem[fcb_addr + 1 + i] = upper_name[name_start + i];
+    } else {
+      mem[fcb_addr + 1 + i] = ' ';
+    }
+  }
+
+  // Fill extension field (3 chars, space-padded)
+  if (dot_pos != std::string::npos) {
+    size_t ext_start = dot_pos + 1;
+    size_t ext_len = std::min(upper_name.length() - ext_start, (size_t)3);
+
+    for (size_t i = 0; i < 3; i++) {
+      if (i < ext_len) {
+        mem[fcb_addr + 9 + i] = upper_name[ext_start + i];
+      } else {
+        mem[fcb_addr + 9 + i] = ' ';
+      }
+    }
+  } else {
+    // No extension
+    for (int i = 0; i < 3; i++) {
+      mem[fcb_addr + 9 + i] = ' ';
+    }
+  }
+}
+
+std::string CPMEmulator::find_unix_file(const std::string& cpm_name) {
+  // First check file mapping
+  std::string normalized = normalize_cpm_filename(cpm_name);
+
+  auto it = file_map.find(normalized);
+  if (it != file_map.end()) {
+    return it->second;
+  }
+
+  // Try lowercase version in current directory
+  std::string lowercase;
+  for (char c : normalized) {
+    lowercase += tolower(c);
+  }
+
+  // Check if file exists
+  if (platform::get_file_type(lowercase.c_str()) != platform::FileType::NotFound) {
+    return lowercase;
+  }
+
+  // Try as-is
+  if (platform::get_file_type(normalized.c_str()) != platform::FileType::NotFound) {
+    return normalized;
+  }
+
+  // Try with ./ prefix
+  std::string with_prefix = "./" + lowercase;
+  if (platform::get_file_type(with_prefix.c_str()) != platform::FileType::NotFound) {
+    return with_prefix;
+  }
+
+  return "";  // Not found
+}
+
+bool CPMEmulator::handle_pc(qkz80_uint16 pc) {
+  // Check for JMP 0 (exit)
+  if (pc == 0) {
+    if (!quiet) fprintf(stderr, "Program exit via JMP 0\n");
+    request_exit(0);
+    return true;
+  }
+
+  // Check for BDOS call (trap at BDOS_BASE where jump from 0x0005 lands)
+  if (pc == BDOS_BASE) {
+    qkz80_uint8 func = cpu->get_reg8(qkz80::reg_C);
+    bdos_call(func);
+
+    // Leave PC on the trap so the call is retried once input arrives
+    if (input_wait == WAIT_RETRY) {
+      return true;
+    }
+
+    // Simulate RET from BDOS
+    qkz80_uint16 ret_addr = cpu->pop_word();
+    cpu->regs.PC.set_pair16(ret_addr);
+    return true;
+  }
+
+  // Check for BIOS calls (magic addresses 0xFF00-0xFF10)
+  if (pc >= 0xFF00 && pc < 0xFF20) {
+    int bios_func = (pc - 0xFF00) * 3;
+    bios_call(bios_func);
+
+    if (input_wait == WAIT_RETRY) {
+      return true;
+    }
+
+    // Simulate RET from BIOS
+    qkz80_uint16 ret_addr = cpu->pop_word();
+    cpu->regs.PC.set_pair16(ret_addr);
+    return true;
+  }
+
+  return false;
+}
+
+void CPMEmulator::bdos_call(qkz80_uint8 func) {
+  if (debug || debug_bdos_funcs.count(func)) {
+    fprintf(stderr, "BDOS call %d\n", func);
+  }
+
+  if (func >= BDOS_EXT_FIRST && func <= BDOS_EXT_RESERVED) {
+    bdos_extension(func);
+    return;
+  }
+
+  switch (func) {
+  case 0:  // System Reset
+    if (!quiet) fprintf(stderr, "System reset\n");
+    request_exit(0);
+    break;
+
+  case 1:  // Console Input
+    bdos_read_console();
+    break;
+
+  case 2:  // Console Output
+    bdos_write_console(cpu->get_reg8(qkz80::reg_E));
+    break;
+
+  case 3:  // Auxiliary Input
+    bdos_aux_input();
+    break;
+
+  case 4:  // Auxiliary Output
+    bdos_aux_output();
+    break;
+
+  case 5:  // List Output (Printer)
+    bdos_list_output();
+    break;
+
+  case 6:  // Direct Console I/O
+    bdos_direct_console_io();
+    break;
+
+  case 7:  // Get IOBYTE
+    bdos_get_iobyte();
+    break;
+
+  case 8:  // Set IOBYTE
+    bdos_set_iobyte();
+    break;
+
+  case 9:  // Print String
+    bdos_write_string();
+    break;
+
+  case 10: // Read Console Buffer
+    bdos_read_console_buffer();
+    break;
+
+  case 11: // Console Status
+    bdos_console_status();
+    break;
+
+  case 12: // Get Version
+    bdos_get_version();
+    break;
+
+  case 13: // Reset Disk System
+    bdos_reset_disk();
+    break;
+
+  case 14: // Select Disk
+    bdos_set_drive();
+    break;
+
+  case 15: // Open File
+    bdos_open_file();
+    break;
+
+  case 16: // Close File
+    bdos_close_file();
+    break;
+
+  case 17: // Search First
+    bdos_search_first();
+    break;
+
+  case 18: // Search Next
+    bdos_search_next();
+    break;
+
+  case 19: // Delete File
+    bdos_delete_file();
+    break;
+
+  case 20: // Read Sequential
+    bdos_read_sequential();
+    break;
+
+  case 21: // Write Sequential
+    bdos_write_sequential();
+    break;
+
+  case 22: // Make File
+    bdos_make_file();
+    break;
+
+  case 23: // Rename File
+    bdos_rename_file();
+    break;
+
+  case 24: // Get Login Vector
+    bdos_get_login_vector();
+    break;
+
+  case 25: // Get Current Drive
+    bdos_get_current_drive();
+    break;
+
+  case 26: // Set DMA Address
+    bdos_get_set_dma();
+    break;
+
+  case 27: // Get Allocation Vector
+    bdos_get_allocation_vector();
+    break;
+
+  case 28: // Write Protect Disk
+    bdos_write_protect_disk();
+    break;
+
+  case 29: // Get Read-Only Vector
+    bdos_get_readonly_vector();
+    break;
+
+  case 30: // Set File Attributes
+    bdos_set_file_attributes();
+    break;
+
+  case 31: // Get Disk Parameter Block
+    bdos_get_dpb();
+    break;
+
+  case 32: // Get/Set User Number
+    bdos_get_set_user();
+    break;
+
+  case 33: // Read Random
+    bdos_read_random();
+    break;
+
+  case 34: // Write Random
+    bdos_write_random();
+    break;
+
+  case 35: // Compute File Size
+    bdos_file_size();
+    break;
+
+  case 36: // Set Random Record
+    bdos_set_random_record();
+    break;
+
+  case 37: // Reset Drive
+    bdos_reset_drive();
+    break;
+
+  case 38: // Access Free Space
+    // Return A=0 indicating success
+    cpu->set_reg8(0, qkz80::reg_A);
+    break;
+
+  case 39: // Free Space
+    // No operation - just return
+    break;
+
+  case 40: // Write Random with Zero Fill
+    bdos_write_random_zero_fill();
+    break;
+
+  case 44: // Set Multi-Sector Count (CP/M 3)
+    bdos_set_multi_sector_count();
+    break;
+
+  case 45: // Set BDOS Error Mode (CP/M 3)
+    bdos_error_mode = cpu->get_reg8(qkz80::reg_E);
+    break;
+
+  case 46: // Get Disk Free Space (CP/M 3)
+    bdos_get_disk_free_space();
+    break;
+
+  case 48: // Flush Buffers (CP/M 3)
+    bdos_flush_buffers();
+    break;
+
+  case 105: // Get Date and Time (CP/M 3)
+    bdos_get_date_time();
+    break;
+
+  default:
+    fprintf(stderr, "Unimplemented BDOS function %d\n", func);
+    cpu->set_reg8(0xFF, qkz80::reg_A);
+    break;
+  }
+}
+
+void CPMEmulator::bdos_write_console(qkz80_uint8 ch) {
+  console_out(ch & 0x7F);
+  console_flush();
+}
+
+void CPMEmulator::bdos_write_string() {
+  qkz80_uint16 addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+
+  while (mem[addr] != '$') {
+    console_out(mem[addr] & 0x7F);
+    addr++;
+  }
+  console_flush();
+}
+
+void CPMEmulator::bdos_read_console() {
+  if (input_would_block()) return;
+  int ch = console_in();
+  if (ch == -1 || ch == EOF) ch = 0x1A;  // EOF becomes ^Z
+  check_ctrl_c_exit(ch);  // Track ^C for exit, pass through to program
+  if (ch == '\n') ch = '\r';  // Convert LF to CR for CP/M
+  cpu->set_reg8(ch & 0x7F, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_read_console_buffer() {
+  // BDOS function 10: Read Console Buffer
+  // DE points to buffer:
+  //   Byte 0: Maximum characters to read (1-255, but typically <=127)
+  //   Byte 1: Actual characters read (filled by this function)
+  //   Bytes 2+: Characters read (up to max)
+  //
+  // Line editing supported:
+  //   Backspace/DEL: Delete last character
+  //   CR or LF: End input
+  //   ^C: Passed through (tracked for 5x exit)
+  //   ^U: Cancel line (clear buffer)
+  //   ^H: Backspace (same as DEL)
+
+  qkz80_uint16 buf_addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+
+  qkz80_uint8 max_chars = mem[buf_addr] & 0xFF;
+  if (max_chars == 0) {
+    mem[buf_addr + 1] = 0;
+    cpu->set_reg8(0, qkz80::reg_A);
+    return;
+  }
+
+  // Buffer for characters (bytes 2+)
+  // Resume a line interrupted by input_would_block()
+  int count = line_active ? line_count : 0;
+  line_active = false;
+
+  while (count < max_chars) {
+    if (input_would_block()) {
+      line_count = count;
+      line_active = true;
+      return;
+    }
+
+    int ch = console_in();
+    if (ch == -1 || ch == EOF) {
+      ch = 0x1A;  // ^Z
+    }
+
+    if (check_ctrl_c_exit(ch)) break;  // Track ^C for exit
+
+    // Handle control characters
+    if (ch == '\n' || ch == '\r') {
+      // End of line - echo CR/LF and finish
+      console_out('\r');
+      console_out('\n');
+      console_flush();
+      break;
+    } else if (ch == 0x7F || ch == 0x08) {  // DEL or Backspace
+      if (count > 0) {
+        count--;
+        // Erase character on screen: backspace, space, backspace
+        console_out('\b');
+        console_out(' ');
+        console_out('\b');
+        console_flush();
+      }
+    } else if (ch == 0x15) {  // ^U - cancel line
+      // Erase all characters on screen
+      while (count > 0) {
+        console_out('\b');
+        console_out(' ');
+        console_out('\b');
+        count--;
+      }
+      console_flush();
+    } else if (ch == 0x03) {  // ^C - pass through to buffer
+      mem[buf_addr + 2 + count] = ch;
+      count++;
+      console_out('^');
+      console_out('C');
+      console_flush();
+    } else if (ch >= 0x20 && ch < 0x7F) {  // Printable characters
+      mem[buf_addr + 2 + count] = ch;
+      count++;
+      console_out(ch);
+      console_flush();
+    } else if (ch == 0x1A) {  // ^Z - end of file marker
+      // Treat ^Z as end of input
+      break;
+    }
+    // Ignore other control characters
+  }
+
+  // Store actual count
+  mem[buf_addr + 1] = count;
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_aux_input() {
+  // Auxiliary (Reader) input
+  if (aux_in_file) {
+    int ch = fgetc(aux_in_file);
+    if (ch == EOF) ch = 0x1A;  // ^Z
+    cpu->set_reg8(ch & 0x7F, qkz80::reg_A);
+  } else {
+    // No aux input configured - return ^Z
+    cpu->set_reg8(0x1A, qkz80::reg_A);
+  }
+}
+
+void CPMEmulator::bdos_aux_output() {
+  // Auxiliary (Punch) output
+  qkz80_uint8 ch = cpu->get_reg8(qkz80::reg_E);
+  if (aux_out_file) {
+    fputc(ch & 0x7F, aux_out_file);
+    fflush(aux_out_file);
+  }
+  // If no file, silently ignore
+}
+
+void CPMEmulator::bdos_list_output() {
+  // List (Printer) output - LPRINT uses this!
+  qkz80_uint8 ch = cpu->get_reg8(qkz80::reg_E);
+  list_out(ch & 0x7F);
+}
+
+void CPMEmulator::bdos_get_iobyte() {
+  cpu->set_reg8(iobyte, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_set_iobyte() {
+  iobyte = cpu->get_reg8(qkz80::reg_E);
+}
+
+void CPMEmulator::bdos_console_status() {
+  // Return 0xFF if character ready, 0x00 if not
+  bool ready = console_ready();
+  note_console_poll(ready);
+  cpu->set_reg8(ready ? 0xFF : 0x00, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_get_version() {
+  // CP/M 2.2 version
+  cpu->set_reg8(0x22, qkz80::reg_A);
+  cpu->set_reg8(0x22, qkz80::reg_L);
+  cpu->set_reg8(0x00, qkz80::reg_B);
+  cpu->set_reg8(0x00, qkz80::reg_H);
+}
+
+void CPMEmulator::bdos_get_set_dma() {
+  current_dma = cpu->get_reg16(qkz80::regp_DE);
+  if (debug) {
+    fprintf(stderr, "Set DMA to 0x%04X\n", current_dma);
+  }
+}
+
+void CPMEmulator::bdos_get_current_drive() {
+  cpu->set_reg8(current_drive, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_set_drive() {
+  current_drive = cpu->get_reg8(qkz80::reg_E) & 0x0F;
+  if (debug) {
+    fprintf(stderr, "Set drive to %c:\n", 'A' + current_drive);
+  }
+}
+
+void CPMEmulator::bdos_get_set_user() {
+  qkz80_uint8 code = cpu->get_reg8(qkz80::reg_E);
+
+  if (code == 0xFF) {
+    // Get user number
+    cpu->set_reg8(current_user, qkz80::reg_A);
+  } else {
+    // Set user number
+    current_user = code & 0x0F;
+  }
+}
+
+void CPMEmulator::bdos_open_file() {
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  std::string filename = fcb_to_filename(fcb_addr);
+
+  FileMode mode;
+  bool eol_convert;
+  std::string unix_path = find_unix_file_ex(filename, &mode, &eol_convert);
+
+  if (debug || debug_bdos_funcs.count(15)) {
+    fprintf(stderr, "BDOS Open: '%s' -> '%s' (mode: %s)\n", filename.c_str(),
+            unix_path.empty() ? "(not found)" : unix_path.c_str(),
+            mode == MODE_TEXT ? "text" : "binary");
+  }
+
+  if (unix_path.empty()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // File not found
+    return;
+  }
+
+  // Serve reads from the shared cache when possible, and text files from
+  // their converted view so random records and sizes match sequential
+  // reads. Text files the cache does not hold are converted as they are
+  // read. Whether the file is writable is only found out by the first
+  // write.
+  CPMFileCache::Content cached;
+  FILE* fp = nullptr;
+  bool text_view = mode == MODE_TEXT && eol_convert;
+  if (file_cache) {
+    cached = text_view ? file_cache->get_text(unix_path) : file_cache->get(unix_path);
+  }
+  if (cached) {
+    fp = platform::open_memory_stream(cached->data(), cached->size());
+    if (!fp) cached.reset();
+  }
+  text_view = text_view && fp;
+
+  bool writable = true;
+  if (!fp) {
+    fp = fopen(unix_path.c_str(), "r+b");
+  }
+  if (!fp) {
+    writable = false;
+    fp = fopen(unix_path.c_str(), "rb");
+    if (!fp) {
+      cpu->set_reg8(0xFF, qkz80::reg_A);
+      return;
+    }
+  }
+
+  OpenFile of;
+  of.fp = fp;
+  of.cache_data = cached;
+  of.text_view = text_view;
+  of.writable = writable;
+  of.unix_path = unix_path;
+  of.cpm_name = filename;
+  of.mode = mode;
+  of.eol_convert = eol_convert;
+  of.position = 0;
+  of.eof_seen = false;
+  of.write_mode = false;
+  add_open_file(fcb_addr, of);
+
+  // Clear extent and record count
+  qkz80_uint8* mem = cpu->get_mem();
+  mem[fcb_addr + 12] = 0;  // EX
+  mem[fcb_addr + 15] = 0x80;  // RC (128 records max per extent)
+
+  cpu->set_reg8(0, qkz80::reg_A);  // Success
+}
+
+void CPMEmulator::bdos_close_file() {
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+
+  if (debug || debug_bdos_funcs.count(16)) {
+    fprintf(stderr, "Close file: FCB at %04X\n", fcb_addr);
+  }
+
+  auto it = open_files.find(fcb_addr);
+  if (it != open_files.end()) {
+    if (debug || debug_bdos_funcs.count(16)) {
+      fprintf(stderr, "Close file: closing '%s'\n", it->second.cpm_name.c_str());
+    }
+    bool ok = close_open_file(it->second);
+    open_files.erase(it);
+    cpu->set_reg8(ok ? 0 : 0xFF, qkz80::reg_A);
+  } else {
+    if (debug || debug_bdos_funcs.count(16)) {
+      fprintf(stderr, "Close file: file not open (OK)\n");
+    }
+    // CP/M close is idempotent
+    cpu->set_reg8(0, qkz80::reg_A);
+  }
+
+  if (debug || debug_bdos_funcs.count(16)) {
+    fprintf(stderr, "Close file: returning A=%02X\n", cpu->get_reg8(qkz80::reg_A));
+  }
+}
+
+void CPMEmulator::bdos_read_sequential() {
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+
+  auto it = open_files.find(fcb_addr);
+  if (it == open_files.end()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error: file not open
+    return;
+  }
+
+  if (!begin_stream_io(it->second, false)) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error: can't reopen or a write was lost
+    return;
+  }
+
+  // Read each record with conversion straight into the DMA buffer
+  for (unsigned rec = 0; rec < multi_sector_count; rec++) {
+    qkz80_uint16 dma = current_dma + rec * 128;
+    size_t nread = dma_read(it->second, dma, 128, true);
+
+    // Update current record in FCB
+    mem[fcb_addr + 32]++;
+
+    if (nread == 0 || it->second.eof_seen) {
+      set_transfer_result(1, rec);  // EOF
+      return;
+    }
+
+    // Pad to 128 bytes with ^Z if needed
+    if (nread < 128) {
+      dma_fill(dma + nread, CPM_EOF, 128 - nread);
+    }
+  }
+
+  set_transfer_result(0, multi_sector_count);  // Success
+}
+
+void CPMEmulator::bdos_write_sequential() {
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+
+  auto it = open_files.find(fcb_addr);
+  if (it == open_files.end()) {
+    // File not open - try to open it for writing
+    bdos_open_file();
+    it = open_files.find(fcb_addr);
+    if (it == open_files.end()) {
+      cpu->set_reg8(0xFF, qkz80::reg_A);
+      return;
+    }
+  }
+
+  it->second.write_mode = true;
+  if (!begin_stream_io(it->second, true)) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error: can't reopen or a write was lost
+    return;
+  }
+
+  // Write all records from DMA with conversion in one pass
+  size_t nwritten = dma_write(it->second, current_dma, multi_sector_count * 128, true);
+
+  if (nwritten > 0) {
+    set_transfer_result(0, multi_sector_count);  // Success
+  } else {
+    set_transfer_result(0xFF, 0);  // Error
+  }
+
+  // Update current record in FCB
+  mem[fcb_addr + 32] += multi_sector_count;
+}
+
+void CPMEmulator::bdos_make_file() {
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  std::string filename = fcb_to_filename(fcb_addr);
+
+  if (debug || debug_bdos_funcs.count(22)) {
+    fprintf(stderr, "Make file: %s\n", filename.c_str());
+  }
+
+  // Convert to lowercase for Unix
+  std::string unix_name;
+  for (char c : filename) {
+    unix_name += tolower(c);
+  }
+
+  if (file_cache) file_cache->invalidate(unix_name);
+  FILE* fp = fopen(unix_name.c_str(), "w+b");
+  if (!fp) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error
+    return;
+  }
+
+  OpenFile of;
+  of.fp = fp;
+  of.writable = true;
+  of.unix_path = unix_name;
+  of.cpm_name = filename;
+  of.mode = default_mode == MODE_AUTO ? detect_file_mode(filename, unix_name)
+                                      : default_mode;
+  of.eol_convert = default_eol_convert;
+  of.position = 0;
+  of.eof_seen = false;
+  of.write_mode = true;
+  add_open_file(fcb_addr, of);
+
+  qkz80_uint8* mem = cpu->get_mem();
+  mem[fcb_addr + 12] = 0;  // EX
+  mem[fcb_addr + 15] = 0;  // RC
+
+  cpu->set_reg8(0, qkz80::reg_A);  // Success
+}
+
+void CPMEmulator::bdos_delete_file() {
+  flush_all_random_writes();
+
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  std::string filename = fcb_to_filename(fcb_addr);
+
+  FileMode mode;
+  bool eol_convert;
+  std::string unix_path = find_unix_file_ex(filename, &mode, &eol_convert);
+
+  if (debug || debug_bdos_funcs.count(19)) {
+    fprintf(stderr, "Delete file: %s -> %s\n", filename.c_str(),
+            unix_path.empty() ? "(not found)" : unix_path.c_str());
+  }
+
+  if (file_cache && !unix_path.empty()) file_cache->invalidate(unix_path);
+  if (unix_path.empty() || !platform::delete_file(unix_path.c_str())) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error
+  } else {
+    cpu->set_reg8(0, qkz80::reg_A);  // Success
+  }
+}
+
+void CPMEmulator::bdos_read_random() {
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+
+  auto it = open_files.find(fcb_addr);
+  if (it == open_files.end()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error: file not open
+    return;
+  }
+
+  // Get random record number from FCB bytes 33-35 (r0, r1, r2)
+  uint32_t record_num = mem[fcb_addr + 33] |
+                        (mem[fcb_addr + 34] << 8) |
+                        (mem[fcb_addr + 35] << 16);
+
+  // Calculate byte position (each record is 128 bytes)
+  long position = record_num * 128L;
+
+  // Read the records, from the prefetch window when the access pattern
+  // allows it, otherwise straight into the DMA buffer
+  size_t size = multi_sector_count * 128;
+  size_t nread;
+  if (!random_read(it->second, position, current_dma, size, &nread)) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error: seek failed or a write was lost
+    return;
+  }
+
+  if (nread == 0) {
+    set_transfer_result(1, 0);  // EOF
+    return;
+  }
+
+  // Pad the last record with ^Z if it is short
+  unsigned records = (nread + 127) / 128;
+  dma_fill(current_dma + nread, CPM_EOF, records * 128 - nread);
+
+  if (records < multi_sector_count) {
+    set_transfer_result(1, records);  // Ran into EOF part way
+  } else {
+    set_transfer_result(0, records);  // Success
+  }
+}
+
+void CPMEmulator::bdos_write_random() {
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+
+  auto it = open_files.find(fcb_addr);
+  if (it == open_files.end()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error: file not open
+    return;
+  }
+
+  // Get random record number from FCB bytes 33-35 (r0, r1, r2)
+  uint32_t record_num = mem[fcb_addr + 33] |
+                        (mem[fcb_addr + 34] << 8) |
+                        (mem[fcb_addr + 35] << 16);
+
+  // Calculate byte position (each record is 128 bytes)
+  long position = record_num * 128L;
+
+  // Adjacent writes are batched and reach the file together, on the next
+  // non-adjacent access, or at close
+  if (!random_write(it->second, position, current_dma, multi_sector_count * 128)) {
+    set_transfer_result(0xFF, 0);  // An earlier batch was lost
+  } else {
+    set_transfer_result(0, multi_sector_count);  // Success
+  }
+}
+
+void CPMEmulator::bdos_file_size() {
+  // The size on disk must include batched random writes
+  flush_all_random_writes();
+
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+  std::string filename = fcb_to_filename(fcb_addr);
+
+  FileMode mode;
+  bool eol_convert;
+  std::string unix_path = find_unix_file_ex(filename, &mode, &eol_convert);
+
+  if (unix_path.empty()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error: file not found
+    return;
+  }
+
+  // Text files are measured as the guest reads them
+  int64_t file_size;
+  if (mode == MODE_TEXT && eol_convert) {
+    file_size = text_file_size(unix_path);
+  } else {
+    file_size = platform::get_file_size(unix_path.c_str());
+  }
+  if (file_size < 0) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error
+    return;
+  }
+
+  // File size in 128-byte records (round up)
+  uint32_t records = (file_size + 127) / 128;
+
+  // Store in FCB bytes 33-35 (r0, r1, r2)
+  mem[fcb_addr + 33] = records & 0xFF;
+  mem[fcb_addr + 34] = (records >> 8) & 0xFF;
+  mem[fcb_addr + 35] = (records >> 16) & 0xFF;
+
+  cpu->set_reg8(0, qkz80::reg_A);  // Success
+}
+
+void CPMEmulator::bdos_set_random_record() {
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+
+  // Convert current sequential position to random record number
+  // Record number = (EX * 128) + CR
+  uint8_t ex = mem[fcb_addr + 12];  // Extent
+  uint8_t cr = mem[fcb_addr + 32];  // Current record
+
+  uint32_t record_num = (ex * 128) + cr;
+
+  // Store in r0-r2
+  mem[fcb_addr + 33] = record_num & 0xFF;
+  mem[fcb_addr + 34] = (record_num >> 8) & 0xFF;
+  mem[fcb_addr + 35] = (record_num >> 16) & 0xFF;
+
+  // No return value for this function
+}
+
+void CPMEmulator::bdos_rename_file() {
+  flush_all_random_writes();
+
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+
+  // In CP/M, rename uses a special FCB format:
+  // Bytes 0-15: old filename (standard FCB format)
+  // Bytes 16-31: new filename
+
+  std::string old_name = fcb_to_filename(fcb_addr);
+
+  FileMode mode;
+  bool eol_convert;
+  std::string old_path = find_unix_file_ex(old_name, &mode, &eol_convert);
+
+  if (old_path.empty()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error: old file not found
+    return;
+  }
+
+  // Extract new name from second FCB (at offset +16)
+  std::string new_name = fcb_to_filename(fcb_addr + 16);
+
+  // Create new path in same directory as old file
+  size_t last_slash = old_path.find_last_of('/');
+  std::string new_path;
+  if (last_slash != std::string::npos) {
+    new_path = old_path.substr(0, last_slash + 1);
+  }
+
+  // Convert new name to lowercase for Unix
+  for (char c : new_name) {
+    new_path += tolower(c);
+  }
+
+  if (debug || debug_bdos_funcs.count(23)) {
+    fprintf(stderr, "Rename: %s -> %s\n", old_path.c_str(), new_path.c_str());
+  }
+
+  if (file_cache) {
+    file_cache->invalidate(old_path);
+    file_cache->invalidate(new_path);
+  }
+
+  if (rename(old_path.c_str(), new_path.c_str()) != 0) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error
+  } else {
+    // Update file mapping
+    file_map[normalize_cpm_filename(new_name)] = new_path;
+    cpu->set_reg8(0, qkz80::reg_A);  // Success
+  }
+}
+
+void CPMEmulator::bdos_direct_console_io() {
+  qkz80_uint8 e_reg = cpu->get_reg8(qkz80::reg_E);
+
+  if (e_reg == 0xFF) {
+    // Input mode - return character if available, 0 if not
+    bool ready = console_ready();
+    note_console_poll(ready);
+    if (ready) {
+      int ch = console_in();
+      if (ch == -1 || ch == EOF) ch = 0;
+      check_ctrl_c_exit(ch);  // Track ^C for exit, pass through to program
+      if (ch == '\n') ch = '\r';  // Convert LF to CR for CP/M
+      cpu->set_reg8(ch & 0x7F, qkz80::reg_A);
+    } else {
+      cpu->set_reg8(0, qkz80::reg_A);
+    }
+  } else if (e_reg == 0xFE) {
+    // Status check - return 0xFF if char ready, 0 if not
+    bool ready = console_ready();
+    note_console_poll(ready);
+    cpu->set_reg8(ready ? 0xFF : 0, qkz80::reg_A);
+  } else {
+    // Output mode - send character
+    console_out(e_reg & 0x7F);
+    console_flush();
+    // No return value for output
+  }
+}
+
+void CPMEmulator::bdos_reset_disk() {
+  // Reset disk system - close all files
+  for (auto& pair : open_files) {
+    close_open_file(pair.second);
+  }
+  open_files.clear();
+
+  // Reset to drive A, user 0
+  current_drive = 0;
+  current_user = 0;
+
+  // No return value
+}
+
+// Helper: match FCB-style pattern (with '?' wildcards) against a filename
+// Both pattern and filename should be space-padded 8+3 format
+static bool match_fcb_pattern(const char* pattern_name, const char* pattern_ext,
+                               const char* file_name, const char* file_ext) {
+  // Match name (8 chars)
+  for (int i = 0; i < 8; i++) {
+    char p = pattern_name[i];
+    char f = file_name[i];
+    if (p != '?' && toupper(p) != toupper(f)) {
+      return false;
+    }
+  }
+  // Match extension (3 chars)
+  for (int i = 0; i < 3; i++) {
+    char p = pattern_ext[i];
+    char f = file_ext[i];
+    if (p != '?' && toupper(p) != toupper(f)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Check if a character is valid in CP/M filenames
+// Valid: A-Z, 0-9, and some special chars
+static bool is_valid_cpm_char(char c) {
+  c = toupper(c);
+  if (c >= 'A' && c <= 'Z') return true;
+  if (c >= '0' && c <= '9') return true;
+  // CP/M allows: $ # @ ! % ' ( ) - { } ~
+  // Technically also & ^ but often cause issues
+  if (c == '$' || c == '#' || c == '@' || c == '!' ||
+      c == '%' || c == '\'' || c == '(' || c == ')' ||
+      c == '-' || c == '{' || c == '}' || c == '~') return true;
+  return false;
+}
+
+// Helper: convert Unix filename to CP/M 8.3 format (space-padded)
+// Returns false if the filename contains illegal CP/M characters
+static bool unix_to_cpm_83(const std::string& unix_name,
+                            char* name_out, char* ext_out) {
+  // Initialize with spaces
+  memset(name_out, ' ', 8);
+  memset(ext_out, ' ', 3);
+
+  // Find extension
+  size_t dot = unix_name.rfind('.');
+  std::string name_part, ext_part;
+
+  if (dot != std::string::npos && dot > 0) {
+    name_part = unix_name.substr(0, dot);
+    ext_part = unix_name.substr(dot + 1);
+  } else {
+    name_part = unix_name;
+  }
+
+  // Validate and copy name (up to 8 chars)
+  for (size_t i = 0; i < name_part.length() && i < 8; i++) {
+    if (!is_valid_cpm_char(name_part[i])) return false;
+    name_out[i] = toupper(name_part[i]);
+  }
+
+  // Validate and copy extension (up to 3 chars)
+  for (size_t i = 0; i < ext_part.length() && i < 3; i++) {
+    if (!is_valid_cpm_char(ext_part[i])) return false;
+    ext_out[i] = toupper(ext_part[i]);
+  }
+
+  // Reject if name is too long (wouldn't fit in 8.3)
+  if (name_part.length() > 8 || ext_part.length() > 3) return false;
+
+  return true;
+}
+
+void CPMEmulator::bdos_search_first() {
+  flush_all_random_writes();
+
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+
+  // Extract pattern from FCB
+  char pattern_name[8], pattern_ext[3];
+  memcpy(pattern_name, &mem[fcb_addr + 1], 8);
+  memcpy(pattern_ext, &mem[fcb_addr + 9], 3);
+
+  // Get drive from FCB (0 = default)
+  qkz80_uint8 fcb_drive = mem[fcb_addr];
+  (void)fcb_drive;  // We only support current directory
+
+  // Get user from FCB byte 0 for '?' user matching
+  search_user = current_user;
+
+  // Clear previous results and scan directory
+  search_results.clear();
+  search_index = 0;
+
+  // Store pattern for debug output
+  search_pattern = std::string(pattern_name, 8) + "." + std::string(pattern_ext, 3);
+
+  if (debug || debug_bdos_funcs.count(17)) {
+    fprintf(stderr, "Search First: pattern='%s'\n", search_pattern.c_str());
+  }
+
+  // Track which CP/M names we've already added (to avoid duplicates from mappings + dir)
+  std::set<std::string> added_cpm_names;
+
+  // First, check file mappings - these define explicit CP/M names
+  for (const auto& mapping : file_mappings) {
+    // Check if the Unix file exists and is not a directory
+    platform::FileType ftype = platform::get_file_type(mapping.unix_pattern.c_str());
+    if (ftype != platform::FileType::Regular) continue;
+
+    // Get the CP/M name from the mapping
+    char file_name[8], file_ext[3];
+    if (!unix_to_cpm_83(mapping.cpm_pattern, file_name, file_ext)) continue;
+
+    if (match_fcb_pattern(pattern_name, pattern_ext, file_name, file_ext)) {
+      search_results.push_back(mapping.unix_pattern);
+      // Remember this CP/M name to avoid duplicates
+      std::string cpm_name = std::string(file_name, 8) + std::string(file_ext, 3);
+      added_cpm_names.insert(cpm_name);
+    }
+  }
+
+  // Also check legacy file_map
+  for (const auto& pair : file_map) {
+    // Check if the file exists and is not a directory
+    platform::FileType ftype = platform::get_file_type(pair.second.c_str());
+    if (ftype != platform::FileType::Regular) continue;
+
+    char file_name[8], file_ext[3];
+    if (!unix_to_cpm_83(pair.first, file_name, file_ext)) continue;
+
+    std::string cpm_name = std::string(file_name, 8) + std::string(file_ext, 3);
+    if (added_cpm_names.count(cpm_name)) continue;  // Already added
+
+    if (match_fcb_pattern(pattern_name, pattern_ext, file_name, file_ext)) {
+      search_results.push_back(pair.second);
+      added_cpm_names.insert(cpm_name);
+    }
+  }
+
+  // Scan current directory for files with valid CP/M names
+  std::vector<platform::DirEntry> dir_entries = platform::list_directory(".");
+  if (dir_entries.empty() && search_results.empty()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Error
+    return;
+  }
+
+  for (const auto& entry : dir_entries) {
+    // Skip directories and hidden files
+    if (entry.name[0] == '.' || entry.is_directory) continue;
+
+    // Convert to CP/M format - skip files with invalid characters
+    char file_name[8], file_ext[3];
+    if (!unix_to_cpm_83(entry.name.c_str(), file_name, file_ext)) continue;
+
+    // Check if this CP/M name was already added via mapping
+    std::string cpm_name = std::string(file_name, 8) + std::string(file_ext, 3);
+    if (added_cpm_names.count(cpm_name)) continue;
+
+    if (match_fcb_pattern(pattern_name, pattern_ext, file_name, file_ext)) {
+      search_results.push_back(entry.name);
+      added_cpm_names.insert(cpm_name);
+    }
+  }
+
+  if (debug || debug_bdos_funcs.count(17)) {
+    fprintf(stderr, "Search First: found %zu files\n", search_results.size());
+  }
+
+  // Return first result
+  if (search_results.empty()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // Not found
+    return;
+  }
+
+  // Build directory entry at DMA address
+  // CP/M directory entry: 32 bytes
+  // Byte 0: user number (0-15)
+  // Bytes 1-8: filename (space padded)
+  // Bytes 9-11: extension (space padded)
+  // Bytes 12-15: extent info (EX, S1, S2, RC)
+  // Bytes 16-31: allocation map
+
+  char file_name[8], file_ext[3];
+  unix_to_cpm_83(search_results[0], file_name, file_ext);
+
+  // Get file size for extent calculation
+  int64_t file_size = platform::get_file_size(search_results[0].c_str());
+  if (file_size < 0) file_size = 0;
+  int records = (file_size + 127) / 128;  // Number of 128-byte records
+  int rc = records > 128 ? 128 : records; // Record count in this extent
+
+  // Write directory entry at DMA
+  memset(&mem[current_dma], 0, 32);
+  mem[current_dma + 0] = search_user;  // User number
+  memcpy(&mem[current_dma + 1], file_name, 8);
+  memcpy(&mem[current_dma + 9], file_ext, 3);
+  mem[current_dma + 12] = 0;  // EX (extent)
+  mem[current_dma + 13] = 0;  // S1
+  mem[current_dma + 14] = 0;  // S2
+  mem[current_dma + 15] = rc; // RC (record count)
+  // Allocation map bytes 16-31 can be any non-zero value for existing file
+  for (int i = 16; i < 32; i++) {
+    mem[current_dma + i] = (i - 16 < (records + 7) / 8) ? 0x01 : 0x00;
+  }
+
+  search_index = 1;  // Next call returns second result
+
+  // Return 0 (directory code) to indicate entry found in first 32 bytes of DMA
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_search_next() {
+  if (debug || debug_bdos_funcs.count(18)) {
+    fprintf(stderr, "Search Next: index=%zu/%zu\n", search_index, search_results.size());
+  }
+
+  if (search_index >= search_results.size()) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);  // No more files
+    return;
+  }
+
+  qkz80_uint8* mem = cpu->get_mem();
+
+  // Build directory entry for next file
+  char file_name[8], file_ext[3];
+  unix_to_cpm_83(search_results[search_index], file_name, file_ext);
+
+  // Get file size
+  int64_t file_size = platform::get_file_size(search_results[search_index].c_str());
+  if (file_size < 0) file_size = 0;
+  int records = (file_size + 127) / 128;
+  int rc = records > 128 ? 128 : records;
+
+  // Write directory entry at DMA
+  memset(&mem[current_dma], 0, 32);
+  mem[current_dma + 0] = search_user;
+  memcpy(&mem[current_dma + 1], file_name, 8);
+  memcpy(&mem[current_dma + 9], file_ext, 3);
+  mem[current_dma + 12] = 0;
+  mem[current_dma + 13] = 0;
+  mem[current_dma + 14] = 0;
+  mem[current_dma + 15] = rc;
+  for (int i = 16; i < 32; i++) {
+    mem[current_dma + i] = (i - 16 < (records + 7) / 8) ? 0x01 : 0x00;
+  }
+
+  search_index++;
+
+  // Return directory code 0
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_get_login_vector() {
+  // Return bitmap of logged in drives
+  // For simplicity, say drive A is logged in
+  cpu->set_reg8(0x01, qkz80::reg_L);  // Drive A
+  cpu->set_reg8(0x00, qkz80::reg_H);
+}
+
+void CPMEmulator::bdos_get_allocation_vector() {
+  // Return address of allocation vector
+  cpu->set_reg8(ALV_ADDR & 0xFF, qkz80::reg_L);
+  cpu->set_reg8((ALV_ADDR >> 8) & 0xFF, qkz80::reg_H);
+}
+
+void CPMEmulator::bdos_write_protect_disk() {
+  // Write protect current disk
+  // Just acknowledge - we don't actually enforce this
+}
+
+void CPMEmulator::bdos_get_readonly_vector() {
+  // Return bitmap of read-only drives
+  // For simplicity, say no drives are read-only
+  cpu->set_reg8(0x00, qkz80::reg_L);
+  cpu->set_reg8(0x00, qkz80::reg_H);
+}
+
+void CPMEmulator::bdos_set_file_attributes() {
+  // Set file attributes (R/O, System, Archive)
+  // Just return success - we don't actually store attributes
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_get_dpb() {
+  // Get Disk Parameter Block address
+  cpu->set_reg8(DPB_ADDR & 0xFF, qkz80::reg_L);
+  cpu->set_reg8((DPB_ADDR >> 8) & 0xFF, qkz80::reg_H);
+}
+
+void CPMEmulator::bdos_reset_drive() {
+  // Reset specified drives (bitmap in DE)
+  // Just acknowledge - close files would be proper behavior
+  for (auto& pair : open_files) {
+    close_open_file(pair.second);
+  }
+  open_files.clear();
+}
+
+void CPMEmulator::bdos_write_random_zero_fill() {
+  // Write random with zero fill (CP/M 3 feature)
+  // Just do a regular random write
+  bdos_write_random();
+}
+
+void CPMEmulator::bdos_set_multi_sector_count() {
+  // CP/M 3: records (1-128) moved by each read/write call, up to 16K
+  qkz80_uint8 count = cpu->get_reg8(qkz80::reg_E);
+  if (count < 1 || count > 128) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);
+    return;
+  }
+  multi_sector_count = count;
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_get_disk_free_space() {
+  // Free 128-byte records as a 24-bit value at DMA; report the maximum
+  // an 8MB CP/M drive can hold
+  uint32_t records = 0x010000;
+  qkz80_uint8* mem = cpu->get_mem();
+  mem[current_dma] = records & 0xFF;
+  mem[(qkz80_uint16)(current_dma + 1)] = (records >> 8) & 0xFF;
+  mem[(qkz80_uint16)(current_dma + 2)] = (records >> 16) & 0xFF;
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+void CPMEmulator::bdos_flush_buffers() {
+  // A failure is also left for the next call on the FCB concerned
+  bool ok = true;
+  for (auto& pair : open_files) {
+    if (!flush_random_writes(pair.second)) ok = false;
+    if (pair.second.fp && fflush(pair.second.fp) != 0) ok = false;
+  }
+  cpu->set_reg8(ok ? 0 : 0xFF, qkz80::reg_A);
+}
+
+static qkz80_uint8 to_bcd(int value) {
+  return (qkz80_uint8)(((value / 10) << 4) | (value % 10));
+}
+
+// Days from 1970-01-01 to the given civil date
+static long days_from_civil(int y, int m, int d) {
+  y -= m <= 2;
+  long era = (y >= 0 ? y : y - 399) / 400;
+  long yoe = y - era * 400;
+  long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+void CPMEmulator::bdos_get_date_time() {
+  // CP/M 3 DAT: day number (1 = 1 Jan 1978), hour and minute in BCD.
+  // Seconds in BCD are returned in A.
+  // Sessions run on worker threads, so no shared localtime() buffer
+  struct tm local;
+  if (!platform::local_time(time(nullptr), &local)) {
+    cpu->set_reg8(0, qkz80::reg_A);
+    return;
+  }
+
+  long day = days_from_civil(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday)
+             - days_from_civil(1978, 1, 1) + 1;
+  qkz80_uint16 dat = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint8* mem = cpu->get_mem();
+  mem[dat] = day & 0xFF;
+  mem[(qkz80_uint16)(dat + 1)] = (day >> 8) & 0xFF;
+  mem[(qkz80_uint16)(dat + 2)] = to_bcd(local.tm_hour);
+  mem[(qkz80_uint16)(dat + 3)] = to_bcd(local.tm_min);
+  cpu->set_reg8(to_bcd(local.tm_sec), qkz80::reg_A);
+}
+
+//=============================================================================
+// Extension BDOS functions
+//=============================================================================
+
+static qkz80_uint16 param_word(const qkz80_uint8* mem, qkz80_uint16 addr) {
+  return mem[addr] | (mem[(qkz80_uint16)(addr + 1)] << 8);
+}
+
+static void put_word(qkz80_uint8* mem, qkz80_uint16 addr, qkz80_uint16 value) {
+  mem[addr] = value & 0xFF;
+  mem[(qkz80_uint16)(addr + 1)] = value >> 8;
+}
+
+void CPMEmulator::bdos_extension(qkz80_uint8 func) {
+  cpu->set_reg16(0, qkz80::regp_HL);
+
+  // Disabled, or not assigned yet: fail quietly so detection probes from
+  // tools that also run on real CP/M leave no noise
+  if (!bdos_extensions || func > BDOS_EXT_LAST) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);
+    return;
+  }
+
+  qkz80_uint8* mem = cpu->get_mem();
+  qkz80_uint16 block = cpu->get_reg16(qkz80::regp_DE);
+
+  switch (func) {
+  case BDOS_EXT_DETECT:
+    cpu->set_reg16(BDOS_EXT_SIGNATURE, qkz80::regp_HL);
+    cpu->set_reg8(BDOS_EXT_LAST, qkz80::reg_B);
+    cpu->set_reg8(BDOS_EXT_VERSION, qkz80::reg_A);
+    break;
+
+  case BDOS_EXT_COPY_FILE:
+    bdos_ext_copy_file();
+    break;
+
+  case BDOS_EXT_READ_BLOCK:
+    bdos_ext_read_block();
+    break;
+
+  case BDOS_EXT_FILL:
+    dma_fill(param_word(mem, block), mem[(qkz80_uint16)(block + 4)],
+             param_word(mem, block + 2));
+    cpu->set_reg8(0, qkz80::reg_A);
+    break;
+
+  case BDOS_EXT_MOVE:
+    bdos_ext_move();
+    break;
+
+  case BDOS_EXT_CRC16:
+    bdos_ext_crc16();
+    break;
+
+  case BDOS_EXT_HOST_TIME:
+    bdos_ext_host_time();
+    break;
+  }
+}
+
+// Copy a whole file on the host. Same FCB layout as rename: source at DE,
+// destination name at DE+16, created like BDOS 22 and replaced if it
+// exists. Returns A=0 and HL=records copied (rounded up, at most 0FFFFh).
+void CPMEmulator::bdos_ext_copy_file() {
+  flush_all_random_writes();
+
+  qkz80_uint16 fcb_addr = cpu->get_reg16(qkz80::regp_DE);
+  std::string src_name = fcb_to_filename(fcb_addr);
+  std::string dst_name = fcb_to_filename(fcb_addr + 16);
+  std::string src_path = find_unix_file(src_name);
+
+  std::string dst_path;
+  for (char c : dst_name) {
+    dst_path += tolower(c);
+  }
+
+  if (debug || debug_bdos_funcs.count(BDOS_EXT_COPY_FILE)) {
+    fprintf(stderr, "Copy file: %s -> %s\n",
+            src_path.empty() ? "(not found)" : src_path.c_str(), dst_path.c_str());
+  }
+
+  FILE* in = src_path.empty() || src_path == dst_path ? nullptr : fopen(src_path.c_str(), "rb");
+  if (!in) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);
+    return;
+  }
+  if (file_cache) file_cache->invalidate(dst_path);
+  FILE* out = fopen(dst_path.c_str(), "wb");
+  if (!out) {
+    fclose(in);
+    cpu->set_reg8(0xFF, qkz80::reg_A);
+    return;
+  }
+
+  std::vector<uint8_t> buffer(65536);
+  unsigned long long total = 0;
+  bool ok = true;
+  size_t n;
+  while ((n = fread(buffer.data(), 1, buffer.size(), in)) > 0) {
+    if (fwrite(buffer.data(), 1, n, out) != n) {
+      ok = false;
+      break;
+    }
+    total += n;
+  }
+  fclose(in);
+  if (fclose(out) != 0) ok = false;
+
+  unsigned long long records = (total + 127) / 128;
+  cpu->set_reg16((qkz80_uint16)std::min(records, 0xFFFFULL), qkz80::regp_HL);
+  cpu->set_reg8(ok ? 0 : 0xFF, qkz80::reg_A);
+}
+
+// Sequential read of many records straight to memory, with the same
+// conversion and end of file rules as BDOS 20
+void CPMEmulator::bdos_ext_read_block() {
+  qkz80_uint8* mem = cpu->get_mem();
+  qkz80_uint16 block = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint16 fcb_addr = param_word(mem, block);
+  qkz80_uint16 addr = param_word(mem, block + 2);
+  unsigned count = param_word(mem, block + 4);
+
+  auto it = open_files.find(fcb_addr);
+  if (it == open_files.end() || !begin_stream_io(it->second, false)) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);
+    return;
+  }
+
+  qkz80_uint8 code = 0;
+  unsigned rec;
+  for (rec = 0; rec < count; rec++) {
+    qkz80_uint16 dma = addr + rec * 128;
+    size_t nread = dma_read(it->second, dma, 128, true);
+    mem[fcb_addr + 32]++;
+    if (nread == 0 || it->second.eof_seen) {
+      code = 1;
+      break;
+    }
+    if (nread < 128) {
+      dma_fill(dma + nread, CPM_EOF, 128 - nread);
+    }
+  }
+  cpu->set_reg16(rec, qkz80::regp_HL);
+  cpu->set_reg8(code, qkz80::reg_A);
+}
+
+// memmove within the 64K address space, wrapping at 0FFFFh
+void CPMEmulator::bdos_ext_move() {
+  qkz80_uint8* mem = cpu->get_mem();
+  qkz80_uint16 block = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint16 src = param_word(mem, block);
+  qkz80_uint16 dst = param_word(mem, block + 2);
+  size_t length = param_word(mem, block + 4);
+
+  std::vector<uint8_t> buffer(length);
+  for (size_t i = 0; i < length; i++) {
+    buffer[i] = mem[(qkz80_uint16)(src + i)];
+  }
+  for (size_t i = 0; i < length; i++) {
+    mem[(qkz80_uint16)(dst + i)] = buffer[i];
+  }
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+// CRC-16/XMODEM (polynomial 1021h, initial value 0), as used by XMODEM
+// and most CP/M checksum utilities
+void CPMEmulator::bdos_ext_crc16() {
+  qkz80_uint8* mem = cpu->get_mem();
+  qkz80_uint16 block = cpu->get_reg16(qkz80::regp_DE);
+  qkz80_uint16 addr = param_word(mem, block);
+  size_t length = param_word(mem, block + 2);
+
+  unsigned crc = 0;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= mem[(qkz80_uint16)(addr + i)] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  cpu->set_reg16(crc & 0xFFFF, qkz80::regp_HL);
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+// Local time in binary: year (word), month, day, hour, minute, second,
+// hundredths, then a 32-bit millisecond counter for timing intervals
+void CPMEmulator::bdos_ext_host_time() {
+  qkz80_uint8* mem = cpu->get_mem();
+  qkz80_uint16 buf = cpu->get_reg16(qkz80::regp_DE);
+
+  uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  struct tm local;
+  if (!platform::local_time((time_t)(usec / 1000000), &local)) {
+    cpu->set_reg8(0xFF, qkz80::reg_A);
+    return;
+  }
+
+  put_word(mem, buf, local.tm_year + 1900);
+  mem[(qkz80_uint16)(buf + 2)] = local.tm_mon + 1;
+  mem[(qkz80_uint16)(buf + 3)] = local.tm_mday;
+  mem[(qkz80_uint16)(buf + 4)] = local.tm_hour;
+  mem[(qkz80_uint16)(buf + 5)] = local.tm_min;
+  mem[(qkz80_uint16)(buf + 6)] = local.tm_sec;
+  mem[(qkz80_uint16)(buf + 7)] = (usec / 10000) % 100;
+  uint32_t msec = (uint32_t)(platform::monotonic_usec() / 1000);
+  put_word(mem, buf + 8, msec & 0xFFFF);
+  put_word(mem, buf + 10, msec >> 16);
+  cpu->set_reg8(0, qkz80::reg_A);
+}
+
+void CPMEmulator::bios_call(int offset) {
+  if (debug || debug_bios_offsets.count(offset)) {
+    fprintf(stderr, "BIOS call offset %d\n", offset);
+  }
+
+  switch (offset) {
+  case BIOS_CONST:
+    bios_const();
+    break;
+
+  case BIOS_CONIN:
+    bios_conin();
+    break;
+
+  case BIOS_CONOUT:
+    bios_conout();
+    break;
+
+  case BIOS_LIST:
+    bios_list();
+    break;
+
+  case BIOS_PUNCH:
+    bios_punch();
+    break;
+
+  case BIOS_READER:
+    bios_reader();
+    break;
+
+  case BIOS_LISTST:
+    bios_listst();
+    break;
+
+  case BIOS_WBOOT:
+    if (!quiet) fprintf(stderr, "BIOS WBOOT called - exiting\n");
+    request_exit(0);
+    break;
+
+  // BIOS SELDSK - Select Disk, returns HL=DPH address or 0 if invalid
+  case BIOS_SELDSK: {
+    qkz80_uint8 drive = cpu->get_reg8(qkz80::reg_C);
+    if (debug || debug_bios_offsets.count(offset)) {
+      fprintf(stderr, "BIOS SELDSK: drive %c\n", 'A' + drive);
+    }
+    if (drive == 0) {
+      // Drive A: - return DPH address in HL
+      cpu->set_reg8(DPH_ADDR & 0xFF, qkz80::reg_L);
+      cpu->set_reg8((DPH_ADDR >> 8) & 0xFF, qkz80::reg_H);
+    } else {
+      // Invalid drive - return 0
+      cpu->set_reg8(0x00, qkz80::reg_L);
+      cpu->set_reg8(0x00, qkz80::reg_H);
+    }
+    break;
+  }
+
+  // Other disk I/O functions - behavior controlled by bios_disk_mode
+  case BIOS_HOME:
+  case BIOS_SETTRK:
+  case BIOS_SETSEC:
+  case BIOS_SETDMA:
+  case BIOS_READ:
+  case BIOS_WRITE:
+  case BIOS_SECTRAN:
+    if (bios_disk_mode == 2) {
+      // Error mode - exit emulator
+      fprintf(stderr, "FATAL: Unimplemented BIOS disk function at offset %d\n", offset);
+      fprintf(stderr, "This emulator handles file I/O at the BDOS level.\n");
+      fprintf(stderr, "Set CPM_BIOS_DISK=ok or CPM_BIOS_DISK=fail to change this behavior.\n");
+      request_exit(1);
+    } else if (bios_disk_mode == 1) {
+      // Fail mode - return error to caller
+      cpu->set_reg8(0x00, qkz80::reg_A);  // Return failure
+      if (debug || debug_bios_offsets.count(offset)) {
+        fprintf(stderr, "BIOS disk function at offset %d - returning failure\n", offset);
+      }
+    } else {
+      // OK mode (default) - return success
+      cpu->set_reg8(0x00, qkz80::reg_A);  // Return success (0 = OK for BIOS disk)
+      if (debug || debug_bios_offsets.count(offset)) {
+        fprintf(stderr, "BIOS disk function at offset %d - returning success\n", offset);
+      }
+    }
+    break;
+
+  default:
+    if (debug) {
+      fprintf(stderr, "Unimplemented BIOS function at offset %d\n", offset);
+    }
+    break;
+  }
+}
+
+void CPMEmulator::bios_const() {
+  // Console status - return 0xFF if character ready, 0x00 if not
+  bool ready = console_ready();
+  note_console_poll(ready);
+  cpu->set_reg8(ready ? 0xFF : 0x00, qkz80::reg_A);
+}
+
+void CPMEmulator::bios_conin() {
+  // Console input
+  if (input_would_block()) return;
+  int ch = console_in();
+  if (ch == -1 || ch == EOF) ch = 0x1A;
+  check_ctrl_c_exit(ch);  // Track ^C for exit, pass through to program
+  if (ch == '\n') ch = '\r';  // Convert LF to CR for CP/M
+  cpu->set_reg8(ch & 0x7F, qkz80::reg_A);
+}
+
+void CPMEmulator::bios_conout() {
+  // Console output - character is in C register
+  qkz80_uint8 ch = cpu->get_reg8(qkz80::reg_C);
+  console_out(ch & 0x7F);
+  console_flush();
+}
+
+void CPMEmulator::bios_list() {
+  // List (printer) output - character is in C register
+  qkz80_uint8 ch = cpu->get_reg8(qkz80::reg_C);
+  list_out(ch & 0x7F);
+}
+
+void CPMEmulator::bios_punch() {
+  // Punch (aux output) - character is in C register
+  qkz80_uint8 ch = cpu->get_reg8(qkz80::reg_C);
+  if (aux_out_file) {
+    fputc(ch & 0x7F, aux_out_file);
+    fflush(aux_out_file);
+  } else {
+    // No aux output file - output to stdout with prefix
+    fprintf(stdout, "[PUNCH] %c", ch & 0x7F);
+    fflush(stdout);
+  }
+}
+
+void CPMEmulator::bios_reader() {
+  // Reader (aux input) - return character in A register
+  if (aux_in_file) {
+    int ch = fgetc(aux_in_file);
+    if (ch == EOF) ch = 0x1A;  // ^Z on EOF
+    cpu->set_reg8(ch & 0x7F, qkz80::reg_A);
+  } else {
+    // No aux input file - return ^Z
+    cpu->set_reg8(0x1A, qkz80::reg_A);
+  }
+}
+
+void CPMEmulator::bios_listst() {
+  // List (printer) status - return 0xFF if ready, 0x00 if not
+  // Always return ready (0xFF)
+  cpu->set_reg8(0xFF, qkz80::reg_A);
+}
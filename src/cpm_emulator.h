@@ -0,0 +1,468 @@
+/*
+ * CP/M 2.2 Emulator - CP/M system layer
+ *
+ * CPMEmulator wraps a qkz80 CPU and provides the CP/M environment:
+ * page zero, BDOS/BIOS traps, file I/O translation to the host
+ * filesystem and device redirection. It is independent of main() so
+ * several instances can be hosted in one process.
+ */
+
+#ifndef CPM_EMULATOR_H
+#define CPM_EMULATOR_H
+
+#include "qkz80.h"
+#include "cpm_filecache.h"
+#include <stdio.h>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class CPMAotCode;
+class CPMLoopIdioms;
+class CPMPeripheralBus;
+class CPMTerminal;
+
+// CP/M Memory Layout Constants
+#define TPA_START      0x0100
+#define BOOT_ADDR      0x0000
+#define IOBYTE_ADDR    0x0003
+#define DRVUSER_ADDR   0x0004
+#define BDOS_ENTRY     0x0005
+#define DEFAULT_FCB    0x005C
+#define DEFAULT_FCB2   0x006C
+#define DEFAULT_DMA    0x0080
+#define DMA_SIZE       128
+#define CPM_EOF        0x1A  // ^Z
+
+// BIOS/BDOS placement (for 64K system)
+// Compressed layout since we only need jump tables, not full code
+#define BIOS_BASE      0xFE00  // BIOS starts here (17 jumps * 3 = 51 bytes)
+#define BDOS_BASE      0xFD00  // BDOS starts here (40 jumps * 3 = 120 bytes)
+#define CCP_BASE       0xFC00  // CCP starts here (gives max TPA)
+
+// BIOS function offsets from BIOS_BASE
+#define BIOS_BOOT      0
+#define BIOS_WBOOT     3
+#define BIOS_CONST     6   // Console status
+#define BIOS_CONIN     9   // Console input
+#define BIOS_CONOUT    12  // Console output
+#define BIOS_LIST      15  // List output
+#define BIOS_PUNCH     18  // Punch output
+#define BIOS_READER    21  // Reader input
+#define BIOS_HOME      24  // Home disk
+#define BIOS_SELDSK    27  // Select disk
+#define BIOS_SETTRK    30  // Set track
+#define BIOS_SETSEC    33  // Set sector
+#define BIOS_SETDMA    36  // Set DMA
+#define BIOS_READ      39  // Read sector
+#define BIOS_WRITE     42  // Write sector
+
+// Reserved memory area for system tables
+#define DPH_ADDR       0xFAE0  // Disk Parameter Header (16 bytes)
+#define DPB_ADDR       0xFAF0  // Disk Parameter Block (15 bytes)
+#define DIRBUF_ADDR    0xFB00  // Directory buffer (128 bytes)
+#define ALV_ADDR       0xFB80  // Allocation Vector (64 bytes for 512 blocks)
+#define CSV_ADDR       0xFBC0  // Check Vector (not used, but referenced)
+#define BIOS_LISTST    45  // List status
+#define BIOS_SECTRAN   48  // Sector translate
+
+// Extension BDOS functions for cpmemu-aware tools, reserved range 224-239.
+// Only answered when CPMEmulator::bdos_extensions is set; otherwise they
+// return A=0FFh, HL=0 like an unknown function. Multi-argument calls take
+// a parameter block at DE (little-endian words).
+#define BDOS_EXT_FIRST      224
+#define BDOS_EXT_RESERVED   239
+#define BDOS_EXT_DETECT     224  // HL=BDOS_EXT_SIGNATURE, A=version, B=last function
+#define BDOS_EXT_COPY_FILE  225  // DE=FCB, new name at +16 as for rename; HL=records
+#define BDOS_EXT_READ_BLOCK 226  // DE->{fcb, address, records}; A=0/1 (EOF), HL=records
+#define BDOS_EXT_FILL       227  // DE->{address, length, byte}
+#define BDOS_EXT_MOVE       228  // DE->{source, destination, length}, overlap safe
+#define BDOS_EXT_CRC16      229  // DE->{address, length}; HL=CRC-16/XMODEM
+#define BDOS_EXT_HOST_TIME  230  // DE->12-byte buffer, see bdos_ext_host_time()
+#define BDOS_EXT_LAST       230
+#define BDOS_EXT_VERSION    1
+#define BDOS_EXT_SIGNATURE  0x5158  // "QX"
+
+// File modes
+enum FileMode {
+  MODE_BINARY,
+  MODE_TEXT,
+  MODE_AUTO
+};
+
+// File mapping entry
+struct FileMapping {
+  std::string cpm_pattern;
+  std::string unix_pattern;
+  FileMode mode;
+  bool eol_convert;
+
+  FileMapping() : mode(MODE_AUTO), eol_convert(true) {}
+};
+
+// FCB structure
+struct FCB {
+  qkz80_uint8 drive;        // 0 = default, 1 = A:, 2 = B:, etc.
+  char name[8];             // Filename, space-padded
+  char ext[3];              // Extension, space-padded
+  qkz80_uint8 ex;           // Extent number
+  qkz80_uint8 s1;           // Reserved
+  qkz80_uint8 s2;           // Reserved
+  qkz80_uint8 rc;           // Record count
+  qkz80_uint8 al[16];       // Allocation map
+  qkz80_uint8 cr;           // Current record
+  qkz80_uint8 r0, r1, r2;   // Random record number
+};
+
+// Open file tracking
+struct OpenFile {
+  FILE* fp;
+  std::string unix_path;
+  std::string cpm_name;
+  FileMode mode;
+  bool eol_convert;
+  int position;  // Current record position
+  bool eof_seen;
+  bool write_mode;
+  std::vector<uint8_t> write_buffer;  // Buffer for EOL conversion on write
+
+  // Random record access (BDOS 33/34/40)
+  long host_pos;                     // Offset of the stdio stream, -1 if unknown
+  long logical_pos;                  // Where sequential I/O resumes, -1 = host_pos
+  long last_random_pos;              // Offset of the previous random read
+  long stride;                       // Distance between the last two random reads
+  int stride_hits;                   // Consecutive random reads at that stride
+  std::vector<uint8_t> window;       // Prefetched file data
+  long window_pos;                   // File offset of window[0]
+  bool window_eof;                   // Window ends at end of file
+  std::vector<uint8_t> write_batch;  // Adjacent random writes not yet written
+  long batch_pos;                    // File offset of write_batch[0]
+  bool write_error;                  // A batch failed to reach the file
+
+  // Host handle pool: fp is closed when evicted and reopened on next use
+  bool writable;                     // Reopen with "r+b" rather than "rb"
+  long saved_pos;                    // Stream offset at eviction
+  bool pooled;                       // fp is in the handle LRU
+  std::list<OpenFile*>::iterator lru_pos;
+
+  // Contents from the shared file cache; fp then reads from memory until
+  // the first write moves the file to a host handle
+  CPMFileCache::Content cache_data;
+  bool text_view;                    // cache_data is the CP/M view of a text file
+  bool modified;                     // Written through this handle
+
+  OpenFile() : fp(nullptr), mode(MODE_BINARY), eol_convert(false),
+    position(0), eof_seen(false), write_mode(false),
+    host_pos(-1), logical_pos(-1), last_random_pos(-1), stride(0),
+    stride_hits(0), window_pos(0), window_eof(false), batch_pos(0),
+    write_error(false),
+    writable(false), saved_pos(0), pooled(false), text_view(false),
+    modified(false) {}
+};
+
+class CPMEmulator {
+private:
+  qkz80* cpu;
+  qkz80_uint8 current_drive;
+  qkz80_uint8 current_user;
+  qkz80_uint16 current_dma;
+  qkz80_uint8 multi_sector_count;  // Records per file transfer (BDOS 44)
+  qkz80_uint8 bdos_error_mode;     // BDOS 45, recorded only
+  bool debug;
+  FileMode default_mode;
+  bool default_eol_convert;
+
+  // File mapping with patterns and modes
+  std::vector<FileMapping> file_mappings;
+
+  // Legacy simple file mapping for backward compatibility
+  std::map<std::string, std::string> file_map;
+
+  // Open files indexed by FCB address
+  std::map<qkz80_uint16, OpenFile> open_files;
+
+  // Open files holding a host handle, most recently used first
+  std::list<OpenFile*> handle_lru;
+
+  // Command line arguments
+  std::vector<std::string> args;
+
+  // Device redirection files
+  FILE* printer_file;      // LST: device (LPRINT)
+  FILE* aux_in_file;       // RDR: device (Auxiliary input)
+  FILE* aux_out_file;      // PUN: device (Auxiliary output)
+  qkz80_uint8 iobyte;      // IOBYTE for device mapping
+
+  // Directory search state for BDOS 17/18
+  std::vector<std::string> search_results;  // List of matching files
+  size_t search_index;                       // Current position in search
+  std::string search_pattern;                // FCB pattern for search
+  qkz80_uint8 search_user;                   // User number for search
+
+  // Run state
+  bool exit_requested;       // Program has terminated
+  int exit_status;           // Process exit status to report
+  int consecutive_ctrl_c;    // ^C count toward the 5x exit
+
+  // Console input parking (see park_on_input)
+  enum InputWait {
+    WAIT_NONE,
+    WAIT_RETRY,   // Console read would block, trap is retried later
+    WAIT_IDLE     // Guest is spinning on console status
+  };
+  InputWait input_wait;
+  int idle_polls;            // Consecutive status polls with no input
+  unsigned long long last_poll_cycles;  // CPU cycles at the last status poll
+
+  // Real-time pacing (see set_clock_rate)
+  double pace_hz;
+  unsigned long long pace_next_cycles;   // Cycle count of the next check
+  unsigned long long pace_batch_cycles;  // Cycles between checks
+  unsigned long long pace_anchor_cycles; // Cycle count at pace_anchor_usec
+  uint64_t pace_anchor_usec;
+  int line_count;            // BDOS 10 characters read before parking
+  bool line_active;          // BDOS 10 line is partially read
+
+public:
+  enum RunStatus {
+    RUN_BUDGET,    // Instruction budget used up, guest still runnable
+    RUN_BLOCKED,   // Guest is waiting for console input
+    RUN_EXITED     // Guest program terminated
+  };
+
+  // Program name from config file
+  std::string config_program;
+
+  // Public debug settings for selective debugging
+  std::set<int> debug_bdos_funcs;  // Which BDOS functions to debug
+  std::set<int> debug_bios_offsets; // Which BIOS offsets to debug
+
+  // Disk BIOS behavior: 0=ok, 1=fail, 2=error
+  int bios_disk_mode;
+
+  // Timer interrupt: RST int_rst every int_cycles cycles (0 = disabled)
+  unsigned long long int_cycles;
+  int int_rst;
+  unsigned long long next_tick_cycles;
+
+  // CTC/SIO devices serviced by run() at their cycle deadlines (not
+  // owned, nullptr = none)
+  CPMPeripheralBus* peripherals;
+
+  // Shared cache for file contents (not owned, nullptr = off)
+  CPMFileCache* file_cache;
+
+  // Screen model the default console output goes through (not owned,
+  // nullptr = bytes go straight to stdout)
+  CPMTerminal* terminal;
+
+  // Compiled blocks of the loaded program, run in place of the
+  // interpreter where they apply (not owned, nullptr = interpret all)
+  CPMAotCode* aot;
+
+  // Delay, fill and copy loops run a batch of iterations at a time (not
+  // owned, nullptr = one instruction at a time)
+  CPMLoopIdioms* loop_idioms;
+
+  // Instructions executed by run() so far
+  long long instruction_count;
+
+  // BDOS and BIOS calls serviced by run() so far
+  unsigned long long trap_count;
+
+  // Host FILE handles kept open at once; older ones are closed and
+  // transparently reopened at the same offset on their next use
+  size_t max_host_files;
+
+  // When set, console reads never block: run() returns RUN_BLOCKED and
+  // the call is retried on the next run(). Used when many instances
+  // share a thread.
+  bool park_on_input;
+
+  // Suppress the program exit notices on stderr
+  bool quiet;
+
+  // Answer the extension BDOS functions (BDOS_EXT_*)
+  bool bdos_extensions;
+
+  CPMEmulator(qkz80* acpu, bool adebug = false)
+    : cpu(acpu), current_drive(0), current_user(0),
+      current_dma(DEFAULT_DMA), multi_sector_count(1), bdos_error_mode(0),
+      debug(adebug),
+      default_mode(MODE_AUTO), default_eol_convert(true),
+      printer_file(nullptr), aux_in_file(nullptr),
+      aux_out_file(nullptr), iobyte(0),
+      search_index(0), search_user(0),
+      exit_requested(false), exit_status(0), consecutive_ctrl_c(0),
+      input_wait(WAIT_NONE), idle_polls(0), last_poll_cycles(0),
+      pace_hz(0), pace_next_cycles(~0ULL), pace_batch_cycles(0),
+      pace_anchor_cycles(0), pace_anchor_usec(0),
+      line_count(0), line_active(false),
+      bios_disk_mode(0), int_cycles(0), int_rst(7), next_tick_cycles(0),
+      peripherals(nullptr), file_cache(nullptr), terminal(nullptr), aot(nullptr),
+      loop_idioms(nullptr), instruction_count(0), trap_count(0), max_host_files(16),
+      park_on_input(false), quiet(false), bdos_extensions(false) {
+  }
+
+  virtual ~CPMEmulator();
+
+  void setup_memory();
+  void setup_command_line(int argc, char** argv, int program_arg_index = 1);
+  void add_file_mapping(const std::string& cpm_name, const std::string& unix_path);
+  void add_file_mapping_ex(const std::string& cpm_pattern, const std::string& unix_pattern,
+                           FileMode mode = MODE_AUTO, bool eol_convert = true);
+  bool load_config_file(const std::string& cfg_path);
+  bool handle_pc(qkz80_uint16 pc);
+
+  // Execute up to max_instructions, servicing CP/M traps and the timer
+  // interrupt. Returns early when the program exits or parks on input.
+  RunStatus run(long long max_instructions);
+
+  void enable_timer_interrupt(unsigned long long cycles, int rst);
+
+  // Run at hz CPU cycles per second of host time (0 = full speed). Uses
+  // the CPU cycle counter and sleeps in batches of a few milliseconds.
+  void set_clock_rate(double hz);
+  void request_exit(int status);
+  bool has_exited() const { return exit_requested; }
+  int get_exit_status() const { return exit_status; }
+  bool waiting_on_read() const { return input_wait == WAIT_RETRY; }
+  qkz80* get_cpu() { return cpu; }
+
+  // Console and list device hooks - override in subclass to redirect
+  virtual void console_out(qkz80_uint8 ch);
+  virtual void console_flush();
+  virtual int console_in();        // Blocking read, -1 on EOF
+  virtual bool console_ready();    // True if console_in() won't block
+  virtual void console_idle(int ms);  // Guest is spinning on status: wait for input
+  virtual void list_out(qkz80_uint8 ch);
+
+  // Device redirection
+  void set_printer_file(const std::string& path);
+  void set_aux_input_file(const std::string& path);
+  void set_aux_output_file(const std::string& path);
+
+private:
+  // File I/O helpers
+  FileMode detect_file_mode(const std::string& filename, const std::string& unix_path);
+  std::string find_unix_file_ex(const std::string& cpm_name, FileMode* mode_out, bool* eol_out);
+  bool match_pattern(const std::string& pattern, const std::string& text);
+
+  // EOL and EOF handling
+  size_t read_with_conversion(OpenFile& of, uint8_t* buffer, size_t size);
+  size_t write_with_conversion(OpenFile& of, const uint8_t* buffer, size_t size);
+
+  // Bytes of a text file as the guest reads it, or -1 if unreadable
+  int64_t text_file_size(const std::string& unix_path);
+
+  // Transfers between files and guest memory at addr, wrapping at 0xFFFF.
+  // convert selects read/write_with_conversion instead of raw fread/fwrite.
+  size_t dma_read(OpenFile& of, qkz80_uint16 addr, size_t size, bool convert);
+  size_t dma_write(OpenFile& of, qkz80_uint16 addr, size_t size, bool convert);
+  void dma_fill(qkz80_uint16 addr, qkz80_uint8 value, size_t size);
+  void set_transfer_result(qkz80_uint8 code, unsigned records);
+
+  // Random record access with stride detection, prefetch and write
+  // batching. Sequential I/O must call begin_stream_io() first. A batch
+  // that fails to reach the file fails the next call on its FCB.
+  bool random_read(OpenFile& of, long pos, qkz80_uint16 dma, size_t size, size_t* nread);
+  bool random_write(OpenFile& of, long pos, qkz80_uint16 dma, size_t size);
+  bool flush_random_writes(OpenFile& of);
+  bool take_write_error(OpenFile& of);
+  void flush_all_random_writes();
+  bool file_seek(OpenFile& of, long pos);
+  bool begin_stream_io(OpenFile& of, bool writing);
+  bool close_open_file(OpenFile& of);
+
+  // Host handle pool
+  void add_open_file(qkz80_uint16 fcb_addr, const OpenFile& of);
+  bool ensure_open(OpenFile& of, bool writing = false);
+  void touch_handle(OpenFile& of);
+  void evict_handle(OpenFile& of);
+
+  // Console input helpers
+  bool check_ctrl_c_exit(int ch);
+  bool input_would_block();
+  void note_console_poll(bool ready);
+  void pace();
+  void skip_halt();
+  unsigned long long next_event_cycles() const;
+
+private:
+  // BDOS functions
+  void bdos_call(qkz80_uint8 func);
+  void bdos_write_console(qkz80_uint8 ch);
+  void bdos_write_string();
+  void bdos_read_console();
+  void bdos_read_console_buffer();
+  void bdos_aux_input();
+  void bdos_aux_output();
+  void bdos_list_output();
+  void bdos_get_iobyte();
+  void bdos_set_iobyte();
+  void bdos_console_status();
+  void bdos_get_version();
+  void bdos_direct_console_io();
+  void bdos_reset_disk();
+  void bdos_get_set_dma();
+  void bdos_open_file();
+  void bdos_close_file();
+  void bdos_read_sequential();
+  void bdos_write_sequential();
+  void bdos_make_file();
+  void bdos_rename_file();
+  void bdos_delete_file();
+  void bdos_read_random();
+  void bdos_write_random();
+  void bdos_file_size();
+  void bdos_set_random_record();
+  void bdos_search_first();
+  void bdos_search_next();
+  void bdos_get_current_drive();
+  void bdos_set_drive();
+  void bdos_get_set_user();
+  void bdos_get_login_vector();
+  void bdos_get_allocation_vector();
+  void bdos_write_protect_disk();
+  void bdos_get_readonly_vector();
+  void bdos_set_file_attributes();
+  void bdos_get_dpb();
+  void bdos_reset_drive();
+  void bdos_write_random_zero_fill();
+  void bdos_set_multi_sector_count();
+  void bdos_get_disk_free_space();
+  void bdos_flush_buffers();
+  void bdos_get_date_time();
+
+  // Extension functions
+  void bdos_extension(qkz80_uint8 func);
+  void bdos_ext_copy_file();
+  void bdos_ext_read_block();
+  void bdos_ext_move();
+  void bdos_ext_crc16();
+  void bdos_ext_host_time();
+
+  // BIOS functions
+  void bios_call(int offset);
+  void bios_const();   // Console status
+  void bios_conin();   // Console input
+  void bios_conout();  // Console output
+  void bios_list();    // List (printer) output
+  void bios_punch();   // Punch (aux output)
+  void bios_reader();  // Reader (aux input)
+  void bios_listst();  // List status
+
+  // Helper functions
+  std::string fcb_to_filename(qkz80_uint16 fcb_addr);
+  void filename_to_fcb(const std::string& filename, qkz80_uint16 fcb_addr);
+  std::string find_unix_file(const std::string& cpm_name);
+  void read_fcb(qkz80_uint16 addr, FCB* fcb);
+  void write_fcb(qkz80_uint16 addr, const FCB* fcb);
+  std::string normalize_cpm_filename(const std::string& name);
+  bool match_wildcard(const std::string& pattern, const std::string& text);
+};
+
+#endif // CPM_EMULATOR_H
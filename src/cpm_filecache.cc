@@ -0,0 +1,135 @@
+/*
+ * Shared read-only file content cache
+ */
+
+#include "cpm_filecache.h"
+#include "os/platform.h"
+#include <stdio.h>
+#include <algorithm>
+
+static const uint8_t CPM_TEXT_EOF = 0x1A;  // ^Z
+
+CPMFileCache::CPMFileCache(size_t abudget)
+  : budget(abudget), used(0) {
+}
+
+CPMFileCache::Content CPMFileCache::get(const std::string& path) {
+  int64_t size, mtime_ns;
+  if (!platform::get_file_version(path.c_str(), &size, &mtime_ns) ||
+      size <= 0 || (uint64_t)size > budget / 4) {
+    return Content();
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+      if (it->second.size == size && it->second.mtime_ns == mtime_ns) {
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        return it->second.data;
+      }
+      remove(it);  // Changed on the host
+    }
+  }
+
+  // Load outside the lock; a racing load of the same file just wins or
+  // loses the insert below
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (!fp) {
+    return Content();
+  }
+  std::shared_ptr<std::vector<uint8_t> > data(new std::vector<uint8_t>((size_t)size));
+  size_t n = fread(data->data(), 1, data->size(), fp);
+  fclose(fp);
+  if (n != data->size()) {
+    return Content();  // Changed while reading
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (entries.count(path)) {
+    remove(entries.find(path));
+  }
+  lru.push_front(path);
+  Entry& entry = entries[path];
+  entry.size = size;
+  entry.mtime_ns = mtime_ns;
+  entry.data = data;
+  entry.lru_pos = lru.begin();
+  used += (size_t)size;
+
+  while (used > budget && lru.size() > 1) {
+    remove(entries.find(lru.back()));
+  }
+  return data;
+}
+
+CPMFileCache::Content CPMFileCache::get_text(const std::string& path) {
+  Content raw = get(path);
+  if (!raw) {
+    return Content();
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(path);
+    if (it != entries.end() && it->second.data == raw && it->second.text) {
+      return it->second.text;
+    }
+  }
+
+  Content text = text_view(raw->data(), raw->size());
+
+  // Keep it only if the file was not reloaded or dropped meanwhile
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = entries.find(path);
+  if (it != entries.end() && it->second.data == raw && !it->second.text) {
+    it->second.text = text;
+    used += text->size();
+    while (used > budget && lru.size() > 1) {
+      remove(entries.find(lru.back()));
+    }
+  }
+  return text;
+}
+
+void CPMFileCache::invalidate(const std::string& path) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = entries.find(path);
+  if (it != entries.end()) {
+    remove(it);
+  }
+}
+
+void CPMFileCache::remove(std::map<std::string, Entry>::iterator it) {
+  used -= (size_t)it->second.size;
+  if (it->second.text) used -= it->second.text->size();
+  lru.erase(it->second.lru_pos);
+  entries.erase(it);
+}
+
+CPMFileCache::Content CPMFileCache::text_view(const uint8_t* data, size_t size) {
+  std::shared_ptr<std::vector<uint8_t> > view(new std::vector<uint8_t>());
+  view->reserve(size + size / 16 + 128);
+  for (size_t i = 0; i < size && data[i] != CPM_TEXT_EOF; i++) {
+    if (data[i] == '\n') {
+      view->push_back('\r');
+    }
+    view->push_back(data[i]);
+  }
+  while (view->size() % 128 != 0) {
+    view->push_back(CPM_TEXT_EOF);
+  }
+  return view;
+}
+
+long CPMFileCache::host_offset(const std::vector<uint8_t>& view, long pos) {
+  // Every CR just before an LF was added by text_view()
+  long offset = 0;
+  long end = std::min(pos, (long)view.size());
+  for (long i = 0; i < end && view[i] != CPM_TEXT_EOF; i++) {
+    if (!(view[i] == '\r' && i + 1 < (long)view.size() && view[i + 1] == '\n')) {
+      offset++;
+    }
+  }
+  return offset;
+}
@@ -0,0 +1,75 @@
+/*
+ * Shared read-only file content cache
+ *
+ * Overlay programs and compiler passes reopen and reread the same files
+ * many times. CPMFileCache keeps whole file contents in memory keyed by
+ * host path, and checks size and modification time on every lookup, so a
+ * file changed on the host is loaded again. Opens served from the cache
+ * read through a memory stream: one stat() per open and no read syscalls.
+ *
+ * Text files are also kept as their CP/M view, converted once: LF becomes
+ * CR LF, data ends at the first ^Z and the last record is padded with ^Z.
+ * Reads of that view are plain binary reads, so record numbers and file
+ * sizes match what the guest sees.
+ *
+ * One cache can be shared by any number of CPMEmulator instances and
+ * threads. Contents are reference counted, so evicting or invalidating an
+ * entry never disturbs a file that is still open.
+ */
+
+#ifndef CPM_FILECACHE_H
+#define CPM_FILECACHE_H
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class CPMFileCache {
+public:
+  typedef std::shared_ptr<const std::vector<uint8_t> > Content;
+
+  // budget: bytes of file data kept at most. Files larger than a quarter
+  // of the budget are never cached.
+  explicit CPMFileCache(size_t budget);
+
+  // Contents of the file at path, loading it on a miss. Returns nullptr
+  // if the file cannot be read, is empty or is too large.
+  Content get(const std::string& path);
+
+  // CP/M view of the text file at path, converting it on first use.
+  // Returns nullptr where get() would.
+  Content get_text(const std::string& path);
+
+  // Drop path after this process changes the file
+  void invalidate(const std::string& path);
+
+  // Convert host text to its CP/M view, as read_with_conversion() would
+  // return it, padded to whole 128-byte records
+  static Content text_view(const uint8_t* data, size_t size);
+
+  // Host file offset of pos in a view made by text_view()
+  static long host_offset(const std::vector<uint8_t>& view, long pos);
+
+private:
+  struct Entry {
+    int64_t size;
+    int64_t mtime_ns;
+    Content data;
+    Content text;                 // CP/M view, nullptr until asked for
+    std::list<std::string>::iterator lru_pos;
+  };
+
+  std::mutex lock;
+  std::map<std::string, Entry> entries;
+  std::list<std::string> lru;   // Most recently used first
+  size_t budget;
+  size_t used;
+
+  void remove(std::map<std::string, Entry>::iterator it);
+};
+
+#endif // CPM_FILECACHE_H
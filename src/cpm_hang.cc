@@ -0,0 +1,158 @@
+/*
+ * Hang and livelock detection
+ */
+
+#include "cpm_hang.h"
+#include <string.h>
+
+// Instructions single-stepped by each check
+static const int PROBE_STEPS = 256;
+
+// A spin must stay within this many bytes of code
+static const unsigned SPIN_RANGE = 256;
+
+static const int STATE_WORDS = 16;
+
+// Everything execute() depends on apart from memory. R is left out: it
+// counts instructions and never feeds back into a loop that ignores it.
+static void capture_state(qkz80* cpu, qkz80_uint16* state) {
+  qkz80_reg_set& r = cpu->regs;
+  state[0] = r.AF.get_pair16();
+  state[1] = r.BC.get_pair16();
+  state[2] = r.DE.get_pair16();
+  state[3] = r.HL.get_pair16();
+  state[4] = r.SP.get_pair16();
+  state[5] = r.PC.get_pair16();
+  state[6] = r.IX.get_pair16();
+  state[7] = r.IY.get_pair16();
+  state[8] = r.AF_.get_pair16();
+  state[9] = r.BC_.get_pair16();
+  state[10] = r.DE_.get_pair16();
+  state[11] = r.HL_.get_pair16();
+  state[12] = r.I;
+  state[13] = (qkz80_uint16)((r.IFF1 << 8) | r.IFF2);
+  state[14] = r.IM;
+  state[15] = (qkz80_uint16)((cpu->ei_delay << 8) | cpu->is_halted());
+}
+
+CPMHangDetector::CPMHangDetector(CPMEmulator* acpm, long long awindow)
+  : cpm(acpm), cpu(acpm->get_cpu()), window(awindow),
+    last_activity(0), window_start(0), range_lo(0), range_hi(0), range_valid(false) {
+  restart_window();
+}
+
+unsigned long long CPMHangDetector::activity() const {
+  return cpm->trap_count + cpu->port_ops;
+}
+
+void CPMHangDetector::restart_window() {
+  last_activity = activity();
+  window_start = cpm->instruction_count;
+  range_valid = false;
+}
+
+void CPMHangDetector::note_pc(qkz80_uint16 pc) {
+  if (!range_valid) {
+    range_lo = range_hi = pc;
+    range_valid = true;
+  } else if (pc < range_lo) {
+    range_lo = pc;
+  } else if (pc > range_hi) {
+    range_hi = pc;
+  }
+}
+
+// FNV-1a over the whole address space
+unsigned CPMHangDetector::memory_hash() const {
+  const qkz80_uint8* mem = cpu->get_mem();
+  unsigned hash = 2166136261u;
+  for (unsigned i = 0; i < 0x10000; i++) {
+    hash = (hash ^ mem[i]) * 16777619u;
+  }
+  return hash;
+}
+
+CPMHangDetector::Verdict CPMHangDetector::check() {
+  if (activity() != last_activity) {
+    restart_window();
+  }
+
+  // A timer or peripheral interrupt can change the outcome of any loop
+  bool interrupts = cpm->int_cycles > 0 || cpm->peripherals;
+  bool deterministic = !(interrupts && cpu->regs.IFF1) &&
+                       !cpu->int_pending && !cpu->nmi_pending;
+
+  qkz80_uint16 start[STATE_WORDS];
+  capture_state(cpu, start);
+  unsigned start_hash = deterministic ? memory_hash() : 0;
+  bool hash_checked = false;
+
+  for (int step = 0; step < PROBE_STEPS; step++) {
+    note_pc(cpu->regs.PC.get_pair16());
+    if (cpm->run(1) != CPMEmulator::RUN_BUDGET || activity() != last_activity) {
+      restart_window();
+      return HANG_NONE;
+    }
+
+    // Memory is only hashed again the first time the registers repeat
+    if (deterministic && !hash_checked) {
+      qkz80_uint16 now[STATE_WORDS];
+      capture_state(cpu, now);
+      if (memcmp(now, start, sizeof(now)) == 0) {
+        hash_checked = true;
+        if (memory_hash() == start_hash) {
+          return HANG_STATE_LOOP;
+        }
+      }
+    }
+  }
+
+  if ((unsigned)(range_hi - range_lo) >= SPIN_RANGE) {
+    restart_window();
+    return HANG_NONE;
+  }
+  if (cpm->instruction_count - window_start >= window) {
+    return HANG_SPIN;
+  }
+  return HANG_NONE;
+}
+
+const char* CPMHangDetector::describe(Verdict verdict) {
+  switch (verdict) {
+  case HANG_STATE_LOOP: return "machine state repeats with no I/O";
+  case HANG_SPIN: return "looping in a small code range with no I/O";
+  default: return "running";
+  }
+}
+
+void CPMHangDetector::dump_state(FILE* fp) const {
+  qkz80_reg_set& r = cpu->regs;
+  const qkz80_uint8* mem = cpu->get_mem();
+
+  fprintf(fp, "PC=%04X SP=%04X AF=%04X BC=%04X DE=%04X HL=%04X IX=%04X IY=%04X\n",
+          r.PC.get_pair16(), r.SP.get_pair16(), r.AF.get_pair16(), r.BC.get_pair16(),
+          r.DE.get_pair16(), r.HL.get_pair16(), r.IX.get_pair16(), r.IY.get_pair16());
+  fprintf(fp, "AF'=%04X BC'=%04X DE'=%04X HL'=%04X I=%02X R=%02X IFF1=%d IFF2=%d IM=%d\n",
+          r.AF_.get_pair16(), r.BC_.get_pair16(), r.DE_.get_pair16(), r.HL_.get_pair16(),
+          r.I, r.R, r.IFF1, r.IFF2, r.IM);
+
+  fprintf(fp, "Stack:");
+  qkz80_uint16 sp = r.SP.get_pair16();
+  for (int i = 0; i < 8; i++) {
+    qkz80_uint16 addr = sp + i * 2;
+    fprintf(fp, " %04X", mem[addr] | (mem[(qkz80_uint16)(addr + 1)] << 8));
+  }
+  fprintf(fp, "\nCode: ");
+  qkz80_uint16 pc = r.PC.get_pair16();
+  for (int i = 0; i < 16; i++) {
+    fprintf(fp, " %02X", mem[(qkz80_uint16)(pc + i)]);
+  }
+  fprintf(fp, "\n");
+
+  if (range_valid) {
+    fprintf(fp, "PC range %04X-%04X for %lld instructions without BDOS, BIOS or port I/O\n",
+            range_lo, range_hi, cpm->instruction_count - window_start);
+  }
+  fprintf(fp, "%lld instructions, %llu BDOS/BIOS calls, %llu port I/O\n",
+          cpm->instruction_count, cpm->trap_count, cpu->port_ops);
+}
@@ -0,0 +1,61 @@
+/*
+ * Hang and livelock detection
+ *
+ * CPMHangDetector is called between run() slices and looks for guests
+ * that can never make progress:
+ *
+ * - State loop: the full machine state (registers and all 64K of memory)
+ *   repeats with no BDOS/BIOS call, port I/O or interrupt source in
+ *   between. Execution is deterministic, so the guest is provably stuck.
+ *
+ * - Spin: no BDOS/BIOS call or port I/O and a PC confined to a small
+ *   address range for a whole window of instructions. This catches wait
+ *   loops on counters that will never match, and is a heuristic.
+ *
+ * Each check single-steps a short probe to collect the PC range and look
+ * for a repeated state, so the cost is independent of the slice length.
+ */
+
+#ifndef CPM_HANG_H
+#define CPM_HANG_H
+
+#include "cpm_emulator.h"
+#include <stdio.h>
+
+class CPMHangDetector {
+public:
+  enum Verdict {
+    HANG_NONE,
+    HANG_STATE_LOOP,   // Machine state repeated exactly
+    HANG_SPIN          // Small PC range with no activity for the window
+  };
+
+  // window: instructions without activity before a spin is reported
+  CPMHangDetector(CPMEmulator* cpm, long long window);
+
+  // Probe the guest; call every slice of a million or so instructions
+  Verdict check();
+
+  static const char* describe(Verdict verdict);
+
+  // Registers, stack and code at PC, plus the range seen by the probes
+  void dump_state(FILE* fp) const;
+
+private:
+  CPMEmulator* cpm;
+  qkz80* cpu;
+  long long window;
+
+  unsigned long long last_activity;  // trap_count + port_ops at window start
+  long long window_start;            // instruction_count at window start
+  qkz80_uint16 range_lo;
+  qkz80_uint16 range_hi;
+  bool range_valid;
+
+  unsigned long long activity() const;
+  void restart_window();
+  void note_pc(qkz80_uint16 pc);
+  unsigned memory_hash() const;
+};
+
+#endif // CPM_HANG_H
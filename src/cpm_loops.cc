@@ -0,0 +1,169 @@
+/*
+ * Loop idiom recognizer - see cpm_loops.h
+ */
+
+#include "cpm_loops.h"
+#include "cpm_emulator.h"
+#include <string.h>
+#include <algorithm>
+
+CPMLoopIdioms::CPMLoopIdioms(bool amode_8080)
+  : loops(0), instructions(0), mode_8080(amode_8080), loop_at(0x10000, UNSEEN) {
+}
+
+// Decode the loop starting at pc, if it is one of the idioms
+bool CPMLoopIdioms::match(const qkz80_uint8* m, qkz80_uint16 pc, Loop* loop) const {
+  if (pc < TPA_START || pc >= BDOS_BASE - MAX_CODE) return false;
+  const qkz80_uint8* p = m + pc;
+  int i = 0;
+
+  loop->head = pc;
+  loop->body = BODY_NONE;
+  loop->fill_reg = -1;
+  loop->fill_value = 0;
+  loop->copy_from_hl = false;
+  loop->instructions = 0;
+
+  // Body: LD (HL),r / INC HL, LD (HL),n / INC HL, or a byte copy
+  if (p[0] >= 0x70 && p[0] <= 0x77 && p[0] != 0x76 && p[1] == 0x23) {
+    loop->body = BODY_FILL;
+    loop->fill_reg = p[0] & 0x07;
+    loop->instructions = 2;
+    i = 2;
+  } else if (p[0] == 0x36 && p[2] == 0x23) {
+    loop->body = BODY_FILL;
+    loop->fill_value = p[1];
+    loop->instructions = 2;
+    i = 3;
+  } else if (((p[0] == 0x7e && p[1] == 0x12) || (p[0] == 0x1a && p[1] == 0x77)) &&
+             ((p[2] == 0x23 && p[3] == 0x13) || (p[2] == 0x13 && p[3] == 0x23))) {
+    loop->body = BODY_COPY;
+    loop->copy_from_hl = (p[0] == 0x7e);
+    loop->instructions = 4;
+    i = 4;
+  }
+
+  // Counter: DJNZ head, or DEC BC / LD A,B / OR C (or LD A,C / OR B)
+  // and JR NZ or JP NZ back to the head
+  if (!mode_8080 && p[i] == 0x10 &&
+      (qkz80_uint16)(pc + i + 2 + (qkz80_int8)p[i + 1]) == pc) {
+    loop->counter = COUNT_B;
+    loop->instructions += 1;
+    i += 2;
+  } else if (p[i] == 0x0b && ((p[i + 1] == 0x78 && p[i + 2] == 0xb1) ||
+                              (p[i + 1] == 0x79 && p[i + 2] == 0xb0))) {
+    if (!mode_8080 && p[i + 3] == 0x20 &&
+        (qkz80_uint16)(pc + i + 5 + (qkz80_int8)p[i + 4]) == pc) {
+      i += 5;
+    } else if (p[i + 3] == 0xc2 && qkz80_MK_INT16(p[i + 4], p[i + 5]) == pc) {
+      i += 6;
+    } else {
+      return false;
+    }
+    loop->counter = COUNT_BC;
+    loop->instructions += 4;
+  } else {
+    return false;
+  }
+
+  // A fill must store a value the loop does not change
+  if (loop->body == BODY_FILL && loop->fill_reg >= 0) {
+    int r = loop->fill_reg;
+    if (r == qkz80::reg_H || r == qkz80::reg_L || r == qkz80::reg_B) return false;
+    if (loop->counter == COUNT_BC && (r == qkz80::reg_C || r == qkz80::reg_A)) return false;
+  }
+
+  loop->length = i;
+  memcpy(loop->code, p, i);
+  return true;
+}
+
+// True if count bytes stored from dest on (wrapping) reach the loop's code
+bool CPMLoopIdioms::writes_code(const Loop& loop, qkz80_uint16 dest, long long count) const {
+  for (int i = 0; i < loop.length; i++) {
+    if ((qkz80_uint16)(loop.head + i - dest) < count) return true;
+  }
+  return false;
+}
+
+int CPMLoopIdioms::run(qkz80* cpu, qkz80_uint16 pc, long long budget,
+                       unsigned long long cycle_limit) {
+  int index = loop_at[pc];
+  if (index == NOT_A_LOOP) return 0;
+
+  // Match on first arrival, and again if the code has changed since
+  const qkz80_uint8* m = cpu->get_mem();
+  if (index == UNSEEN || memcmp(m + pc, found[index].code, found[index].length) != 0) {
+    Loop loop;
+    if (!match(m, pc, &loop)) {
+      loop_at[pc] = NOT_A_LOOP;
+      return 0;
+    }
+    if (index == UNSEEN) {
+      index = (int)found.size();
+      found.push_back(loop);
+      loop_at[pc] = index;
+    } else {
+      found[index] = loop;
+    }
+  }
+  if (cpu->int_pending || cpu->nmi_pending) return 0;
+  const Loop& loop = found[index];
+
+  // Iterations to the end of the loop, cut to the instruction budget and
+  // to the cycles left before the next event (execute() counts 5 cycles
+  // an instruction)
+  qkz80_uint16 bc = cpu->regs.BC.get_pair16();
+  long long left;
+  if (loop.counter == COUNT_B) {
+    left = (bc >> 8) ? (bc >> 8) : 256;
+  } else {
+    left = bc ? bc : 65536;
+  }
+  unsigned long long per = 5ULL * loop.instructions;
+  if (cycle_limit <= cpu->cycles) return 0;
+  long long k = std::min(left, budget / loop.instructions);
+  k = std::min(k, (long long)std::min((cycle_limit - cpu->cycles) / per, 65536ULL));
+  if (k < 2) return 0;
+
+  qkz80_uint16 hl = cpu->regs.HL.get_pair16();
+  qkz80_uint16 de = cpu->regs.DE.get_pair16();
+  if (loop.body == BODY_FILL) {
+    if (writes_code(loop, hl, k)) return 0;
+    qkz80_uint8 value = loop.fill_reg < 0 ? loop.fill_value : cpu->get_reg8(loop.fill_reg);
+    for (long long i = 0; i < k; i++) {
+      cpu->mem->store_mem((qkz80_uint16)(hl + i), value);
+    }
+    cpu->regs.HL.set_pair16(hl + k);
+  } else if (loop.body == BODY_COPY) {
+    qkz80_uint16 src = loop.copy_from_hl ? hl : de;
+    qkz80_uint16 dest = loop.copy_from_hl ? de : hl;
+    if (writes_code(loop, dest, k)) return 0;
+    // Byte by byte, as the loop does, so overlapping copies replicate
+    qkz80_uint8 byte = 0;
+    for (long long i = 0; i < k; i++) {
+      byte = cpu->mem->fetch_mem((qkz80_uint16)(src + i));
+      cpu->mem->store_mem((qkz80_uint16)(dest + i), byte);
+    }
+    cpu->regs.HL.set_pair16(hl + k);
+    cpu->regs.DE.set_pair16(de + k);
+    cpu->regs.AF.set_high(byte);
+  }
+
+  if (loop.counter == COUNT_B) {
+    cpu->regs.BC.set_high((qkz80_uint8)((bc >> 8) - k));
+  } else {
+    bc -= k;
+    cpu->regs.BC.set_pair16(bc);
+    qkz80_uint8 a = cpu->regs.BC.get_high() | cpu->regs.BC.get_low();
+    cpu->regs.AF.set_high(a);
+    cpu->regs.set_flags_from_logic8(a, 0, 0);
+  }
+
+  cpu->regs.PC.set_pair16(k == left ? loop.head + loop.length : loop.head);
+  cpu->cycles += per * k;
+  int executed = (int)(k * loop.instructions);
+  loops++;
+  instructions += executed;
+  return executed;
+}
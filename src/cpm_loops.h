@@ -0,0 +1,69 @@
+/*
+ * Loop idiom recognizer
+ *
+ * CP/M programs spend much of their time in a few hand-written loops:
+ * DJNZ delays, DEC BC / LD A,B / OR C / JR NZ countdowns, and the same
+ * two counters around a fill (LD (HL),r / INC HL) or a byte copy
+ * (LD A,(HL) / LD (DE),A / INC HL / INC DE, or from (DE) to (HL)). When
+ * PC reaches the head of one, run() applies as many whole iterations as
+ * fit at once: memory, registers, flags, PC and cycles end up exactly as
+ * the interpreter would leave them, and the instructions are counted.
+ *
+ * Only code between TPA_START and the BDOS is considered, so no trap
+ * address lies inside a loop. run() declines when an interrupt is
+ * pending, when the loop would write over its own code, and stops short
+ * of the cycle count at which the caller's next event is due.
+ */
+
+#ifndef CPM_LOOPS_H
+#define CPM_LOOPS_H
+
+#include "qkz80.h"
+#include <stdint.h>
+#include <vector>
+
+class CPMLoopIdioms {
+public:
+  explicit CPMLoopIdioms(bool mode_8080);
+
+  // At most budget instructions, and cycles must not pass cycle_limit.
+  // Returns the instructions executed, or 0 if pc is not a loop head it
+  // can run.
+  int run(qkz80* cpu, qkz80_uint16 pc, long long budget,
+          unsigned long long cycle_limit);
+
+  uint64_t loops;          // Batches of iterations run
+  uint64_t instructions;   // Instructions they stood for
+
+private:
+  enum Body { BODY_NONE, BODY_FILL, BODY_COPY };
+  enum Counter { COUNT_B, COUNT_BC };
+
+  enum {
+    UNSEEN = -1,           // loop_at: not examined yet
+    NOT_A_LOOP = -2
+  };
+
+  static const int MAX_CODE = 16;
+
+  struct Loop {
+    qkz80_uint16 head;
+    int length;                // Bytes of code
+    qkz80_uint8 code[MAX_CODE];
+    int instructions;          // Per iteration
+    Body body;
+    int fill_reg;              // Register stored by a fill, -1 = immediate
+    qkz80_uint8 fill_value;    // Immediate fill byte
+    bool copy_from_hl;         // Copy (HL) to (DE), otherwise (DE) to (HL)
+    Counter counter;
+  };
+
+  bool match(const qkz80_uint8* m, qkz80_uint16 pc, Loop* loop) const;
+  bool writes_code(const Loop& loop, qkz80_uint16 dest, long long count) const;
+
+  bool mode_8080;
+  std::vector<int> loop_at;    // Per address: index into found, or UNSEEN/NOT_A_LOOP
+  std::vector<Loop> found;
+};
+
+#endif // CPM_LOOPS_H
@@ -0,0 +1,111 @@
+/*
+ * Shared and file-backed guest memory
+ */
+
+#include "cpm_memory.h"
+#include "qkz80.h"
+#include <atomic>
+#include <string.h>
+
+CPMSharedImage::CPMSharedImage(const qkz80_uint8* mem)
+  : data(mem, mem + CPM_MEM_SIZE) {
+  handle = platform::create_shared_image(mem, CPM_MEM_SIZE);
+}
+
+CPMSharedImage::~CPMSharedImage() {
+  platform::release_shared_image(handle);
+}
+
+static qkz80_uint8* copy_image(const CPMSharedImage& image) {
+  qkz80_uint8* copy = new qkz80_uint8[CPM_MEM_SIZE];
+  memcpy(copy, image.get_data(), CPM_MEM_SIZE);
+  return copy;
+}
+
+CPMCowMemory::CPMCowMemory(const CPMSharedImage& image)
+  : CPMCowMemory(image, image.get_handle() == -1 ? nullptr :
+                 platform::map_private_view(image.get_handle(), CPM_MEM_SIZE)) {
+}
+
+CPMCowMemory::CPMCowMemory(const CPMSharedImage& image, void* view)
+  : qkz80_cpu_mem(view ? static_cast<qkz80_uint8*>(view) : copy_image(image)),
+    mapped(view != nullptr) {
+}
+
+CPMCowMemory::~CPMCowMemory() {
+  if (mapped) {
+    platform::unmap_view(get_mem(), CPM_MEM_SIZE);
+  } else {
+    delete[] get_mem();
+  }
+}
+
+static qkz80_uint8* zeroed_memory() {
+  qkz80_uint8* mem = new qkz80_uint8[CPM_MEM_SIZE];
+  memset(mem, 0, CPM_MEM_SIZE);
+  return mem;
+}
+
+CPMMappedMemory::CPMMappedMemory(const char* path)
+  : CPMMappedMemory(platform::map_shared_file(path, CPM_MEMFILE_HEADER_SIZE +
+                                                    CPM_MEM_SIZE)) {
+}
+
+CPMMappedMemory::CPMMappedMemory(void* view)
+  : qkz80_cpu_mem(view ? static_cast<qkz80_uint8*>(view) + CPM_MEMFILE_HEADER_SIZE
+                       : zeroed_memory()),
+    header(static_cast<CPMMemFileHeader*>(view)) {
+  if (!header) return;
+
+  // An existing file keeps its old contents; start from a clean machine
+  memset(view, 0, CPM_MEMFILE_HEADER_SIZE + CPM_MEM_SIZE);
+  memcpy(header->magic, CPM_MEMFILE_MAGIC, sizeof(header->magic));
+  header->version = CPM_MEMFILE_VERSION;
+  header->header_size = CPM_MEMFILE_HEADER_SIZE;
+  header->mem_size = CPM_MEM_SIZE;
+}
+
+CPMMappedMemory::~CPMMappedMemory() {
+  if (header) {
+    platform::unmap_view(header, CPM_MEMFILE_HEADER_SIZE + CPM_MEM_SIZE);
+  } else {
+    delete[] get_mem();
+  }
+}
+
+void CPMMappedMemory::publish(qkz80* cpu, uint64_t instructions,
+                              CPMMemFileState state, int exit_status) {
+  if (!header) return;
+
+  const qkz80_reg_set& r = cpu->regs;
+  volatile uint64_t* sequence = &header->sequence;
+  *sequence = *sequence + 1;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  header->state = state;
+  header->instructions = instructions;
+  header->cycles = cpu->cycles;
+  header->updated_usec = platform::monotonic_usec();
+  header->exit_status = exit_status;
+  header->af = r.AF.get_pair16();
+  header->bc = r.BC.get_pair16();
+  header->de = r.DE.get_pair16();
+  header->hl = r.HL.get_pair16();
+  header->af_alt = r.AF_.get_pair16();
+  header->bc_alt = r.BC_.get_pair16();
+  header->de_alt = r.DE_.get_pair16();
+  header->hl_alt = r.HL_.get_pair16();
+  header->ix = r.IX.get_pair16();
+  header->iy = r.IY.get_pair16();
+  header->sp = r.SP.get_pair16();
+  header->pc = r.PC.get_pair16();
+  header->i = r.I;
+  header->r = r.R;
+  header->iff1 = r.IFF1;
+  header->iff2 = r.IFF2;
+  header->im = r.IM;
+  header->halted = cpu->is_halted() ? 1 : 0;
+
+  std::atomic_thread_fence(std::memory_order_release);
+  *sequence = *sequence + 1;
+}
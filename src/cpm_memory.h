@@ -0,0 +1,109 @@
+/*
+ * Shared guest memory images
+ *
+ * When many instances run the same program most of their 64K is
+ * identical: page zero, the BIOS/BDOS tables from setup_memory() and the
+ * loaded .COM image. CPMSharedImage holds one copy of that state in an
+ * anonymous memory object. CPMCowMemory maps a private copy-on-write view
+ * of it, so an instance only owns the pages it has written and starts
+ * without any memset or fread.
+ *
+ * CPMMappedMemory keeps guest RAM in a shared mapping of a file instead
+ * (--mem-file). Other processes can map the same file and watch memory
+ * live. A header page in front of RAM holds the registers and counters,
+ * refreshed by publish().
+ */
+
+#ifndef CPM_MEMORY_H
+#define CPM_MEMORY_H
+
+#include "qkz80_mem.h"
+#include "os/platform.h"
+#include <stdint.h>
+#include <vector>
+
+#define CPM_MEM_SIZE 0x10000
+
+// Read-only 64K base image shared by any number of CPMCowMemory views
+class CPMSharedImage {
+  platform::SharedImage handle;
+  std::vector<qkz80_uint8> data;  // Used when a view can't be mapped
+
+public:
+  explicit CPMSharedImage(const qkz80_uint8* mem);
+  ~CPMSharedImage();
+
+  platform::SharedImage get_handle() const { return handle; }
+  const qkz80_uint8* get_data() const { return data.data(); }
+
+private:
+  CPMSharedImage(const CPMSharedImage&);
+  CPMSharedImage& operator=(const CPMSharedImage&);
+};
+
+// Guest memory that starts as a copy-on-write view of a shared image.
+// Falls back to a private copy if the platform can't map one.
+class CPMCowMemory : public qkz80_cpu_mem {
+  bool mapped;
+
+  CPMCowMemory(const CPMSharedImage& image, void* view);
+
+public:
+  explicit CPMCowMemory(const CPMSharedImage& image);
+  ~CPMCowMemory();
+
+  bool is_shared() const { return mapped; }
+};
+
+class qkz80;
+
+// First page of a --mem-file; guest RAM follows at header_size. Fields are
+// in host byte order and are only ever added at the end, with a new
+// version. A reader copies the fields between two reads of sequence and
+// keeps the copy if both reads were the same even number.
+#define CPM_MEMFILE_MAGIC "CPMEMRAM"
+#define CPM_MEMFILE_VERSION 1
+#define CPM_MEMFILE_HEADER_SIZE 4096
+
+enum CPMMemFileState {
+  CPM_MEMFILE_RUNNING = 0,
+  CPM_MEMFILE_EXITED = 1,     // The program exited; exit_status is set
+  CPM_MEMFILE_STOPPED = 2     // Stopped by a limit or hang detection
+};
+
+struct CPMMemFileHeader {
+  char magic[8];              // CPM_MEMFILE_MAGIC, without a terminator
+  uint32_t version;
+  uint32_t header_size;       // Offset of guest RAM in the file
+  uint32_t mem_size;          // Bytes of guest RAM
+  uint32_t state;             // CPMMemFileState
+  uint64_t sequence;          // Odd while the fields below are changing
+  uint64_t instructions;
+  uint64_t cycles;
+  uint64_t updated_usec;      // Host monotonic clock at the last publish()
+  int32_t exit_status;
+  uint16_t af, bc, de, hl;
+  uint16_t af_alt, bc_alt, de_alt, hl_alt;
+  uint16_t ix, iy, sp, pc;
+  uint8_t i, r, iff1, iff2, im, halted;
+};
+
+// Guest RAM in a shared mapping of a file. Falls back to private memory
+// if the file can't be mapped; is_mapped() says which.
+class CPMMappedMemory : public qkz80_cpu_mem {
+  CPMMemFileHeader* header;   // nullptr when not mapped
+
+  explicit CPMMappedMemory(void* view);
+
+public:
+  explicit CPMMappedMemory(const char* path);
+  ~CPMMappedMemory();
+
+  bool is_mapped() const { return header != nullptr; }
+
+  // Copy the CPU state and counters to the header page
+  void publish(qkz80* cpu, uint64_t instructions, CPMMemFileState state,
+               int exit_status = 0);
+};
+
+#endif // CPM_MEMORY_H
@@ -0,0 +1,509 @@
+/*
+ * Z80 CTC and SIO peripheral models
+ */
+
+#include "cpm_peripherals.h"
+#include "cpm_emulator.h"
+
+// Cycles between exchanges with the host console (5 ms at 4 MHz)
+static const unsigned long long SIO_POLL_CYCLES = 20000;
+
+// Longest wait for console input while the CPU is halted
+static const int SIO_IDLE_MS = 10;
+
+// Host input read ahead of the guest
+static const size_t SIO_RX_BUFFER = 256;
+
+//=============================================================================
+// Daisy chain
+//=============================================================================
+
+unsigned long long CPMPeripheral::now() const {
+  return bus->get_cpu()->cycles;
+}
+
+void CPMPeripheral::changed() {
+  bus->service();
+}
+
+CPMPeripheralBus::CPMPeripheralBus(qkz80* acpu)
+  : next_event(CPM_NO_EVENT), cpu_halted(false), cpu(acpu), raised(false) {
+  cpu->int_listener = this;
+}
+
+CPMPeripheralBus::~CPMPeripheralBus() {
+  if (cpu->int_listener == this) cpu->int_listener = nullptr;
+  for (size_t i = 0; i < devices.size(); i++) {
+    cpu->attach_io(devices[i]->base, nullptr, devices[i]->port_count());
+    delete devices[i];
+  }
+}
+
+void CPMPeripheralBus::add(qkz80_uint8 base, CPMPeripheral* dev) {
+  dev->bus = this;
+  dev->base = base;
+  cpu->attach_io(base, dev, dev->port_count());
+  devices.push_back(dev);
+  service();
+}
+
+void CPMPeripheralBus::service() {
+  unsigned long long now = cpu->cycles;
+  unsigned long long next = CPM_NO_EVENT;
+  for (size_t i = 0; i < devices.size(); i++) {
+    unsigned long long event = devices[i]->advance(now);
+    if (event < next) next = event;
+  }
+  next_event = next;
+
+  if (requester()) {
+    cpu->int_pending = true;
+    raised = true;
+  } else if (raised) {
+    // The request was withdrawn (data read, interrupt disabled)
+    cpu->int_pending = false;
+    raised = false;
+  }
+}
+
+// The device whose IEI is high and that has an interrupt waiting
+CPMPeripheral* CPMPeripheralBus::requester() const {
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (devices[i]->int_requested()) return devices[i];
+    if (devices[i]->int_in_service()) return nullptr;
+  }
+  return nullptr;
+}
+
+qkz80_uint8 CPMPeripheralBus::int_acknowledge(qkz80_uint8 vector) {
+  CPMPeripheral* dev = requester();
+  raised = false;
+  if (dev) {
+    vector = dev->int_acknowledge();
+  }
+  service();
+  return vector;
+}
+
+// RETI ends the service of the highest priority device in service
+void CPMPeripheralBus::reti() {
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (devices[i]->int_in_service()) {
+      devices[i]->int_reti();
+      break;
+    }
+  }
+  service();
+}
+
+//=============================================================================
+// CTC
+//=============================================================================
+
+// Channel control word bits
+#define CTC_CONTROL      0x01
+#define CTC_RESET        0x02
+#define CTC_CONSTANT     0x04
+#define CTC_PRESCALE_256 0x20
+#define CTC_COUNTER      0x40
+#define CTC_INT_ENABLE   0x80
+
+CPMCtc::CPMCtc() : vector_base(0) {
+  for (int ch = 0; ch < 4; ch++) {
+    Channel& c = channels[ch];
+    c.control = 0;
+    c.time_constant = 256;
+    c.running = false;
+    c.need_constant = false;
+    c.period = 0;
+    c.deadline = CPM_NO_EVENT;
+    c.count = 256;
+    c.pending = false;
+    c.in_service = false;
+  }
+}
+
+qkz80_uint8 CPMCtc::in(qkz80_uint8 port) {
+  Channel& c = channels[(port - base) & 3];
+  if (!c.running) {
+    return (qkz80_uint8)c.time_constant;
+  }
+  if (c.control & CTC_COUNTER) {
+    return (qkz80_uint8)c.count;
+  }
+  // Down counter value, from the cycles left to the next zero count
+  unsigned long long prescale = (c.control & CTC_PRESCALE_256) ? 256 : 16;
+  unsigned long long left = c.deadline > now() ? c.deadline - now() : 0;
+  unsigned long long value = (left + prescale - 1) / prescale;
+  if (value < 1) value = 1;
+  return (qkz80_uint8)value;
+}
+
+void CPMCtc::out(qkz80_uint8 port, qkz80_uint8 value) {
+  int ch = (port - base) & 3;
+  Channel& c = channels[ch];
+
+  if (c.need_constant) {
+    // Time constant; counting starts at once (there is no trigger input)
+    c.need_constant = false;
+    c.time_constant = value ? value : 256;
+    c.count = c.time_constant;
+    c.running = true;
+    if (c.control & CTC_COUNTER) {
+      c.deadline = CPM_NO_EVENT;
+    } else {
+      c.period = (unsigned long long)c.time_constant *
+                 ((c.control & CTC_PRESCALE_256) ? 256 : 16);
+      c.deadline = now() + c.period;
+    }
+  } else if (value & CTC_CONTROL) {
+    c.control = value;
+    if (!(value & CTC_INT_ENABLE)) c.pending = false;
+    if (value & CTC_RESET) {
+      c.running = false;
+      c.pending = false;
+      c.deadline = CPM_NO_EVENT;
+    }
+    if (value & CTC_CONSTANT) c.need_constant = true;
+  } else if (ch == 0) {
+    // Interrupt vector; bits 2-1 are filled in with the channel
+    vector_base = value & 0xF8;
+  }
+  changed();
+}
+
+void CPMCtc::zero_count(int ch) {
+  Channel& c = channels[ch];
+  if (c.control & CTC_INT_ENABLE) c.pending = true;
+
+  // The zero count output clocks the next channel in counter mode
+  if (ch < 3) {
+    Channel& next = channels[ch + 1];
+    if (next.running && (next.control & CTC_COUNTER) && --next.count == 0) {
+      next.count = next.time_constant;
+      zero_count(ch + 1);
+    }
+  }
+}
+
+unsigned long long CPMCtc::advance(unsigned long long now) {
+  unsigned long long next = CPM_NO_EVENT;
+  for (int ch = 0; ch < 4; ch++) {
+    Channel& c = channels[ch];
+    if (!c.running || (c.control & CTC_COUNTER)) continue;
+    while (c.deadline <= now) {
+      c.deadline += c.period;
+      zero_count(ch);
+    }
+    if (c.deadline < next) next = c.deadline;
+  }
+  return next;
+}
+
+// Channel 0 has the highest priority
+bool CPMCtc::int_requested() const {
+  for (int ch = 0; ch < 4; ch++) {
+    if (channels[ch].in_service) return false;
+    if (channels[ch].pending) return true;
+  }
+  return false;
+}
+
+bool CPMCtc::int_in_service() const {
+  for (int ch = 0; ch < 4; ch++) {
+    if (channels[ch].in_service) return true;
+  }
+  return false;
+}
+
+qkz80_uint8 CPMCtc::int_acknowledge() {
+  for (int ch = 0; ch < 4; ch++) {
+    Channel& c = channels[ch];
+    if (c.in_service) break;
+    if (c.pending) {
+      c.pending = false;
+      c.in_service = true;
+      return (qkz80_uint8)(vector_base | (ch << 1));
+    }
+  }
+  return vector_base;
+}
+
+void CPMCtc::int_reti() {
+  for (int ch = 0; ch < 4; ch++) {
+    if (channels[ch].in_service) {
+      channels[ch].in_service = false;
+      return;
+    }
+  }
+}
+
+//=============================================================================
+// SIO
+//=============================================================================
+
+// WR0 commands (bits 5-3)
+#define SIO_CMD_CHANNEL_RESET 3
+#define SIO_CMD_RX_NEXT       4
+#define SIO_CMD_RESET_TX_INT  5
+#define SIO_CMD_RETI          7
+
+// WR1 bits
+#define SIO_WR1_TX_INT        0x02
+#define SIO_WR1_STATUS_VECTOR 0x04
+
+// RR0 bits
+#define SIO_RR0_RX_AVAILABLE  0x01
+#define SIO_RR0_INT_PENDING   0x02
+#define SIO_RR0_TX_EMPTY      0x04
+#define SIO_RR0_DCD           0x08
+#define SIO_RR0_CTS           0x20
+
+CPMSio::CPMSio(CPMEmulator* aconsole, unsigned long long achar_cycles)
+  : console(aconsole), char_cycles(achar_cycles ? achar_cycles : 1),
+    poll_next(aconsole ? 0 : CPM_NO_EVENT), console_eof(false) {
+  for (int ch = 0; ch < 2; ch++) {
+    for (int src = 0; src < SRC_COUNT; src++) {
+      channels[ch].in_service[src] = false;
+    }
+    channels[ch].rx_next = 0;
+    reset_channel(ch);
+  }
+}
+
+CPMSio::~CPMSio() {
+  if (console) console->console_flush();
+}
+
+// Channel reset leaves the daisy chain state alone
+void CPMSio::reset_channel(int ch) {
+  Channel& c = channels[ch];
+  for (int i = 0; i < 8; i++) c.wr[i] = 0;
+  c.pointer = 0;
+  c.rx_data = 0;
+  c.rx_full = false;
+  c.rx_armed = false;
+  c.tx_busy = false;
+  c.tx_done = 0;
+  for (int src = 0; src < SRC_COUNT; src++) {
+    c.pending[src] = false;
+  }
+}
+
+bool CPMSio::rx_int_enabled(int ch) const {
+  int mode = (channels[ch].wr[1] >> 3) & 3;
+  return mode == 1 ? channels[ch].rx_armed : mode != 0;
+}
+
+void CPMSio::write_register(int ch, qkz80_uint8 value) {
+  Channel& c = channels[ch];
+  if (c.pointer != 0) {
+    c.wr[c.pointer] = value;
+    if (c.pointer == 1) {
+      if (!(value & SIO_WR1_TX_INT)) c.pending[SRC_TX] = false;
+      if (((value >> 3) & 3) == 1) c.rx_armed = true;
+      // A character already waiting interrupts as soon as it is enabled
+      c.pending[SRC_RX] = c.rx_full && rx_int_enabled(ch);
+      if (c.pending[SRC_RX]) c.rx_armed = false;
+    }
+    c.pointer = 0;
+    return;
+  }
+
+  c.wr[0] = value;
+  c.pointer = value & 7;
+  switch ((value >> 3) & 7) {
+  case SIO_CMD_CHANNEL_RESET:
+    reset_channel(ch);
+    break;
+  case SIO_CMD_RX_NEXT:
+    c.rx_armed = true;
+    break;
+  case SIO_CMD_RESET_TX_INT:
+    c.pending[SRC_TX] = false;
+    break;
+  case SIO_CMD_RETI:
+    if (ch == 0) int_reti();
+    break;
+  default:
+    break;
+  }
+}
+
+qkz80_uint8 CPMSio::read_register(int ch) {
+  Channel& c = channels[ch];
+  int reg = c.pointer;
+  c.pointer = 0;
+
+  switch (reg) {
+  case 0: {
+    qkz80_uint8 rr0 = SIO_RR0_DCD | SIO_RR0_CTS;
+    if (c.rx_full) rr0 |= SIO_RR0_RX_AVAILABLE;
+    if (!c.tx_busy) rr0 |= SIO_RR0_TX_EMPTY;
+    if (ch == 0 && first_source(true) >= 0) rr0 |= SIO_RR0_INT_PENDING;
+    return rr0;
+  }
+  case 1:
+    return c.tx_busy ? 0x00 : 0x01;   // All sent
+  case 2:
+    if (ch == 1) {
+      int src = first_source(true);
+      return src >= 0 ? vector_for(src / SRC_COUNT, src % SRC_COUNT) : vector_for(1, -1);
+    }
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+qkz80_uint8 CPMSio::in(qkz80_uint8 port) {
+  int offset = (port - base) & 3;
+  int ch = offset >> 1;
+  if (!(offset & 1)) {
+    return read_register(ch);
+  }
+
+  Channel& c = channels[ch];
+  qkz80_uint8 value = c.rx_data;
+  if (c.rx_full) {
+    c.rx_full = false;
+    c.pending[SRC_RX] = false;
+    changed();
+  }
+  return value;
+}
+
+void CPMSio::out(qkz80_uint8 port, qkz80_uint8 value) {
+  int offset = (port - base) & 3;
+  int ch = offset >> 1;
+  if (!(offset & 1)) {
+    write_register(ch, value);
+    changed();
+    return;
+  }
+
+  // Characters written while one is still being sent are queued behind it.
+  // Console output is buffered by stdio and flushed at the next poll, and
+  // stays in order with BDOS console output.
+  Channel& c = channels[ch];
+  unsigned long long start = c.tx_busy && c.tx_done > now() ? c.tx_done : now();
+  if (ch == 0 && console) {
+    console->console_out(value);
+  } else {
+    tx_queue[ch].push_back(value);
+  }
+  c.tx_busy = true;
+  c.tx_done = start + char_cycles;
+  c.pending[SRC_TX] = false;
+  changed();
+}
+
+// Flush output and read waiting console input. With the CPU halted there
+// is nothing else to do, so wait a little for input instead of spinning.
+void CPMSio::poll_console() {
+  console->console_flush();
+  if (console_eof) return;
+
+  if (bus->cpu_halted && rx_queue[0].empty() && !console->console_ready()) {
+    console->console_idle(SIO_IDLE_MS);
+  }
+  while (rx_queue[0].size() < SIO_RX_BUFFER && console->console_ready()) {
+    int ch = console->console_in();
+    if (ch < 0) {
+      console_eof = true;
+      break;
+    }
+    rx_queue[0].push_back((qkz80_uint8)ch);
+  }
+}
+
+unsigned long long CPMSio::advance(unsigned long long now) {
+  unsigned long long next = CPM_NO_EVENT;
+  if (console) {
+    if (now >= poll_next) {
+      poll_console();
+      poll_next = now + SIO_POLL_CYCLES;
+    }
+    next = poll_next;
+  }
+
+  for (int ch = 0; ch < 2; ch++) {
+    Channel& c = channels[ch];
+    if (c.tx_busy) {
+      if (now >= c.tx_done) {
+        c.tx_busy = false;
+        if (c.wr[1] & SIO_WR1_TX_INT) c.pending[SRC_TX] = true;
+      } else if (c.tx_done < next) {
+        next = c.tx_done;
+      }
+    }
+
+    if (!c.rx_full && !rx_queue[ch].empty()) {
+      if (now >= c.rx_next) {
+        c.rx_data = rx_queue[ch].front();
+        rx_queue[ch].pop_front();
+        c.rx_full = true;
+        c.rx_next = now + char_cycles;
+        if (rx_int_enabled(ch)) {
+          c.pending[SRC_RX] = true;
+          c.rx_armed = false;
+        }
+      } else if (c.rx_next < next) {
+        next = c.rx_next;
+      }
+    }
+  }
+  return next;
+}
+
+// Source index ch*2+src of the first waiting source that no higher
+// source in service blocks, or with want_pending false the first source
+// in service; -1 if none
+int CPMSio::first_source(bool want_pending) const {
+  for (int i = 0; i < 2 * SRC_COUNT; i++) {
+    const Channel& c = channels[i / SRC_COUNT];
+    if (c.in_service[i % SRC_COUNT]) return want_pending ? -1 : i;
+    if (want_pending && c.pending[i % SRC_COUNT]) return i;
+  }
+  return -1;
+}
+
+// Vector from WR2B, with bits 3-1 naming the source when WR1B asks for
+// it. src -1 gives the "no interrupt" code.
+qkz80_uint8 CPMSio::vector_for(int ch, int src) const {
+  qkz80_uint8 vector = channels[1].wr[2];
+  if (channels[1].wr[1] & SIO_WR1_STATUS_VECTOR) {
+    int code;
+    if (src < 0) {
+      code = 3;
+    } else {
+      code = (ch == 0 ? 4 : 0) | (src == SRC_RX ? 2 : 0);
+    }
+    vector = (qkz80_uint8)((vector & 0xF1) | (code << 1));
+  }
+  return vector;
+}
+
+bool CPMSio::int_requested() const {
+  return first_source(true) >= 0;
+}
+
+bool CPMSio::int_in_service() const {
+  return first_source(false) >= 0;
+}
+
+qkz80_uint8 CPMSio::int_acknowledge() {
+  int i = first_source(true);
+  if (i < 0) return vector_for(1, -1);
+  Channel& c = channels[i / SRC_COUNT];
+  c.pending[i % SRC_COUNT] = false;
+  c.in_service[i % SRC_COUNT] = true;
+  return vector_for(i / SRC_COUNT, i % SRC_COUNT);
+}
+
+void CPMSio::int_reti() {
+  int i = first_source(false);
+  if (i >= 0) {
+    channels[i / SRC_COUNT].in_service[i % SRC_COUNT] = false;
+  }
+}
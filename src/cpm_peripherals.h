@@ -0,0 +1,185 @@
+/*
+ * Z80 CTC and SIO peripheral models
+ *
+ * The devices sit on qkz80 I/O ports and on an interrupt daisy chain.
+ * Nothing runs per instruction: each device reports the CPU cycle at
+ * which it next needs attention (a timer reaching zero, a character
+ * finishing transmission, the next host poll) and CPMEmulator::run()
+ * calls CPMPeripheralBus::service() when the cycle counter passes the
+ * earliest of them.
+ *
+ * Interrupts follow the Z80 daisy chain: devices are in priority order,
+ * a device with an interrupt in service blocks every device below it
+ * until its RETI, and the acknowledged device supplies the IM 2 vector.
+ */
+
+#ifndef CPM_PERIPHERALS_H
+#define CPM_PERIPHERALS_H
+
+#include "qkz80.h"
+#include <deque>
+#include <vector>
+
+class CPMEmulator;
+class CPMPeripheralBus;
+
+// Cycle value meaning "no event scheduled"
+#define CPM_NO_EVENT (~0ULL)
+
+class CPMPeripheral : public qkz80_io_device {
+public:
+  CPMPeripheral() : bus(nullptr), base(0) {}
+
+  // Ports used, starting at the base given to CPMPeripheralBus::add()
+  virtual unsigned port_count() const = 0;
+
+  // Bring the device up to cycle now and return the cycle of its next
+  // event, or CPM_NO_EVENT
+  virtual unsigned long long advance(unsigned long long now) = 0;
+
+  // Daisy chain, in the device's own priority order
+  virtual bool int_requested() const = 0;   // An unblocked source is waiting
+  virtual bool int_in_service() const = 0;  // A source is being serviced
+  virtual qkz80_uint8 int_acknowledge() = 0;  // Returns the vector
+  virtual void int_reti() = 0;             // Ends the highest service
+
+protected:
+  CPMPeripheralBus* bus;
+  qkz80_uint8 base;   // First port
+
+  // Current CPU cycle, and a reschedule after a register write
+  unsigned long long now() const;
+  void changed();
+
+  friend class CPMPeripheralBus;
+};
+
+class CPMPeripheralBus : public qkz80_int_listener {
+public:
+  explicit CPMPeripheralBus(qkz80* acpu);
+  ~CPMPeripheralBus() override;
+
+  // Attach dev at port base; devices added first have the highest
+  // interrupt priority. The bus owns the device.
+  void add(qkz80_uint8 base, CPMPeripheral* dev);
+  bool empty() const { return devices.empty(); }
+
+  // Advance every device to the current cycle, update the CPU's
+  // interrupt request and reschedule next_event
+  void service();
+
+  // Cycle at which service() is next needed
+  unsigned long long next_event;
+
+  // Set while the CPU is halted and not paced, so host polls may wait
+  // for input
+  bool cpu_halted;
+
+  qkz80* get_cpu() const { return cpu; }
+
+  qkz80_uint8 int_acknowledge(qkz80_uint8 vector) override;
+  void reti() override;
+
+private:
+  qkz80* cpu;
+  std::vector<CPMPeripheral*> devices;
+  bool raised;   // int_pending was set by the chain
+
+  CPMPeripheral* requester() const;
+};
+
+// Z80 CTC: four counter/timer channels at base..base+3. Timer mode counts
+// CPU cycles through a prescaler of 16 or 256. Counter mode counts the
+// zero count output of the channel below it (channel 0 has no input),
+// the usual way to cascade channels on CP/M boards.
+class CPMCtc : public CPMPeripheral {
+public:
+  CPMCtc();
+
+  unsigned port_count() const override { return 4; }
+  qkz80_uint8 in(qkz80_uint8 port) override;
+  void out(qkz80_uint8 port, qkz80_uint8 value) override;
+  unsigned long long advance(unsigned long long now) override;
+
+  bool int_requested() const override;
+  bool int_in_service() const override;
+  qkz80_uint8 int_acknowledge() override;
+  void int_reti() override;
+
+private:
+  struct Channel {
+    qkz80_uint8 control;
+    unsigned time_constant;   // 1..256
+    bool running;
+    bool need_constant;       // Next write is the time constant
+    unsigned long long period;    // Timer mode: cycles per zero count
+    unsigned long long deadline;  // Timer mode: cycle of the next zero count
+    unsigned count;               // Counter mode: edges left
+    bool pending;
+    bool in_service;
+  };
+  Channel channels[4];
+  qkz80_uint8 vector_base;
+
+  void zero_count(int ch);
+};
+
+// Z80 SIO/2: two serial channels, RC2014 port layout: base+0 A control,
+// base+1 A data, base+2 B control, base+3 B data. Each character takes
+// char_cycles to send or receive. Channel A can be joined to the CP/M
+// console; other channels exchange data with the host program through
+// rx_queue and tx_queue.
+class CPMSio : public CPMPeripheral {
+public:
+  // console: emulator whose console hooks feed channel A, or nullptr
+  CPMSio(CPMEmulator* console, unsigned long long char_cycles);
+  ~CPMSio() override;   // Flushes the console, which must still exist
+
+  unsigned port_count() const override { return 4; }
+  qkz80_uint8 in(qkz80_uint8 port) override;
+  void out(qkz80_uint8 port, qkz80_uint8 value) override;
+  unsigned long long advance(unsigned long long now) override;
+
+  bool int_requested() const override;
+  bool int_in_service() const override;
+  qkz80_uint8 int_acknowledge() override;
+  void int_reti() override;
+
+  // Host side of each channel: bytes waiting for the guest, bytes sent
+  // (tx_queue[0] stays empty when channel A is on the console)
+  std::deque<qkz80_uint8> rx_queue[2];
+  std::deque<qkz80_uint8> tx_queue[2];
+
+private:
+  enum Source { SRC_RX, SRC_TX, SRC_COUNT };
+
+  struct Channel {
+    qkz80_uint8 wr[8];
+    int pointer;                    // Register selected by WR0
+    qkz80_uint8 rx_data;
+    bool rx_full;
+    bool rx_armed;                  // Interrupt on first character mode
+    unsigned long long rx_next;     // Earliest cycle for the next character
+    bool tx_busy;
+    unsigned long long tx_done;
+    bool pending[SRC_COUNT];
+    bool in_service[SRC_COUNT];
+  };
+  Channel channels[2];
+  CPMEmulator* console;
+  unsigned long long char_cycles;
+  unsigned long long poll_next;
+  bool console_eof;
+
+  void reset_channel(int ch);
+  void write_register(int ch, qkz80_uint8 value);
+  qkz80_uint8 read_register(int ch);
+  void poll_console();
+  bool rx_int_enabled(int ch) const;
+
+  // Sources in priority order: A receive, A transmit, B receive, B transmit
+  int first_source(bool want_pending) const;
+  qkz80_uint8 vector_for(int ch, int src) const;
+};
+
+#endif // CPM_PERIPHERALS_H
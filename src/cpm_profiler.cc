@@ -0,0 +1,214 @@
+/*
+ * Statistical sampling profiler for guest code
+ */
+
+#include "cpm_profiler.h"
+#include "os/platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+// Entries listed in each section of the report
+static const size_t REPORT_LINES = 100;
+
+CPMProfiler* CPMProfiler::active = nullptr;
+
+CPMProfiler::CPMProfiler(qkz80* acpu, bool acallers)
+  : cpu(acpu), mem(acpu->get_mem()), callers(acallers), hz(0),
+    head(0), tail(0), dropped(0),
+    pc_hist(0x10000), caller_hist(acallers ? 0x10000 : 0), total(0) {
+}
+
+CPMProfiler::~CPMProfiler() {
+  stop();
+}
+
+bool CPMProfiler::start(int ahz) {
+  if (active) return false;
+  active = this;
+  hz = ahz;
+  if (!platform::start_profile_timer(hz, tick)) {
+    active = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void CPMProfiler::stop() {
+  if (active != this) return;
+  platform::stop_profile_timer();
+  active = nullptr;
+  drain();
+}
+
+// Runs in the timer signal handler: plain loads and stores only
+void CPMProfiler::tick() {
+  CPMProfiler* p = active;
+  if (!p) return;
+
+  unsigned sample = p->cpu->regs.PC.get_pair16();
+  if (p->callers) {
+    qkz80_uint16 sp = p->cpu->regs.SP.get_pair16();
+    unsigned ret = p->mem[sp] | (p->mem[(qkz80_uint16)(sp + 1)] << 8);
+    sample |= ret << 16;
+  }
+
+  unsigned h = p->head.load(std::memory_order_relaxed);
+  if (h - p->tail.load(std::memory_order_acquire) >= RING_SIZE) {
+    p->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  p->ring[h % RING_SIZE] = sample;
+  p->head.store(h + 1, std::memory_order_release);
+}
+
+void CPMProfiler::drain() {
+  unsigned t = tail.load(std::memory_order_relaxed);
+  unsigned h = head.load(std::memory_order_acquire);
+  for (; t != h; t++) {
+    unsigned sample = ring[t % RING_SIZE];
+    pc_hist[sample & 0xFFFF]++;
+    if (callers) {
+      // The stack top is only a return address some of the time
+      qkz80_uint16 site;
+      if (find_call_site(sample >> 16, &site)) {
+        caller_hist[site]++;
+      }
+    }
+    total++;
+  }
+  tail.store(t, std::memory_order_release);
+}
+
+// If ret follows a CALL or RST (so it could have been pushed as a return
+// address), store the address of that instruction in site
+bool CPMProfiler::find_call_site(qkz80_uint16 ret, qkz80_uint16* site) const {
+  qkz80_uint16 call = ret - 3;
+  if (mem[call] == 0xCD || (mem[call] & 0xC7) == 0xC4) {
+    *site = call;
+    return true;
+  }
+  qkz80_uint16 rst = ret - 1;
+  if ((mem[rst] & 0xC7) == 0xC7) {
+    *site = rst;
+    return true;
+  }
+  return false;
+}
+
+bool CPMProfiler::load_symbols(const char* path) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) return false;
+
+  // Whitespace separated "ADDR NAME" pairs, several per line, ^Z ends it
+  std::string token;
+  std::vector<std::string> tokens;
+  int ch;
+  while ((ch = fgetc(fp)) != EOF && ch != 0x1A) {
+    if (isspace(ch)) {
+      if (!token.empty()) tokens.push_back(token);
+      token.clear();
+    } else {
+      token += (char)ch;
+    }
+  }
+  if (!token.empty()) tokens.push_back(token);
+  fclose(fp);
+
+  size_t i = 0;
+  while (i + 1 < tokens.size()) {
+    char* end;
+    unsigned long addr = strtoul(tokens[i].c_str(), &end, 16);
+    if (*end != '\0' || addr > 0xFFFF) {
+      // Not an address - resynchronize on the next token
+      i++;
+      continue;
+    }
+    symbols[(qkz80_uint16)addr] = tokens[i + 1];
+    i += 2;
+  }
+  return true;
+}
+
+std::string CPMProfiler::symbolize(qkz80_uint16 addr) const {
+  if (symbols.empty()) return "";
+  std::map<qkz80_uint16, std::string>::const_iterator it = symbols.upper_bound(addr);
+  if (it == symbols.begin()) return "";
+  --it;
+  if (it->first == addr) return it->second;
+  char offset[16];
+  snprintf(offset, sizeof(offset), "+0x%X", addr - it->first);
+  return it->second + offset;
+}
+
+// Write the busiest entries of a histogram, most samples first
+static void write_histogram(FILE* fp, const std::vector<std::pair<unsigned long long, std::string> >& rows,
+                            unsigned long long total) {
+  std::vector<std::pair<unsigned long long, std::string> > sorted(rows);
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const std::pair<unsigned long long, std::string>& a,
+                      const std::pair<unsigned long long, std::string>& b) {
+                     return a.first > b.first;
+                   });
+  if (sorted.size() > REPORT_LINES) sorted.resize(REPORT_LINES);
+  for (size_t i = 0; i < sorted.size(); i++) {
+    fprintf(fp, "%10llu %6.2f%%  %s\n", sorted[i].first,
+            total ? 100.0 * sorted[i].first / total : 0.0, sorted[i].second.c_str());
+  }
+}
+
+bool CPMProfiler::write_report(const char* path) {
+  drain();
+
+  FILE* fp = fopen(path, "w");
+  if (!fp) return false;
+
+  fprintf(fp, "; Guest profile: %llu samples at %d Hz, %u dropped\n",
+          total, hz, dropped.load());
+
+  std::vector<std::pair<unsigned long long, std::string> > rows;
+
+  if (!symbols.empty()) {
+    std::map<std::string, unsigned long long> by_symbol;
+    for (unsigned addr = 0; addr < 0x10000; addr++) {
+      if (!pc_hist[addr]) continue;
+      std::map<qkz80_uint16, std::string>::const_iterator it = symbols.upper_bound(addr);
+      std::string name = (it == symbols.begin()) ? "?" : (--it)->second;
+      by_symbol[name] += pc_hist[addr];
+    }
+    for (std::map<std::string, unsigned long long>::const_iterator it = by_symbol.begin();
+         it != by_symbol.end(); ++it) {
+      rows.push_back(std::make_pair(it->second, it->first));
+    }
+    fprintf(fp, "\n; By symbol\n;  samples       %%  symbol\n");
+    write_histogram(fp, rows, total);
+  }
+
+  rows.clear();
+  for (unsigned addr = 0; addr < 0x10000; addr++) {
+    if (!pc_hist[addr]) continue;
+    char label[8];
+    snprintf(label, sizeof(label), "%04X  ", addr);
+    rows.push_back(std::make_pair(pc_hist[addr], label + symbolize(addr)));
+  }
+  fprintf(fp, "\n; By address\n;  samples       %%  addr  symbol\n");
+  write_histogram(fp, rows, total);
+
+  if (callers) {
+    rows.clear();
+    for (unsigned addr = 0; addr < 0x10000; addr++) {
+      if (!caller_hist[addr]) continue;
+      char label[8];
+      snprintf(label, sizeof(label), "%04X  ", addr);
+      rows.push_back(std::make_pair(caller_hist[addr], label + symbolize(addr)));
+    }
+    fprintf(fp, "\n; Callers (return address on top of the guest stack)\n"
+                ";  samples       %%  call  symbol\n");
+    write_histogram(fp, rows, total);
+  }
+
+  fclose(fp);
+  return true;
+}
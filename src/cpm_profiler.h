@@ -0,0 +1,73 @@
+/*
+ * Statistical sampling profiler for guest code
+ *
+ * A host interval timer (SIGPROF on POSIX) interrupts the emulator thread
+ * and records the guest PC, and optionally the word on top of the guest
+ * stack as a shadow return address, into a lock-free ring buffer. Nothing
+ * is added to the instruction loop. The owner drains the ring between run
+ * slices and writes a histogram of guest addresses at exit, symbolized
+ * with an optional .SYM file (as written by L80, LINK or ZSID).
+ */
+
+#ifndef CPM_PROFILER_H
+#define CPM_PROFILER_H
+
+#include "qkz80.h"
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+class CPMProfiler {
+public:
+  // cpu must outlive the profiler; callers also records return addresses
+  CPMProfiler(qkz80* cpu, bool callers);
+  ~CPMProfiler();
+
+  // Start sampling hz times per second of CPU time. Only one profiler
+  // can be running at a time.
+  bool start(int hz);
+  void stop();
+
+  // Move buffered samples into the histograms. Call between run slices
+  // often enough that the ring doesn't fill (RING_SIZE samples).
+  void drain();
+
+  // Load a .SYM file ("ADDR NAME" pairs, hex addresses), false on error
+  bool load_symbols(const char* path);
+
+  // Write the histogram report, false on error
+  bool write_report(const char* path);
+
+  static const unsigned RING_SIZE = 65536;
+
+private:
+  qkz80* cpu;
+  qkz80_uint8* mem;
+  bool callers;
+  int hz;
+
+  // Sample ring: PC in the low 16 bits, return address in the high 16.
+  // The timer is the only producer and drain() the only consumer.
+  unsigned ring[RING_SIZE];
+  std::atomic<unsigned> head;
+  std::atomic<unsigned> tail;
+  std::atomic<unsigned> dropped;
+
+  std::vector<unsigned long long> pc_hist;
+  std::vector<unsigned long long> caller_hist;   // By CALL/RST address
+  unsigned long long total;
+
+  std::map<qkz80_uint16, std::string> symbols;
+
+  static CPMProfiler* active;
+  static void tick();
+
+  bool find_call_site(qkz80_uint16 ret, qkz80_uint16* site) const;
+  std::string symbolize(qkz80_uint16 addr) const;
+
+  CPMProfiler(const CPMProfiler&);
+  CPMProfiler& operator=(const CPMProfiler&);
+};
+
+#endif // CPM_PROFILER_H
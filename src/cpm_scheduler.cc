@@ -0,0 +1,366 @@
+/*
+ * M:N scheduler for hosting many CP/M sessions in one process
+ */
+
+#include "cpm_scheduler.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <chrono>
+
+// Sessions spinning on console status are requeued after this long
+// even when no input arrives, so polling loops keep making progress
+static const long long IDLE_PARK_MS = 20;
+
+// Session output is written once this much is buffered, or at the end
+// of every slice
+static const size_t OUTPUT_FLUSH_SIZE = 4096;
+
+static long long now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//=============================================================================
+// CPMSession
+//=============================================================================
+
+CPMSession::CPMSession(int afd, const CPMSharedImage* image)
+  : CPMSessionMachine(image), CPMEmulator(&processor, false),
+    fd(afd), in_pos(0), in_len(0), hangup(false), last_in_cr(false) {
+  park_on_input = true;
+}
+
+CPMSession::~CPMSession() {
+  flush_output();
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+void CPMSession::start_program() {
+  // setup_memory() state is already in the image; only registers remain
+  processor.regs.SP.set_pair16(0xFFF0);
+  processor.regs.PC.set_pair16(TPA_START);
+}
+
+// Read whatever input is available; with block=false never waits.
+// Returns true if console_in() can return without blocking.
+bool CPMSession::fill_input(bool block) {
+  while (in_pos >= in_len && !hangup) {
+    if (!block) {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, 0) <= 0) {
+        return false;
+      }
+    }
+
+    ssize_t n;
+    do {
+      n = read(fd, in_buf, sizeof(in_buf));
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+      hangup = true;
+      break;
+    }
+
+    // Telnet-style clients send CR LF or CR NUL for Enter - keep the CR
+    in_pos = 0;
+    in_len = 0;
+    for (ssize_t i = 0; i < n; i++) {
+      qkz80_uint8 ch = in_buf[i];
+      bool after_cr = last_in_cr;
+      last_in_cr = (ch == '\r');
+      if (after_cr && (ch == '\n' || ch == 0)) continue;
+      in_buf[in_len++] = ch;
+    }
+  }
+  return true;
+}
+
+void CPMSession::console_out(qkz80_uint8 ch) {
+  out_buf += (char)ch;
+}
+
+void CPMSession::console_flush() {
+  if (out_buf.size() >= OUTPUT_FLUSH_SIZE) {
+    flush_output();
+  }
+}
+
+void CPMSession::flush_output() {
+  size_t done = 0;
+  while (done < out_buf.size() && !hangup) {
+    ssize_t n = write(fd, out_buf.data() + done, out_buf.size() - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      hangup = true;
+      break;
+    }
+    done += (size_t)n;
+  }
+  out_buf.clear();
+}
+
+int CPMSession::console_in() {
+  fill_input(true);
+  if (in_pos >= in_len) {
+    // Peer went away - end the session
+    request_exit(0);
+    return -1;
+  }
+  return in_buf[in_pos++];
+}
+
+bool CPMSession::console_ready() {
+  return fill_input(false);
+}
+
+//=============================================================================
+// CPMScheduler
+//=============================================================================
+
+CPMScheduler::CPMScheduler(int num_workers, long long slice_instructions)
+  : slice(slice_instructions), live_sessions(0), runnable(0),
+    stopping(false), next_worker(0), listen_fd(-1) {
+  if (num_workers < 1) num_workers = 1;
+  for (int i = 0; i < num_workers; i++) {
+    workers.push_back(new Worker);
+  }
+  if (pipe(wake_pipe) != 0) {
+    wake_pipe[0] = wake_pipe[1] = -1;
+  } else {
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+}
+
+CPMScheduler::~CPMScheduler() {
+  for (Worker* w : workers) {
+    for (CPMSession* s : w->queue) delete s;
+    delete w;
+  }
+  for (Parked& p : park_pending) delete p.session;
+  if (wake_pipe[0] >= 0) close(wake_pipe[0]);
+  if (wake_pipe[1] >= 0) close(wake_pipe[1]);
+}
+
+int CPMScheduler::open_listener(int port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) return -1;
+
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons((uint16_t)port);
+
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      ::listen(sock, SOMAXCONN) != 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+void CPMScheduler::add(CPMSession* session) {
+  live_sessions++;
+  enqueue(session, next_worker++ % workers.size());
+}
+
+void CPMScheduler::listen(int afd, SessionFactory afactory) {
+  listen_fd = afd;
+  factory = afactory;
+}
+
+void CPMScheduler::enqueue(CPMSession* session, size_t worker_index) {
+  Worker* w = workers[worker_index];
+  {
+    std::lock_guard<std::mutex> lk(w->lock);
+    w->queue.push_back(session);
+  }
+  runnable++;
+  {
+    // Taking the lock orders this against a worker about to sleep
+    std::lock_guard<std::mutex> lk(idle_lock);
+  }
+  idle_cv.notify_one();
+}
+
+// Pop from our own queue first, then steal from the back of the others
+CPMSession* CPMScheduler::take(size_t worker_index) {
+  size_t n = workers.size();
+  for (size_t i = 0; i < n; i++) {
+    Worker* w = workers[(worker_index + i) % n];
+    std::lock_guard<std::mutex> lk(w->lock);
+    if (w->queue.empty()) continue;
+
+    CPMSession* session;
+    if (i == 0) {
+      session = w->queue.front();
+      w->queue.pop_front();
+    } else {
+      session = w->queue.back();
+      w->queue.pop_back();
+    }
+    runnable--;
+    return session;
+  }
+  return nullptr;
+}
+
+void CPMScheduler::park(CPMSession* session, bool idle) {
+  Parked p;
+  p.session = session;
+  p.deadline_ms = idle ? now_ms() + IDLE_PARK_MS : 0;
+  {
+    std::lock_guard<std::mutex> lk(park_lock);
+    park_pending.push_back(p);
+  }
+  char c = 0;
+  if (write(wake_pipe[1], &c, 1) < 0) {
+    // Pipe full - the poller is already due to wake up
+  }
+}
+
+void CPMScheduler::finish(CPMSession* session) {
+  delete session;
+  if (--live_sessions == 0 && listen_fd < 0) {
+    stopping = true;
+    {
+      std::lock_guard<std::mutex> lk(idle_lock);
+    }
+    idle_cv.notify_all();
+    char c = 0;
+    if (write(wake_pipe[1], &c, 1) < 0) {
+      // Poller will see stopping on its next wakeup
+    }
+  }
+}
+
+void CPMScheduler::worker_loop(size_t worker_index) {
+  while (!stopping) {
+    CPMSession* session = take(worker_index);
+    if (!session) {
+      std::unique_lock<std::mutex> lk(idle_lock);
+      idle_cv.wait_for(lk, std::chrono::milliseconds(100),
+                       [this] { return runnable > 0 || stopping; });
+      continue;
+    }
+
+    CPMEmulator::RunStatus status = session->run(slice);
+    session->flush_output();
+
+    switch (status) {
+    case CPMEmulator::RUN_BUDGET:
+      enqueue(session, worker_index);
+      break;
+    case CPMEmulator::RUN_BLOCKED:
+      park(session, !session->waiting_on_read());
+      break;
+    case CPMEmulator::RUN_EXITED:
+      finish(session);
+      break;
+    }
+  }
+}
+
+void CPMScheduler::poller_loop() {
+  std::vector<Parked> parked;
+  std::vector<struct pollfd> fds;
+
+  while (!stopping) {
+    {
+      std::lock_guard<std::mutex> lk(park_lock);
+      parked.insert(parked.end(), park_pending.begin(), park_pending.end());
+      park_pending.clear();
+    }
+
+    // Slot 0 is the wakeup pipe, slot 1 the listener, then parked sessions
+    fds.resize(2 + parked.size());
+    fds[0].fd = wake_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_fd;   // Negative fd is ignored by poll()
+    fds[1].events = POLLIN;
+
+    long long now = now_ms();
+    int timeout = -1;
+    for (size_t i = 0; i < parked.size(); i++) {
+      fds[2 + i].fd = parked[i].session->get_fd();
+      fds[2 + i].events = POLLIN;
+      if (parked[i].deadline_ms) {
+        long long wait = parked[i].deadline_ms - now;
+        if (wait < 0) wait = 0;
+        if (timeout < 0 || wait < timeout) timeout = (int)wait;
+      }
+    }
+    for (struct pollfd& pfd : fds) pfd.revents = 0;
+
+    if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      char drain[64];
+      while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+      }
+    }
+
+    if (fds[1].revents & POLLIN) {
+      int conn = accept(listen_fd, nullptr, nullptr);
+      if (conn >= 0) {
+        CPMSession* session = factory(conn);
+        if (session) {
+          add(session);
+        } else {
+          close(conn);
+        }
+      }
+    }
+
+    // Requeue sessions with input (or a hangup) and expired idle parks
+    now = now_ms();
+    size_t keep = 0;
+    for (size_t i = 0; i < parked.size(); i++) {
+      bool ready = (fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+      bool expired = parked[i].deadline_ms && parked[i].deadline_ms <= now;
+      if (ready || expired) {
+        enqueue(parked[i].session, next_worker++ % workers.size());
+      } else {
+        parked[keep++] = parked[i];
+      }
+    }
+    parked.resize(keep);
+  }
+
+  for (Parked& p : parked) delete p.session;
+}
+
+void CPMScheduler::run() {
+  // A session hanging up mid-write must not kill the process
+  signal(SIGPIPE, SIG_IGN);
+
+  std::thread poller(&CPMScheduler::poller_loop, this);
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i]->thread = std::thread(&CPMScheduler::worker_loop, this, i);
+  }
+
+  for (Worker* w : workers) {
+    w->thread.join();
+  }
+  poller.join();
+}
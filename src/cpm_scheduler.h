@@ -0,0 +1,130 @@
+/*
+ * M:N scheduler for hosting many CP/M sessions in one process
+ *
+ * Each session is a CPMEmulator with its own CPU and memory, attached to a
+ * file descriptor (socket, pty or serial line) for its console. Sessions
+ * are run in instruction slices on a small pool of worker threads. Every
+ * worker owns a run queue and idle workers steal from the others. A
+ * session waiting for console input is parked on the poller thread and
+ * requeued when its descriptor becomes readable, so idle sessions cost
+ * nothing but memory.
+ *
+ * POSIX only (uses poll() and sockets).
+ */
+
+#ifndef CPM_SCHEDULER_H
+#define CPM_SCHEDULER_H
+
+#include "cpm_emulator.h"
+#include "cpm_memory.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// CPU and memory for a session, constructed before the CPMEmulator base.
+// With a shared image, memory is a copy-on-write view of it.
+struct CPMSessionMachine {
+  qkz80_cpu_mem* memory;
+  qkz80 processor;
+
+  explicit CPMSessionMachine(const CPMSharedImage* image)
+    : memory(image ? new CPMCowMemory(*image) : new qkz80_cpu_mem()),
+      processor(memory) {}
+  ~CPMSessionMachine() { delete memory; }
+};
+
+// A CP/M instance whose console is a file descriptor
+class CPMSession : private CPMSessionMachine, public CPMEmulator {
+  int fd;
+  std::string out_buf;           // Console output not yet written
+  qkz80_uint8 in_buf[256];       // Console input read ahead
+  size_t in_pos;
+  size_t in_len;
+  bool hangup;                   // Peer closed the connection
+  bool last_in_cr;               // Last input byte was CR
+
+  bool fill_input(bool block);
+
+public:
+  // image: optional base memory (from setup_memory() plus the program)
+  explicit CPMSession(int afd, const CPMSharedImage* image = nullptr);
+  ~CPMSession();
+
+  int get_fd() const { return fd; }
+
+  // Start the program already present in a shared base image
+  void start_program();
+
+  // Write buffered console output to the descriptor
+  void flush_output();
+
+  void console_out(qkz80_uint8 ch) override;
+  void console_flush() override;
+  int console_in() override;
+  bool console_ready() override;
+};
+
+class CPMScheduler {
+public:
+  typedef std::function<CPMSession*(int fd)> SessionFactory;
+
+  CPMScheduler(int num_workers, long long slice_instructions);
+  ~CPMScheduler();
+
+  // Add a runnable session; the scheduler takes ownership
+  void add(CPMSession* session);
+
+  // Accept connections on listen_fd, creating a session for each one
+  void listen(int listen_fd, SessionFactory factory);
+
+  // Run until every session has exited (forever when listening)
+  void run();
+
+  // Open a TCP listening socket on port, returns -1 on error
+  static int open_listener(int port);
+
+private:
+  struct Worker {
+    std::mutex lock;
+    std::deque<CPMSession*> queue;
+    std::thread thread;
+  };
+
+  struct Parked {
+    CPMSession* session;
+    long long deadline_ms;   // Requeue even without input (0 = never)
+  };
+
+  std::vector<Worker*> workers;
+  long long slice;
+
+  std::atomic<int> live_sessions;
+  std::atomic<int> runnable;
+  std::atomic<bool> stopping;
+  std::atomic<unsigned> next_worker;
+
+  std::mutex idle_lock;
+  std::condition_variable idle_cv;
+
+  // Sessions handed to the poller, picked up on its next wakeup
+  std::mutex park_lock;
+  std::vector<Parked> park_pending;
+  int wake_pipe[2];
+
+  int listen_fd;
+  SessionFactory factory;
+
+  void enqueue(CPMSession* session, size_t worker_index);
+  CPMSession* take(size_t worker_index);
+  void park(CPMSession* session, bool idle);
+  void finish(CPMSession* session);
+  void worker_loop(size_t worker_index);
+  void poller_loop();
+};
+
+#endif // CPM_SCHEDULER_H
@@ -0,0 +1,97 @@
+/*
+ * Run statistics for --stats
+ */
+
+#include "cpm_stats.h"
+
+static const char* const COUNTER_NAMES[platform::HW_COUNTER_COUNT] = {
+  "host cycles",
+  "host instructions",
+  "branch misses",
+  "L1i misses",
+};
+
+// Short names for the one-line summary
+static const char* const COUNTER_TAGS[platform::HW_COUNTER_COUNT] = {
+  "cyc",
+  "ins",
+  "br-miss",
+  "l1i-miss",
+};
+
+CPMRunCounts::CPMRunCounts() : instructions(0), seconds(0) {
+  for (int i = 0; i < platform::HW_COUNTER_COUNT; i++) {
+    hw.value[i] = 0;
+    hw.valid[i] = false;
+  }
+}
+
+CPMRunStats::CPMRunStats(bool hardware)
+  : counters(hardware ? platform::open_hw_counters() : -1),
+    start_instructions(0), start_usec(0) {
+  platform::read_hw_counters(counters, &start_hw);
+}
+
+CPMRunStats::~CPMRunStats() {
+  platform::close_hw_counters(counters);
+}
+
+void CPMRunStats::start(long long instructions) {
+  start_instructions = instructions;
+  start_usec = platform::monotonic_usec();
+  platform::read_hw_counters(counters, &start_hw);
+}
+
+CPMRunCounts CPMRunStats::stop(long long instructions) const {
+  CPMRunCounts counts;
+  counts.instructions = instructions - start_instructions;
+  counts.seconds = (platform::monotonic_usec() - start_usec) / 1e6;
+
+  platform::HwCounterValues now;
+  platform::read_hw_counters(counters, &now);
+  for (int i = 0; i < platform::HW_COUNTER_COUNT; i++) {
+    counts.hw.valid[i] = now.valid[i] && start_hw.valid[i];
+    counts.hw.value[i] = counts.hw.valid[i] ? now.value[i] - start_hw.value[i] : 0;
+  }
+  return counts;
+}
+
+void CPMRunStats::print(FILE* fp, const CPMRunCounts& counts, const char* indent) {
+  double per = counts.instructions > 0 ? 1.0 / counts.instructions : 0;
+  fprintf(fp, "%s%lld guest instructions in %.3fs, %.1f MIPS\n", indent,
+          counts.instructions, counts.seconds,
+          counts.seconds > 0 ? counts.instructions / counts.seconds / 1e6 : 0.0);
+
+  bool any = false;
+  for (int i = 0; i < platform::HW_COUNTER_COUNT; i++) {
+    if (!counts.hw.valid[i]) continue;
+    any = true;
+    fprintf(fp, "%s%-18s %14llu  %9.3f per guest instruction\n", indent,
+            COUNTER_NAMES[i], (unsigned long long)counts.hw.value[i],
+            counts.hw.value[i] * per);
+  }
+  if (!any) {
+    fprintf(fp, "%shardware counters not available\n", indent);
+    return;
+  }
+
+  const platform::HwCounterValues& hw = counts.hw;
+  if (hw.valid[platform::HW_CYCLES] && hw.valid[platform::HW_INSTRUCTIONS] &&
+      hw.value[platform::HW_CYCLES] > 0) {
+    fprintf(fp, "%shost IPC %.2f\n", indent,
+            (double)hw.value[platform::HW_INSTRUCTIONS] / hw.value[platform::HW_CYCLES]);
+  }
+}
+
+std::string CPMRunStats::summary(const CPMRunCounts& counts) {
+  std::string out;
+  if (counts.instructions <= 0) return out;
+  for (int i = 0; i < platform::HW_COUNTER_COUNT; i++) {
+    if (!counts.hw.valid[i]) continue;
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%s%s/instr %.3f", out.empty() ? "" : "  ",
+             COUNTER_TAGS[i], (double)counts.hw.value[i] / counts.instructions);
+    out += buf;
+  }
+  return out;
+}
@@ -0,0 +1,61 @@
+/*
+ * Run statistics for --stats
+ *
+ * CPMRunStats measures a stretch of emulation on one thread: guest
+ * instructions, wall time and MIPS, plus host hardware counters (cycles,
+ * instructions, branch misses, L1 instruction cache misses) where the
+ * platform can count them. Counters are reported per guest instruction,
+ * which is the number to watch when tuning the interpreter's dispatch.
+ *
+ * Counters are often unavailable (no perf_event support, or forbidden in
+ * a container); the report then just says so and gives the MIPS figure.
+ */
+
+#ifndef CPM_STATS_H
+#define CPM_STATS_H
+
+#include "os/platform.h"
+#include <stdio.h>
+#include <string>
+
+// What one measured stretch cost
+struct CPMRunCounts {
+  long long instructions;
+  double seconds;
+  platform::HwCounterValues hw;   // Host events; none valid if unavailable
+
+  CPMRunCounts();
+};
+
+class CPMRunStats {
+public:
+  // hardware: also open the counters for the calling thread, which must
+  // be the one that runs the emulation
+  explicit CPMRunStats(bool hardware);
+  ~CPMRunStats();
+
+  bool has_counters() const { return counters >= 0; }
+
+  // Mark the start, given the emulator's instruction count
+  void start(long long instructions);
+
+  // Counts since start()
+  CPMRunCounts stop(long long instructions) const;
+
+  // Multi-line report, each line starting with indent
+  static void print(FILE* fp, const CPMRunCounts& counts, const char* indent);
+
+  // Counters per guest instruction on one line, or "" if there are none
+  static std::string summary(const CPMRunCounts& counts);
+
+private:
+  platform::HwCounters counters;
+  platform::HwCounterValues start_hw;
+  long long start_instructions;
+  uint64_t start_usec;
+
+  CPMRunStats(const CPMRunStats&);
+  CPMRunStats& operator=(const CPMRunStats&);
+};
+
+#endif // CPM_STATS_H
@@ -0,0 +1,567 @@
+/*
+ * Virtual terminal screen model
+ */
+
+#include "cpm_terminal.h"
+#include "os/platform.h"
+#include <string.h>
+#include <algorithm>
+
+// Parameters kept for one CSI sequence
+static const size_t MAX_PARAMS = 16;
+
+// Unchanged cells rewritten rather than skipped with a cursor move
+static const int SHORT_GAP = 6;
+
+CPMTerminal::CPMTerminal(Type atype, int arows, int acols, FILE* ahost)
+  : fps(30), guest_bytes(0), host_bytes(0), frames(0),
+    type(atype), rows(arows), cols(acols), host(ahost),
+    screen(arows * acols), shown(arows * acols), dirty_lo(arows), dirty_hi(arows),
+    any_dirty(false), cleared(true), bell(false), shown_row(0), shown_col(0),
+    last_frame_usec(0) {
+  Cell blank = {' ', 0};
+  std::fill(shown.begin(), shown.end(), blank);
+  reset();
+
+  // Nothing to draw until the guest writes
+  for (int r = 0; r < rows; r++) {
+    dirty_lo[r] = cols;
+    dirty_hi[r] = -1;
+  }
+  any_dirty = false;
+}
+
+bool CPMTerminal::parse_type(const char* name, Type* type) {
+  if (strcmp(name, "adm3a") == 0) {
+    *type = TERM_ADM3A;
+  } else if (strcmp(name, "vt52") == 0) {
+    *type = TERM_VT52;
+  } else if (strcmp(name, "vt100") == 0 || strcmp(name, "ansi") == 0) {
+    *type = TERM_VT100;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void CPMTerminal::reset() {
+  Cell blank = {' ', 0};
+  std::fill(screen.begin(), screen.end(), blank);
+  for (int r = 0; r < rows; r++) {
+    touch(r, 0, cols - 1);
+  }
+  row = col = 0;
+  wrap_pending = false;
+  attr = 0;
+  top = 0;
+  bottom = rows - 1;
+  saved_row = saved_col = 0;
+  saved_attr = 0;
+  state = ST_NORMAL;
+  params.clear();
+  private_mode = false;
+}
+
+// ============================================================================
+// Screen Buffer
+// ============================================================================
+
+void CPMTerminal::touch(int r, int c0, int c1) {
+  if (c0 < dirty_lo[r]) dirty_lo[r] = c0;
+  if (c1 > dirty_hi[r]) dirty_hi[r] = c1;
+  any_dirty = true;
+}
+
+void CPMTerminal::put(char ch) {
+  if (wrap_pending) {
+    col = 0;
+    line_feed();
+    wrap_pending = false;
+  }
+
+  Cell& cell = at(row, col);
+  cell.ch = ch;
+  cell.attr = attr;
+  touch(row, col, col);
+
+  if (col < cols - 1) {
+    col++;
+  } else if (type == TERM_VT100) {
+    wrap_pending = true;   // Wraps when the next character arrives
+  } else if (type == TERM_ADM3A) {
+    col = 0;               // Wraps at once
+    line_feed();
+  }                        // VT52 stays on the last column
+}
+
+void CPMTerminal::clear_cells(int r, int c0, int c1) {
+  if (c0 > c1) return;
+  Cell blank = {' ', 0};
+  for (int c = c0; c <= c1; c++) {
+    at(r, c) = blank;
+  }
+  touch(r, c0, c1);
+}
+
+void CPMTerminal::line_feed() {
+  if (row == bottom) {
+    scroll_up(top, bottom, 1);
+  } else if (row < rows - 1) {
+    row++;
+  }
+}
+
+void CPMTerminal::reverse_line_feed() {
+  if (row == top) {
+    scroll_down(top, bottom, 1);
+  } else if (row > 0) {
+    row--;
+  }
+}
+
+// Move rows from+count..to up to from, blanking the rows left at the bottom
+void CPMTerminal::scroll_up(int from, int to, int count) {
+  count = std::min(count, to - from + 1);
+  for (int r = from; r <= to - count; r++) {
+    std::copy(&at(r + count, 0), &at(r + count, 0) + cols, &at(r, 0));
+    touch(r, 0, cols - 1);
+  }
+  for (int r = to - count + 1; r <= to; r++) {
+    clear_cells(r, 0, cols - 1);
+  }
+}
+
+void CPMTerminal::scroll_down(int from, int to, int count) {
+  count = std::min(count, to - from + 1);
+  for (int r = to; r >= from + count; r--) {
+    std::copy(&at(r - count, 0), &at(r - count, 0) + cols, &at(r, 0));
+    touch(r, 0, cols - 1);
+  }
+  for (int r = from; r < from + count; r++) {
+    clear_cells(r, 0, cols - 1);
+  }
+}
+
+void CPMTerminal::move_to(int r, int c) {
+  row = std::max(0, std::min(r, rows - 1));
+  col = std::max(0, std::min(c, cols - 1));
+  wrap_pending = false;
+}
+
+std::string CPMTerminal::row_text(int r) const {
+  std::string text;
+  for (int c = 0; c < cols; c++) {
+    text += at(r, c).ch;
+  }
+  size_t end = text.find_last_not_of(' ');
+  text.erase(end == std::string::npos ? 0 : end + 1);
+  return text;
+}
+
+void CPMTerminal::dump(FILE* fp) const {
+  for (int r = 0; r < rows; r++) {
+    fprintf(fp, "%s\n", row_text(r).c_str());
+  }
+}
+
+// ============================================================================
+// Parsers
+// ============================================================================
+
+void CPMTerminal::write(qkz80_uint8 ch) {
+  guest_bytes++;
+  ch &= 0x7F;
+
+  switch (state) {
+  case ST_NORMAL:
+    if (ch == 0x1B) {
+      state = ST_ESC;
+    } else if (ch < 0x20 || ch == 0x7F) {
+      control(ch);
+    } else {
+      put((char)ch);
+    }
+    break;
+
+  case ST_ESC:
+    state = ST_NORMAL;
+    escape(ch);
+    break;
+
+  case ST_ADDR_ROW:
+    addr_row = ch - 32;
+    state = ST_ADDR_COL;
+    break;
+
+  case ST_ADDR_COL:
+    move_to(addr_row, ch - 32);
+    state = ST_NORMAL;
+    break;
+
+  case ST_CSI:
+    if (ch == 0x1B) {
+      state = ST_ESC;
+    } else if (ch < 0x20) {
+      control(ch);   // Executed in the middle of a sequence
+    } else {
+      csi(ch);
+    }
+    break;
+
+  case ST_SKIP_ONE:
+    state = ST_NORMAL;
+    break;
+  }
+}
+
+void CPMTerminal::control(qkz80_uint8 ch) {
+  switch (ch) {
+  case 0x07:
+    bell = true;
+    return;
+  case 0x08:
+    if (col > 0) col--;
+    break;
+  case 0x09:
+    col = std::min(cols - 1, (col / 8 + 1) * 8);
+    break;
+  case 0x0A:
+    line_feed();
+    break;
+  case 0x0D:
+    col = 0;
+    break;
+  case 0x0B:   // ADM-3A up, VT line feed
+    if (type != TERM_ADM3A) {
+      line_feed();
+    } else if (row > 0) {
+      row--;
+    }
+    break;
+  case 0x0C:   // ADM-3A right, VT line feed
+    if (type != TERM_ADM3A) {
+      line_feed();
+    } else if (col < cols - 1) {
+      col++;
+    }
+    break;
+  case 0x1A:   // ADM-3A clear screen
+    if (type == TERM_ADM3A) {
+      for (int r = 0; r < rows; r++) clear_cells(r, 0, cols - 1);
+      row = col = 0;
+    }
+    break;
+  case 0x1E:   // ADM-3A home
+    if (type == TERM_ADM3A) {
+      row = col = 0;
+    }
+    break;
+  default:
+    return;
+  }
+  wrap_pending = false;
+}
+
+void CPMTerminal::escape(qkz80_uint8 ch) {
+  if (type == TERM_ADM3A) {
+    switch (ch) {
+    case '=':
+      state = ST_ADDR_ROW;
+      break;
+    case 'T': case 't':   // Clear to end of line
+      clear_cells(row, col, cols - 1);
+      break;
+    case 'Y': case 'y':   // Clear to end of screen
+      clear_cells(row, col, cols - 1);
+      for (int r = row + 1; r < rows; r++) clear_cells(r, 0, cols - 1);
+      break;
+    case '*': case '+': case ':': case ';':   // Clear screen
+      for (int r = 0; r < rows; r++) clear_cells(r, 0, cols - 1);
+      move_to(0, 0);
+      break;
+    case 'E':   // Insert line
+      scroll_down(row, rows - 1, 1);
+      break;
+    case 'R':   // Delete line
+      scroll_up(row, rows - 1, 1);
+      break;
+    }
+    return;
+  }
+
+  if (type == TERM_VT52) {
+    switch (ch) {
+    case 'A': move_to(row - 1, col); break;
+    case 'B': move_to(row + 1, col); break;
+    case 'C': move_to(row, col + 1); break;
+    case 'D': move_to(row, col - 1); break;
+    case 'H': move_to(0, 0); break;
+    case 'I': reverse_line_feed(); break;
+    case 'J':
+      clear_cells(row, col, cols - 1);
+      for (int r = row + 1; r < rows; r++) clear_cells(r, 0, cols - 1);
+      break;
+    case 'K': clear_cells(row, col, cols - 1); break;
+    case 'Y': state = ST_ADDR_ROW; break;
+    // H19 extensions
+    case 'E':
+      for (int r = 0; r < rows; r++) clear_cells(r, 0, cols - 1);
+      move_to(0, 0);
+      break;
+    case 'L': scroll_down(row, rows - 1, 1); break;
+    case 'M': scroll_up(row, rows - 1, 1); break;
+    case 'p': attr |= ATTR_REVERSE; break;
+    case 'q': attr &= ~ATTR_REVERSE; break;
+    case 'j': saved_row = row; saved_col = col; break;
+    case 'k': move_to(saved_row, saved_col); break;
+    }
+    return;
+  }
+
+  switch (ch) {
+  case '[':
+    state = ST_CSI;
+    params.clear();
+    private_mode = false;
+    break;
+  case 'D': line_feed(); break;
+  case 'M': reverse_line_feed(); break;
+  case 'E': col = 0; line_feed(); break;
+  case '7':
+    saved_row = row;
+    saved_col = col;
+    saved_attr = attr;
+    break;
+  case '8':
+    move_to(saved_row, saved_col);
+    attr = saved_attr;
+    break;
+  case 'c': reset(); break;
+  case '(': case ')': case '#':
+    state = ST_SKIP_ONE;
+    break;
+  }
+}
+
+int CPMTerminal::param(size_t i, int dflt) const {
+  return (i < params.size() && params[i] != 0) ? params[i] : dflt;
+}
+
+void CPMTerminal::csi(qkz80_uint8 ch) {
+  if (ch >= '0' && ch <= '9') {
+    if (params.empty()) params.push_back(0);
+    params.back() = std::min(params.back() * 10 + (ch - '0'), 9999);
+    return;
+  }
+  if (ch == ';') {
+    if (params.empty()) params.push_back(0);
+    if (params.size() < MAX_PARAMS) params.push_back(0);
+    return;
+  }
+  if (ch == '?') {
+    private_mode = true;
+    return;
+  }
+  if (ch < 0x40) {
+    return;   // Intermediate bytes
+  }
+
+  state = ST_NORMAL;
+  if (private_mode) {
+    return;   // DEC modes such as cursor visibility
+  }
+
+  int n = param(0, 1);
+  switch (ch) {
+  case 'A': move_to(std::max(row - n, row >= top ? top : 0), col); break;
+  case 'B': move_to(std::min(row + n, row <= bottom ? bottom : rows - 1), col); break;
+  case 'C': move_to(row, col + n); break;
+  case 'D': move_to(row, col - n); break;
+  case 'G': case '`': move_to(row, n - 1); break;
+  case 'd': move_to(n - 1, col); break;
+  case 'H': case 'f': move_to(param(0, 1) - 1, param(1, 1) - 1); break;
+
+  case 'J':
+    if (param(0, 0) == 0) {
+      clear_cells(row, col, cols - 1);
+      for (int r = row + 1; r < rows; r++) clear_cells(r, 0, cols - 1);
+    } else if (param(0, 0) == 1) {
+      for (int r = 0; r < row; r++) clear_cells(r, 0, cols - 1);
+      clear_cells(row, 0, col);
+    } else {
+      for (int r = 0; r < rows; r++) clear_cells(r, 0, cols - 1);
+    }
+    break;
+
+  case 'K':
+    if (param(0, 0) == 0) {
+      clear_cells(row, col, cols - 1);
+    } else if (param(0, 0) == 1) {
+      clear_cells(row, 0, col);
+    } else {
+      clear_cells(row, 0, cols - 1);
+    }
+    break;
+
+  case 'L':
+    if (row >= top && row <= bottom) scroll_down(row, bottom, n);
+    break;
+  case 'M':
+    if (row >= top && row <= bottom) scroll_up(row, bottom, n);
+    break;
+
+  case '@':
+  case 'P': {
+    n = std::min(n, cols - col);
+    Cell* line = &at(row, 0);
+    if (ch == '@') {
+      std::copy_backward(line + col, line + cols - n, line + cols);
+      clear_cells(row, col, col + n - 1);
+    } else {
+      std::copy(line + col + n, line + cols, line + col);
+      clear_cells(row, cols - n, cols - 1);
+    }
+    touch(row, col, cols - 1);
+    break;
+  }
+  case 'X':
+    clear_cells(row, col, std::min(cols - 1, col + n - 1));
+    break;
+
+  case 'm':
+    if (params.empty()) attr = 0;
+    for (size_t i = 0; i < params.size(); i++) {
+      switch (params[i]) {
+      case 0: attr = 0; break;
+      case 1: attr |= ATTR_BOLD; break;
+      case 4: attr |= ATTR_UNDERLINE; break;
+      case 7: attr |= ATTR_REVERSE; break;
+      case 22: attr &= ~ATTR_BOLD; break;
+      case 24: attr &= ~ATTR_UNDERLINE; break;
+      case 27: attr &= ~ATTR_REVERSE; break;
+      }
+    }
+    break;
+
+  case 'r': {
+    int t = param(0, 1) - 1;
+    int b = param(1, rows) - 1;
+    if (t >= 0 && b < rows && t < b) {
+      top = t;
+      bottom = b;
+      move_to(0, 0);
+    }
+    break;
+  }
+  case 's':
+    saved_row = row;
+    saved_col = col;
+    break;
+  case 'u':
+    move_to(saved_row, saved_col);
+    break;
+  }
+}
+
+// ============================================================================
+// Rendering
+// ============================================================================
+
+bool CPMTerminal::changed() const {
+  return any_dirty || bell || row != shown_row || col != shown_col;
+}
+
+void CPMTerminal::update() {
+  if (!host || !changed()) return;
+  uint64_t now = platform::monotonic_usec();
+  if (fps > 0 && now - last_frame_usec < 1000000u / (unsigned)fps) return;
+  render();
+  last_frame_usec = now;
+}
+
+void CPMTerminal::present() {
+  if (!host || !changed()) return;
+  render();
+  last_frame_usec = platform::monotonic_usec();
+}
+
+void CPMTerminal::finish() {
+  present();
+  if (!host) return;
+  fprintf(host, "\x1b[%d;1H\r\n", rows);
+  fflush(host);
+}
+
+static void append_sgr(std::string& out, qkz80_uint8 attr) {
+  out += "\x1b[0";
+  if (attr & 1) out += ";1";
+  if (attr & 2) out += ";4";
+  if (attr & 4) out += ";7";
+  out += 'm';
+}
+
+// Send the cells that differ from the host screen, then place the cursor
+void CPMTerminal::render() {
+  std::string out;
+  char buf[32];
+
+  if (cleared) {
+    out += "\x1b[0m\x1b[H\x1b[2J";
+    shown_row = shown_col = 0;
+    cleared = false;
+  }
+
+  qkz80_uint8 host_attr = 0;
+  for (int r = 0; r < rows && any_dirty; r++) {
+    for (int c = dirty_lo[r]; c <= dirty_hi[r]; c++) {
+      const Cell& cell = at(r, c);
+      Cell& old = shown[r * cols + c];
+      if (!(cell != old)) continue;
+
+      if (r != shown_row || c != shown_col) {
+        // Rewriting a short run of unchanged cells is cheaper than moving
+        int gap = (r == shown_row) ? c - shown_col : -1;
+        bool same_attr = gap > 0 && gap <= SHORT_GAP;
+        for (int g = shown_col; same_attr && g < c; g++) {
+          same_attr = at(r, g).attr == host_attr;
+        }
+        if (same_attr) {
+          for (int g = shown_col; g < c; g++) out += at(r, g).ch;
+        } else {
+          snprintf(buf, sizeof(buf), "\x1b[%d;%dH", r + 1, c + 1);
+          out += buf;
+        }
+      }
+      if (cell.attr != host_attr) {
+        append_sgr(out, cell.attr);
+        host_attr = cell.attr;
+      }
+      out += cell.ch;
+      old = cell;
+      shown_row = r;
+      shown_col = c + 1;
+    }
+    dirty_lo[r] = cols;
+    dirty_hi[r] = -1;
+  }
+  any_dirty = false;
+
+  if (host_attr != 0) {
+    out += "\x1b[0m";
+  }
+  if (row != shown_row || col != shown_col) {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row + 1, col + 1);
+    out += buf;
+    shown_row = row;
+    shown_col = col;
+  }
+  if (bell) {
+    out += '\a';
+    bell = false;
+  }
+
+  fwrite(out.data(), 1, out.size(), host);
+  fflush(host);
+  host_bytes += out.size();
+  frames++;
+}
@@ -0,0 +1,131 @@
+/*
+ * Virtual terminal screen model
+ *
+ * Full-screen CP/M programs write cursor addressing sequences one byte at
+ * a time. CPMTerminal interprets them for an ADM-3A, VT52 or VT100 into a
+ * screen buffer instead of passing every byte to the host terminal. The
+ * host then sees frames: at most fps of them a second, each containing
+ * only the cells that differ from what it already shows, drawn with ANSI
+ * sequences. A program that repaints an unchanged screen sends nothing.
+ *
+ * Without a host stream the terminal is headless, and the screen can be
+ * dumped as text for batch tests.
+ */
+
+#ifndef CPM_TERMINAL_H
+#define CPM_TERMINAL_H
+
+#include "qkz80_types.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class CPMTerminal {
+public:
+  enum Type {
+    TERM_ADM3A,   // Lear Siegler ADM-3A (Kaypro, Osborne)
+    TERM_VT52,    // DEC VT52 (also H19 reverse video)
+    TERM_VT100    // DEC VT100 / ANSI subset
+  };
+
+  // host: stream frames are drawn on, or nullptr for headless
+  CPMTerminal(Type type, int rows, int cols, FILE* host);
+
+  // Name as given to --terminal ("adm3a", "vt52", "vt100")
+  static bool parse_type(const char* name, Type* type);
+
+  // Interpret one byte of guest output
+  void write(qkz80_uint8 ch);
+
+  // Draw a frame if the screen changed and one is due
+  void update();
+
+  // Draw any change now, e.g. before waiting for input
+  void present();
+
+  // Last frame, then leave the host cursor below the screen
+  void finish();
+
+  // Screen text, one line per row with trailing blanks removed
+  void dump(FILE* fp) const;
+  std::string row_text(int row) const;
+
+  int fps;                  // Frame rate limit for update()
+
+  // Traffic, to show what the model saved
+  uint64_t guest_bytes;     // Bytes written by the guest
+  uint64_t host_bytes;      // Bytes sent to the host
+  uint64_t frames;
+
+private:
+  enum Attr {
+    ATTR_BOLD = 1,
+    ATTR_UNDERLINE = 2,
+    ATTR_REVERSE = 4
+  };
+
+  struct Cell {
+    char ch;
+    qkz80_uint8 attr;
+    bool operator!=(const Cell& o) const { return ch != o.ch || attr != o.attr; }
+  };
+
+  enum State {
+    ST_NORMAL,
+    ST_ESC,
+    ST_ADDR_ROW,     // ADM-3A ESC = / VT52 ESC Y: next byte is row + 32
+    ST_ADDR_COL,
+    ST_CSI,          // VT100 ESC [
+    ST_SKIP_ONE      // Consume one byte (character set selection)
+  };
+
+  Type type;
+  int rows, cols;
+  FILE* host;
+
+  std::vector<Cell> screen;   // What the guest drew
+  std::vector<Cell> shown;    // What the host shows
+  std::vector<int> dirty_lo;  // Per row: first and last column changed
+  std::vector<int> dirty_hi;  //   since the last frame (lo > hi = clean)
+  bool any_dirty;
+  bool cleared;               // Host screen must be cleared first
+  bool bell;                  // BEL to pass on with the next frame
+  int shown_row, shown_col;   // Host cursor after the last frame
+
+  int row, col;
+  bool wrap_pending;          // Cursor is past the last column
+  qkz80_uint8 attr;
+  int top, bottom;            // Scroll region
+  int saved_row, saved_col;
+  qkz80_uint8 saved_attr;
+
+  State state;
+  int addr_row;
+  std::vector<int> params;
+  bool private_mode;          // CSI ? sequence
+
+  uint64_t last_frame_usec;
+
+  Cell& at(int r, int c) { return screen[r * cols + c]; }
+  const Cell& at(int r, int c) const { return screen[r * cols + c]; }
+  void touch(int r, int c0, int c1);
+  void put(char ch);
+  void clear_cells(int r, int c0, int c1);
+  void line_feed();
+  void reverse_line_feed();
+  void scroll_up(int from, int to, int count);
+  void scroll_down(int from, int to, int count);
+  void move_to(int r, int c);
+  void reset();
+
+  void control(qkz80_uint8 ch);
+  void escape(qkz80_uint8 ch);
+  void csi(qkz80_uint8 ch);
+  int param(size_t i, int dflt) const;
+
+  bool changed() const;
+  void render();
+};
+
+#endif // CPM_TERMINAL_H
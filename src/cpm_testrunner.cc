@@ -0,0 +1,318 @@
+/*
+ * Parallel regression runner for interpreted CP/M programs
+ */
+
+#include "cpm_testrunner.h"
+#include "cpm_hang.h"
+#include "os/platform.h"
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+// Instructions run between limit and hang checks
+static const long long TEST_SLICE = 1000000LL;
+
+// CPU and memory for a test, constructed before the CPMEmulator base
+struct CPMTestMachine {
+  qkz80_cpu_mem memory;
+  qkz80 processor;
+
+  CPMTestMachine() : processor(&memory) {}
+};
+
+// A CP/M instance with scripted console input and captured output
+class CPMCaptureEmulator : private CPMTestMachine, public CPMEmulator {
+  std::string input;
+  size_t in_pos;
+
+public:
+  std::string console;
+  std::string list;
+
+  explicit CPMCaptureEmulator(const std::string& script)
+    : CPMEmulator(&processor, false), input(script), in_pos(0) {
+    quiet = true;
+  }
+
+  void console_out(qkz80_uint8 ch) override {
+    if (ch != '\r') console += (char)ch;
+  }
+
+  void console_flush() override {}
+
+  // Reading past the end of the script ends the test
+  int console_in() override {
+    if (in_pos < input.size()) {
+      return (qkz80_uint8)input[in_pos++];
+    }
+    request_exit(0);
+    return -1;
+  }
+
+  bool console_ready() override {
+    return in_pos < input.size();
+  }
+
+  // Spinning on status with no script left would never end
+  void console_idle(int) override {
+    if (in_pos >= input.size()) {
+      request_exit(0);
+    }
+  }
+
+  void list_out(qkz80_uint8 ch) override {
+    if (ch != '\r') list += (char)ch;
+  }
+};
+
+static bool read_file(const std::string& path, std::string* data) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (!fp) return false;
+  data->clear();
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    data->append(buf, n);
+  }
+  fclose(fp);
+  return true;
+}
+
+static bool write_file(const std::string& path, const std::string& data) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (!fp) return false;
+  bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+  return fclose(fp) == 0 && ok;
+}
+
+static std::string strip_cr(const std::string& text) {
+  std::string out;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] != '\r') out += text[i];
+  }
+  return out;
+}
+
+// Describe the first line where expected and actual differ
+static std::string first_difference(const std::string& expected, const std::string& actual) {
+  size_t pos = 0;
+  size_t start = 0;
+  int line = 1;
+  while (pos < expected.size() && pos < actual.size() && expected[pos] == actual[pos]) {
+    if (expected[pos] == '\n') {
+      line++;
+      start = pos + 1;
+    }
+    pos++;
+  }
+
+  std::string want = expected.substr(start, expected.find('\n', start) - start);
+  std::string got = actual.substr(start, actual.find('\n', start) - start);
+  if (start >= expected.size()) want = "<end of output>";
+  if (start >= actual.size()) got = "<end of output>";
+  return "line " + std::to_string(line) + ": expected \"" + want + "\", got \"" + got + "\"";
+}
+
+CPMTestRunner::CPMTestRunner(const std::string& ainterpreter, bool amode_8080)
+  : instruction_limit(2000000000LL), time_limit(0), hang_window(0), file_cache(nullptr), stats(false),
+    interpreter(ainterpreter), mode_8080(amode_8080),
+    update_golden(false), wall_seconds(0) {
+}
+
+int CPMTestRunner::scan(const std::string& dir, const std::string& ext) {
+  if (platform::get_file_type(dir.c_str()) != platform::FileType::Directory) {
+    return -1;
+  }
+
+  std::vector<platform::DirEntry> entries = platform::list_directory(dir.c_str());
+  std::vector<std::string> names;
+  for (size_t i = 0; i < entries.size(); i++) {
+    const std::string& name = entries[i].name;
+    if (entries[i].is_directory || name.size() <= ext.size()) continue;
+    std::string tail = name.substr(name.size() - ext.size());
+    bool match = true;
+    for (size_t j = 0; j < ext.size(); j++) {
+      if (tolower((unsigned char)tail[j]) != tolower((unsigned char)ext[j])) match = false;
+    }
+    if (match) names.push_back(name);
+  }
+  std::sort(names.begin(), names.end());
+
+  for (size_t i = 0; i < names.size(); i++) {
+    CPMTestCase test;
+    test.name = names[i];
+    test.source = dir + platform::path_separator() + names[i];
+    test.stem = test.source.substr(0, test.source.size() - ext.size());
+    tests.push_back(test);
+  }
+  return (int)names.size();
+}
+
+bool CPMTestRunner::run(int num_jobs, bool update) {
+  update_golden = update;
+
+  std::string data;
+  if (!read_file(interpreter, &data) || data.empty()) {
+    return false;
+  }
+  image.assign(data.begin(), data.end());
+  image.resize(std::min(image.size(), (size_t)(CCP_BASE - TPA_START)));
+
+  if (num_jobs < 1) num_jobs = 1;
+  if ((size_t)num_jobs > tests.size()) num_jobs = (int)std::max(tests.size(), (size_t)1);
+
+  uint64_t start = platform::monotonic_usec();
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_jobs; i++) {
+    threads.push_back(std::thread([this, &next]() {
+      size_t index;
+      while ((index = next.fetch_add(1)) < tests.size()) {
+        run_test(tests[index]);
+      }
+    }));
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  wall_seconds = (platform::monotonic_usec() - start) / 1e6;
+  return true;
+}
+
+void CPMTestRunner::run_test(CPMTestCase& test) {
+  std::string script;
+  if (read_file(test.stem + ".in", &script)) {
+    script = strip_cr(script);
+  }
+
+  CPMCaptureEmulator cpm(script);
+  qkz80* cpu = cpm.get_cpu();
+  cpu->set_cpu_mode(mode_8080 ? qkz80::MODE_8080 : qkz80::MODE_Z80);
+  cpm.setup_memory();
+  memcpy(&cpu->get_mem()[TPA_START], image.data(), image.size());
+  cpu->regs.PC.set_pair16(TPA_START);
+
+  // Command tail "NAME.BAS"; the source is mapped under that name
+  std::string cpm_name;
+  for (size_t i = 0; i < test.name.size(); i++) {
+    cpm_name += (char)toupper((unsigned char)test.name[i]);
+  }
+  std::vector<char*> argv;
+  argv.push_back(const_cast<char*>(interpreter.c_str()));
+  argv.push_back(const_cast<char*>(cpm_name.c_str()));
+  cpm.setup_command_line((int)argv.size(), argv.data(), 0);
+
+  // Sources already in CP/M CR/LF form must not get a second CR
+  std::string source;
+  read_file(test.source, &source);
+  bool has_crlf = source.find("\r\n") != std::string::npos;
+  cpm.add_file_mapping_ex(cpm_name, test.source, MODE_TEXT, !has_crlf);
+
+  // Long names reach the program truncated to 8.3 in the FCB
+  size_t dot = cpm_name.find('.');
+  if (dot != std::string::npos && dot > 8) {
+    std::string name_83 = cpm_name.substr(0, 8) + cpm_name.substr(dot, 4);
+    cpm.add_file_mapping_ex(name_83, test.source, MODE_TEXT, !has_crlf);
+  }
+
+  cpm.file_cache = file_cache;
+
+  CPMHangDetector hang(&cpm, hang_window);
+  const char* stop_reason = nullptr;
+  CPMRunStats meter(stats);
+  meter.start(cpm.instruction_count);
+  uint64_t start = platform::monotonic_usec();
+  while (!cpm.has_exited()) {
+    if (cpm.instruction_count >= instruction_limit) {
+      stop_reason = "instruction limit reached";
+      break;
+    }
+    if (time_limit > 0 && (platform::monotonic_usec() - start) / 1e6 >= time_limit) {
+      stop_reason = "time limit reached";
+      break;
+    }
+    cpm.run(std::min(TEST_SLICE, instruction_limit - cpm.instruction_count));
+    if (hang_window > 0 && !cpm.has_exited()) {
+      CPMHangDetector::Verdict verdict = hang.check();
+      if (verdict != CPMHangDetector::HANG_NONE) {
+        stop_reason = CPMHangDetector::describe(verdict);
+        break;
+      }
+    }
+  }
+  test.seconds = (platform::monotonic_usec() - start) / 1e6;
+  if (stats) {
+    test.counts = meter.stop(cpm.instruction_count);
+  }
+  test.instructions = cpm.instruction_count;
+  test.console.swap(cpm.console);
+  test.list.swap(cpm.list);
+
+  if (stop_reason) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s at PC=%04X", stop_reason, cpu->regs.PC.get_pair16());
+    test.failure = msg;
+    return;
+  }
+
+  test.passed = true;
+  check_output(test, ".out", test.console, "console", true);
+  check_output(test, ".lpt", test.list, "printer", false);
+}
+
+// Compare one output with its golden file, or rewrite the golden file.
+// A golden file that is not required defaults to empty output.
+void CPMTestRunner::check_output(CPMTestCase& test, const char* ext, const std::string& actual,
+                                 const char* what, bool required) {
+  std::string path = test.stem + ext;
+  std::string expected;
+  bool found = read_file(path, &expected);
+
+  if (update_golden) {
+    if (actual.empty() && !required) {
+      if (found) platform::delete_file(path.c_str());
+    } else if (!write_file(path, actual)) {
+      test.passed = false;
+      test.failure = "cannot write " + path;
+    }
+    return;
+  }
+
+  if (!found && required) {
+    test.passed = false;
+    test.failure = "no golden file " + path;
+    return;
+  }
+  expected = strip_cr(expected);
+  if (expected != actual && test.passed) {
+    test.passed = false;
+    test.failure = std::string(what) + " " + first_difference(expected, actual);
+  }
+}
+
+int CPMTestRunner::report(FILE* fp) const {
+  int failed = 0;
+  long long total_instructions = 0;
+  for (size_t i = 0; i < tests.size(); i++) {
+    const CPMTestCase& test = tests[i];
+    fprintf(fp, "%-4s %-24s %12lld instr %8.3fs %8.1f MIPS\n",
+            test.passed ? (update_golden ? "UPD" : "PASS") : "FAIL",
+            test.name.c_str(), test.instructions, test.seconds,
+            test.seconds > 0 ? test.instructions / test.seconds / 1e6 : 0.0);
+    if (stats) {
+      std::string summary = CPMRunStats::summary(test.counts);
+      fprintf(fp, "     %s\n", summary.empty() ? "hardware counters not available" : summary.c_str());
+    }
+    if (!test.passed) {
+      fprintf(fp, "     %s\n", test.failure.c_str());
+      failed++;
+    }
+    total_instructions += test.instructions;
+  }
+  fprintf(fp, "%d tests, %d passed, %d failed, %lld instructions in %.3fs\n",
+          (int)tests.size(), (int)tests.size() - failed, failed,
+          total_instructions, wall_seconds);
+  return failed;
+}
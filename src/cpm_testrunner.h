@@ -0,0 +1,88 @@
+/*
+ * Parallel regression runner for interpreted CP/M programs
+ *
+ * Runs every test source in a directory (NAME.BAS by default) under an
+ * interpreter such as MBASIC, as "INTERP NAME.BAS". Each test gets its own
+ * in-process CPMEmulator, and tests are spread over a pool of threads.
+ *
+ * Console input comes from NAME.in if it exists. Once the script is used
+ * up, the next console read (or a status poll loop) ends the test, so an
+ * interpreter that returns to its prompt finishes cleanly. Console and LST:
+ * output are captured in memory and compared with the golden files
+ * NAME.out and NAME.lpt next to the source; a missing NAME.lpt means no
+ * printer output is expected.
+ */
+
+#ifndef CPM_TESTRUNNER_H
+#define CPM_TESTRUNNER_H
+
+#include "cpm_emulator.h"
+#include "cpm_stats.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+struct CPMTestCase {
+  std::string name;          // Source file name, e.g. circ10.bas
+  std::string source;        // Path of the source
+  std::string stem;          // Path without the extension
+
+  // Results
+  bool passed;
+  std::string failure;       // Why it failed
+  std::string console;       // Captured output, CR/LF as LF
+  std::string list;
+  long long instructions;
+  double seconds;
+  CPMRunCounts counts;       // With stats on
+
+  CPMTestCase() : passed(false), instructions(0), seconds(0) {}
+};
+
+class CPMTestRunner {
+public:
+  // interpreter: .COM image run for each test
+  CPMTestRunner(const std::string& interpreter, bool mode_8080);
+
+  // Add every file in dir whose name ends in ext (case-insensitive).
+  // Returns the number of tests found, -1 if the directory is unreadable.
+  int scan(const std::string& dir, const std::string& ext);
+
+  // Run all tests on num_jobs threads and compare with the golden files,
+  // or with update set, rewrite the golden files from the output instead.
+  // Returns false if the interpreter cannot be loaded.
+  bool run(int num_jobs, bool update);
+
+  // Per-test results and a summary; returns the number of failed tests
+  int report(FILE* fp) const;
+
+  // Instructions and wall time a single test may use before it is
+  // failed (0 seconds = no time limit)
+  long long instruction_limit;
+  double time_limit;
+
+  // Fail a test early when CPMHangDetector finds it stuck for this many
+  // instructions (0 = off)
+  long long hang_window;
+
+  // Content cache shared by every test (not owned, nullptr = off)
+  CPMFileCache* file_cache;
+
+  // Measure host hardware counters for each test and add them to the
+  // report, per guest instruction
+  bool stats;
+
+private:
+  std::string interpreter;
+  bool mode_8080;
+  bool update_golden;
+  std::vector<qkz80_uint8> image;
+  std::vector<CPMTestCase> tests;
+  double wall_seconds;
+
+  void run_test(CPMTestCase& test);
+  void check_output(CPMTestCase& test, const char* ext, const std::string& actual,
+                    const char* what, bool required);
+};
+
+#endif // CPM_TESTRUNNER_H
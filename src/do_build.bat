@@ -18,33 +18,81 @@ echo.
 echo Building cpmemu for Windows x64...
 echo.
 
-echo [1/6] Compiling qkz80.cc...
+echo [1/18] Compiling qkz80.cc...
 cl /nologo /c /EHsc /O2 /std:c++14 /I. qkz80.cc
 if errorlevel 1 goto :error
 
-echo [2/6] Compiling qkz80_errors.cc...
+echo [2/18] Compiling qkz80_errors.cc...
 cl /nologo /c /EHsc /O2 /std:c++14 /I. qkz80_errors.cc
 if errorlevel 1 goto :error
 
-echo [3/6] Compiling qkz80_mem.cc...
+echo [3/18] Compiling qkz80_mem.cc...
 cl /nologo /c /EHsc /O2 /std:c++14 /I. qkz80_mem.cc
 if errorlevel 1 goto :error
 
-echo [4/6] Compiling qkz80_reg_set.cc...
+echo [4/18] Compiling qkz80_reg_set.cc...
 cl /nologo /c /EHsc /O2 /std:c++14 /I. qkz80_reg_set.cc
 if errorlevel 1 goto :error
 
-echo [5/6] Compiling os\windows\platform.cc...
+echo [5/18] Compiling os\windows\platform.cc...
 cl /nologo /c /EHsc /O2 /std:c++14 /I. os\windows\platform.cc /Foplatform.obj
 if errorlevel 1 goto :error
 
-echo [6/6] Compiling cpmemu.cc...
+echo [6/18] Compiling cpm_emulator.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_emulator.cc
+if errorlevel 1 goto :error
+
+echo [7/18] Compiling cpm_memory.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_memory.cc
+if errorlevel 1 goto :error
+
+echo [8/18] Compiling cpm_profiler.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_profiler.cc
+if errorlevel 1 goto :error
+
+echo [9/18] Compiling cpm_coverage.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_coverage.cc
+if errorlevel 1 goto :error
+
+echo [10/18] Compiling cpm_hang.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_hang.cc
+if errorlevel 1 goto :error
+
+echo [11/18] Compiling cpm_peripherals.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_peripherals.cc
+if errorlevel 1 goto :error
+
+echo [12/18] Compiling cpm_filecache.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_filecache.cc
+if errorlevel 1 goto :error
+
+echo [13/18] Compiling cpm_stats.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_stats.cc
+if errorlevel 1 goto :error
+
+echo [14/18] Compiling cpm_terminal.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_terminal.cc
+if errorlevel 1 goto :error
+
+echo [15/18] Compiling cpm_testrunner.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_testrunner.cc
+if errorlevel 1 goto :error
+
+echo [16/18] Compiling cpm_aot.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_aot.cc
+if errorlevel 1 goto :error
+
+echo [17/18] Compiling cpm_loops.cc...
+cl /nologo /c /EHsc /O2 /std:c++14 /I. cpm_loops.cc
+if errorlevel 1 goto :error
+
+echo [18/18] Compiling cpmemu.cc...
 cl /nologo /c /EHsc /O2 /std:c++14 /I. cpmemu.cc
 if errorlevel 1 goto :error
 
 echo.
 echo Linking cpmemu.exe...
-link /nologo /OUT:cpmemu.exe cpmemu.obj qkz80.obj qkz80_errors.obj qkz80_mem.obj qkz80_reg_set.obj platform.obj
+link /nologo /OUT:cpmemu.exe cpmemu.obj cpm_emulator.obj cpm_memory.obj cpm_profiler.obj cpm_coverage.obj cpm_hang.obj cpm_peripherals.obj cpm_filecache.obj cpm_stats.obj cpm_terminal.obj cpm_testrunner.obj cpm_aot.obj cpm_loops.obj qkz80.obj qkz80_errors.obj qkz80_mem.obj qkz80_reg_set.obj platform.obj
 if errorlevel 1 goto :error
 
 echo.
@@ -8,7 +8,18 @@
 #include <termios.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <signal.h>
 #include <dirent.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
@@ -63,9 +74,25 @@ bool stdin_has_data() {
     return select(STDIN_FILENO + 1, &readfds, NULL, NULL, &tv) > 0;
 }
 
+bool stdin_wait(int timeout_ms) {
+    fd_set readfds;
+    struct timeval tv;
+    FD_ZERO(&readfds);
+    FD_SET(STDIN_FILENO, &readfds);
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return select(STDIN_FILENO + 1, &readfds, NULL, NULL, &tv) > 0;
+}
+
+// Unbuffered, so stdin_has_data() also sees input that arrived in the
+// same read as an earlier character
 int console_getchar() {
-    int ch = getchar();
-    if (ch == EOF) return -1;
+    unsigned char ch;
+    ssize_t n;
+    do {
+        n = read(STDIN_FILENO, &ch, 1);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1) return -1;
     return ch;
 }
 
@@ -95,10 +122,43 @@ int64_t get_file_size(const char* path) {
     return static_cast<int64_t>(st.st_size);
 }
 
+bool get_file_version(const char* path, int64_t* size, int64_t* mtime_ns) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    *size = static_cast<int64_t>(st.st_size);
+#if defined(__APPLE__)
+    *mtime_ns = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000LL +
+                st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    *mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+    // Whole seconds; a change within the same second goes unnoticed
+    *mtime_ns = static_cast<int64_t>(st.st_mtime) * 1000000000LL;
+#endif
+    return true;
+}
+
 bool delete_file(const char* path) {
     return unlink(path) == 0;
 }
 
+bool create_directory(const char* path) {
+    return mkdir(path, 0777) == 0;
+}
+
+bool remove_directory(const char* path) {
+    return rmdir(path) == 0;
+}
+
+FILE* open_memory_stream(const void* data, size_t size) {
+    if (size == 0) {
+        return nullptr;
+    }
+    return fmemopen(const_cast<void*>(data), size, "rb");
+}
+
 std::vector<DirEntry> list_directory(const char* path) {
     std::vector<DirEntry> entries;
 
@@ -151,6 +211,249 @@ int change_directory(const char* path) {
     return chdir(path);
 }
 
+// ============================================================================
+// Shared Memory Images
+// ============================================================================
+
+SharedImage create_shared_image(const void* data, size_t size) {
+    int fd;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    fd = memfd_create("cpmemu-image", MFD_CLOEXEC);
+#else
+    char name[] = "/tmp/cpmemu-image-XXXXXX";
+    fd = mkstemp(name);
+    if (fd >= 0) {
+        unlink(name);
+    }
+#endif
+    if (fd < 0) {
+        return -1;
+    }
+
+    const char* p = static_cast<const char*>(data);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, p + done, size - done);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return fd;
+}
+
+void* map_private_view(SharedImage image, size_t size) {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      static_cast<int>(image), 0);
+    return addr == MAP_FAILED ? nullptr : addr;
+}
+
+void unmap_view(void* addr, size_t size) {
+    munmap(addr, size);
+}
+
+void release_shared_image(SharedImage image) {
+    if (image >= 0) {
+        close(static_cast<int>(image));
+    }
+}
+
+void* map_shared_file(const char* path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    // The mapping keeps the file open
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return addr == MAP_FAILED ? nullptr : addr;
+}
+
+// ============================================================================
+// Timing
+// ============================================================================
+
+uint64_t monotonic_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_usec(uint64_t usec) {
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+bool local_time(time_t t, struct tm* out) {
+    return localtime_r(&t, out) != nullptr;
+}
+
+bool get_io_call_counts(uint64_t* reads, uint64_t* writes) {
+    // Linux keeps per-process totals in /proc; reading it costs one read
+    FILE* fp = fopen("/proc/self/io", "r");
+    if (!fp) return false;
+
+    bool have_reads = false, have_writes = false;
+    char line[128];
+    unsigned long long value;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscr: %llu", &value) == 1) {
+            *reads = value;
+            have_reads = true;
+        } else if (sscanf(line, "syscw: %llu", &value) == 1) {
+            *writes = value;
+            have_writes = true;
+        }
+    }
+    fclose(fp);
+    return have_reads && have_writes;
+}
+
+// ============================================================================
+// Profiling Timer
+// ============================================================================
+
+static ProfileTick profile_tick = nullptr;
+
+static void profile_signal(int) {
+    int saved_errno = errno;
+    if (profile_tick) profile_tick();
+    errno = saved_errno;
+}
+
+bool start_profile_timer(int hz, ProfileTick tick) {
+    if (hz <= 0) return false;
+    profile_tick = tick;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_signal;
+    sa.sa_flags = SA_RESTART;   // Don't interrupt console or file I/O
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, nullptr) != 0) return false;
+
+    struct itimerval it;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+    it.it_value = it.it_interval;
+    return setitimer(ITIMER_PROF, &it, nullptr) == 0;
+}
+
+void stop_profile_timer() {
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, nullptr);
+    signal(SIGPROF, SIG_IGN);
+    profile_tick = nullptr;
+}
+
+// ============================================================================
+// Hardware Counters
+// ============================================================================
+
+#ifdef __linux__
+
+struct HwCounterSet {
+    int fd[HW_COUNTER_COUNT];
+};
+
+static int open_perf_event(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // The kernel multiplexes counters when there are too few; the times
+    // let read_hw_counters() scale the count up
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+HwCounters open_hw_counters() {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[HW_COUNTER_COUNT] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    };
+
+    // Opened one by one rather than as a group, so a missing event only
+    // loses that counter
+    HwCounterSet* set = new HwCounterSet;
+    bool any = false;
+    for (int i = 0; i < HW_COUNTER_COUNT; i++) {
+        set->fd[i] = open_perf_event(events[i].type, events[i].config);
+        if (set->fd[i] >= 0) any = true;
+    }
+    if (!any) {
+        delete set;
+        return -1;
+    }
+    return (HwCounters)set;
+}
+
+void read_hw_counters(HwCounters counters, HwCounterValues* values) {
+    HwCounterSet* set = counters < 0 ? nullptr : (HwCounterSet*)counters;
+    for (int i = 0; i < HW_COUNTER_COUNT; i++) {
+        values->value[i] = 0;
+        values->valid[i] = false;
+
+        uint64_t data[3];   // Count, time enabled, time running
+        if (!set || set->fd[i] < 0 ||
+            read(set->fd[i], data, sizeof(data)) != (ssize_t)sizeof(data) ||
+            data[2] == 0) {
+            continue;
+        }
+        values->value[i] = data[2] < data[1]
+            ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+        values->valid[i] = true;
+    }
+}
+
+void close_hw_counters(HwCounters counters) {
+    if (counters < 0) return;
+    HwCounterSet* set = (HwCounterSet*)counters;
+    for (int i = 0; i < HW_COUNTER_COUNT; i++) {
+        if (set->fd[i] >= 0) close(set->fd[i]);
+    }
+    delete set;
+}
+
+#else
+
+HwCounters open_hw_counters() {
+    return -1;
+}
+
+void read_hw_counters(HwCounters counters, HwCounterValues* values) {
+    (void)counters;
+    for (int i = 0; i < HW_COUNTER_COUNT; i++) {
+        values->value[i] = 0;
+        values->valid[i] = false;
+    }
+}
+
+void close_hw_counters(HwCounters counters) {
+    (void)counters;
+}
+
+#endif
+
 // ============================================================================
 // Initialization
 // ============================================================================
@@ -11,6 +11,8 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <cstdio>
+#include <ctime>
 
 namespace platform {
 
@@ -35,6 +37,10 @@ bool stdin_has_data();
 // Returns the character, or -1 on EOF
 int console_getchar();
 
+// Wait up to timeout_ms for input on stdin
+// Returns true if input (or end of file) is pending
+bool stdin_wait(int timeout_ms);
+
 // ============================================================================
 // File System
 // ============================================================================
@@ -53,9 +59,22 @@ FileType get_file_type(const char* path);
 // Get the size of a file in bytes, returns -1 on error
 int64_t get_file_size(const char* path);
 
+// Size and last modification time (nanoseconds from an arbitrary epoch)
+// of a file, to tell whether it changed. Returns false on error.
+bool get_file_version(const char* path, int64_t* size, int64_t* mtime_ns);
+
 // Delete a file, returns true on success
 bool delete_file(const char* path);
 
+// Create or remove an (empty) directory, returns true on success
+bool create_directory(const char* path);
+bool remove_directory(const char* path);
+
+// Open a read-only stdio stream over size bytes of memory, which must
+// stay valid until the stream is closed. Returns nullptr where memory
+// streams are not supported.
+FILE* open_memory_stream(const void* data, size_t size);
+
 // Directory entry information
 struct DirEntry {
     std::string name;
@@ -79,6 +98,97 @@ std::string basename(const std::string& path);
 // Change working directory (returns 0 on success, -1 on error)
 int change_directory(const char* path);
 
+// ============================================================================
+// Shared Memory Images
+// ============================================================================
+
+// Handle to an anonymous memory object, -1 if invalid
+typedef intptr_t SharedImage;
+
+// Create an anonymous memory object holding a copy of size bytes of data
+SharedImage create_shared_image(const void* data, size_t size);
+
+// Map a private copy-on-write view of an image. Pages are shared with the
+// image until written. Returns nullptr on error.
+void* map_private_view(SharedImage image, size_t size);
+
+// Unmap a view returned by map_private_view()
+void unmap_view(void* addr, size_t size);
+
+// Release an image (existing views stay valid)
+void release_shared_image(SharedImage image);
+
+// Map size bytes of a file, creating it or setting its length to size.
+// Writes go to the file and are seen at once by other processes that map
+// it. Returns nullptr on error. Unmap with unmap_view().
+void* map_shared_file(const char* path, size_t size);
+
+// ============================================================================
+// Timing
+// ============================================================================
+
+// Monotonic clock in microseconds from an arbitrary starting point
+uint64_t monotonic_usec();
+
+// Sleep for at least usec microseconds
+void sleep_usec(uint64_t usec);
+
+// Break t down into local time. Safe to call from several threads at once.
+bool local_time(time_t t, struct tm* out);
+
+// Read and write system calls made by this process so far (including
+// ones that did not reach the disk). Returns false if not available.
+bool get_io_call_counts(uint64_t* reads, uint64_t* writes);
+
+// ============================================================================
+// Profiling Timer
+// ============================================================================
+
+// Called on every profiling tick. On POSIX this runs in a signal handler
+// on the emulator thread, so it may only touch lock-free state.
+typedef void (*ProfileTick)();
+
+// Start calling tick about hz times per second of process CPU time
+// Returns false if the timer could not be started
+bool start_profile_timer(int hz, ProfileTick tick);
+
+// Stop the profiling timer
+void stop_profile_timer();
+
+// ============================================================================
+// Hardware Counters
+// ============================================================================
+
+// CPU events counted for the host code running the emulation
+enum HwCounter {
+    HW_CYCLES,
+    HW_INSTRUCTIONS,
+    HW_BRANCH_MISSES,
+    HW_L1I_MISSES,
+    HW_COUNTER_COUNT
+};
+
+// Counts since the counters were opened. A counter that is not supported,
+// not permitted or was never scheduled is not valid.
+struct HwCounterValues {
+    uint64_t value[HW_COUNTER_COUNT];
+    bool valid[HW_COUNTER_COUNT];
+};
+
+// Handle to a set of counters, -1 if invalid
+typedef intptr_t HwCounters;
+
+// Start counting user mode events of the calling thread. Returns -1 if no
+// counter can be opened (no perf_event support, or not permitted as is
+// usual in containers).
+HwCounters open_hw_counters();
+
+// Read the counters; must be called on the thread that opened them
+void read_hw_counters(HwCounters counters, HwCounterValues* values);
+
+// Stop counting and release the counters
+void close_hw_counters(HwCounters counters);
+
 // ============================================================================
 // Initialization
 // ============================================================================
@@ -12,6 +12,8 @@
 #include <sys/stat.h>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
 
 namespace platform {
 
@@ -70,6 +72,19 @@ bool stdin_has_data() {
     return _kbhit() != 0;
 }
 
+bool stdin_wait(int timeout_ms) {
+    if (stdin_has_data()) {
+        return true;
+    }
+    if (is_terminal()) {
+        // Signalled on any console event, not only key presses
+        WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), timeout_ms);
+    } else {
+        Sleep(timeout_ms);
+    }
+    return stdin_has_data();
+}
+
 int console_getchar() {
     if (!is_terminal()) {
         // For non-terminal, use standard getchar
@@ -108,10 +123,40 @@ int64_t get_file_size(const char* path) {
     return static_cast<int64_t>(size.QuadPart);
 }
 
+bool get_file_version(const char* path, int64_t* size, int64_t* mtime_ns) {
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fad)) {
+        return false;
+    }
+    LARGE_INTEGER value;
+    value.HighPart = fad.nFileSizeHigh;
+    value.LowPart = fad.nFileSizeLow;
+    *size = static_cast<int64_t>(value.QuadPart);
+    value.HighPart = fad.ftLastWriteTime.dwHighDateTime;
+    value.LowPart = fad.ftLastWriteTime.dwLowDateTime;
+    *mtime_ns = static_cast<int64_t>(value.QuadPart) * 100;  // 100ns units
+    return true;
+}
+
 bool delete_file(const char* path) {
     return DeleteFileA(path) != 0;
 }
 
+bool create_directory(const char* path) {
+    return CreateDirectoryA(path, NULL) != 0;
+}
+
+bool remove_directory(const char* path) {
+    return RemoveDirectoryA(path) != 0;
+}
+
+FILE* open_memory_stream(const void* data, size_t size) {
+    // No fmemopen in the CRT; callers fall back to the file itself
+    (void)data;
+    (void)size;
+    return nullptr;
+}
+
 std::vector<DirEntry> list_directory(const char* path) {
     std::vector<DirEntry> entries;
 
@@ -177,6 +222,153 @@ int change_directory(const char* path) {
     return SetCurrentDirectoryA(path) ? 0 : -1;
 }
 
+// ============================================================================
+// Shared Memory Images
+// ============================================================================
+
+SharedImage create_shared_image(const void* data, size_t size) {
+    HANDLE h = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                  0, static_cast<DWORD>(size), NULL);
+    if (h == NULL) {
+        return -1;
+    }
+
+    void* view = MapViewOfFile(h, FILE_MAP_WRITE, 0, 0, size);
+    if (view == NULL) {
+        CloseHandle(h);
+        return -1;
+    }
+    memcpy(view, data, size);
+    UnmapViewOfFile(view);
+    return reinterpret_cast<SharedImage>(h);
+}
+
+void* map_private_view(SharedImage image, size_t size) {
+    // FILE_MAP_COPY gives a copy-on-write view of the mapping
+    return MapViewOfFile(reinterpret_cast<HANDLE>(image), FILE_MAP_COPY, 0, 0, size);
+}
+
+void unmap_view(void* addr, size_t size) {
+    (void)size;
+    UnmapViewOfFile(addr);
+}
+
+void release_shared_image(SharedImage image) {
+    if (image != -1) {
+        CloseHandle(reinterpret_cast<HANDLE>(image));
+    }
+}
+
+void* map_shared_file(const char* path, size_t size) {
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER length;
+    length.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFilePointerEx(file, length, NULL, FILE_BEGIN) || !SetEndOfFile(file)) {
+        CloseHandle(file);
+        return nullptr;
+    }
+
+    // Mapping the whole file, so the size comes from the file itself
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return nullptr;
+    }
+    // The view keeps the mapping and the file open
+    void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+    CloseHandle(mapping);
+    return view;
+}
+
+// ============================================================================
+// Timing
+// ============================================================================
+
+uint64_t monotonic_usec() {
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000 +
+           (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+void sleep_usec(uint64_t usec) {
+    // Sleep() has millisecond granularity; callers track drift
+    Sleep((DWORD)((usec + 999) / 1000));
+}
+
+bool local_time(time_t t, struct tm* out) {
+    return localtime_s(out, &t) == 0;
+}
+
+bool get_io_call_counts(uint64_t* reads, uint64_t* writes) {
+    IO_COUNTERS counters;
+    if (!GetProcessIoCounters(GetCurrentProcess(), &counters)) return false;
+    *reads = counters.ReadOperationCount;
+    *writes = counters.WriteOperationCount;
+    return true;
+}
+
+// ============================================================================
+// Profiling Timer
+// ============================================================================
+
+// Windows has no SIGPROF; a timer-queue thread calls tick instead. It
+// samples wall time rather than CPU time.
+static HANDLE profile_timer = NULL;
+static ProfileTick profile_tick = nullptr;
+
+static VOID CALLBACK profile_callback(PVOID, BOOLEAN) {
+    if (profile_tick) profile_tick();
+}
+
+bool start_profile_timer(int hz, ProfileTick tick) {
+    if (hz <= 0 || profile_timer != NULL) return false;
+    profile_tick = tick;
+    DWORD period = hz >= 1000 ? 1 : 1000 / hz;
+    return CreateTimerQueueTimer(&profile_timer, NULL, profile_callback, NULL,
+                                 period, period, WT_EXECUTEDEFAULT) != 0;
+}
+
+void stop_profile_timer() {
+    if (profile_timer != NULL) {
+        // INVALID_HANDLE_VALUE waits for a running callback to finish
+        DeleteTimerQueueTimer(NULL, profile_timer, INVALID_HANDLE_VALUE);
+        profile_timer = NULL;
+    }
+    profile_tick = nullptr;
+}
+
+// ============================================================================
+// Hardware Counters
+// ============================================================================
+
+// Not implemented on Windows; callers report the counters as unavailable
+
+HwCounters open_hw_counters() {
+    return -1;
+}
+
+void read_hw_counters(HwCounters counters, HwCounterValues* values) {
+    (void)counters;
+    for (int i = 0; i < HW_COUNTER_COUNT; i++) {
+        values->value[i] = 0;
+        values->valid[i] = false;
+    }
+}
+
+void close_hw_counters(HwCounters counters) {
+    (void)counters;
+}
+
 // ============================================================================
 // Initialization
 // ============================================================================
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Training and comparison for the profile-guided cpmemu_pgo build
+#
+#   pgo.sh train CPMEMU         Run the training corpus under an
+#                               instrumented cpmemu
+#   pgo.sh compare PLAIN PGO    Time two builds on the CPU workloads and
+#                               report the speedup
+#
+# The corpus is the in-tree instruction exercisers, each run for a fixed
+# number of instructions: ZEXDOC in Z80 mode and 8080EXM in 8080 mode keep
+# the interpreter's decode switch busy, and the small console tests add
+# the BDOS paths. If MBASIC names a copy of mbasic.com, the BASIC programs
+# in tests/ are run under it as well (training only; results are ignored).
+
+TESTS=$(cd "$(dirname "$0")/../tests" && pwd)
+
+# Instructions per exerciser run
+TRAIN_INSTRUCTIONS=${TRAIN_INSTRUCTIONS:-150000000}
+BENCH_INSTRUCTIONS=${BENCH_INSTRUCTIONS:-200000000}
+BENCH_RUNS=${BENCH_RUNS:-3}
+
+# Run "cpmemu [options] program" for count instructions, discarding output
+run_limited() {
+    emu=$1
+    count=$2
+    shift 2
+    "$emu" --max-instructions="$count" "$@" </dev/null >/dev/null 2>&1
+}
+
+train() {
+    emu=$1
+    echo "Training $emu"
+    echo "  zexdoc.com (Z80)"
+    run_limited "$emu" "$TRAIN_INSTRUCTIONS" "$TESTS/zexdoc.com"
+    echo "  8080EXM.COM (8080)"
+    run_limited "$emu" "$TRAIN_INSTRUCTIONS" --8080 "$TESTS/8080EXM.COM"
+    echo "  console tests"
+    for t in simple_con test_djnz tflags tflags16 test_n_flag; do
+        run_limited "$emu" 10000000 "$TESTS/$t.com"
+    done
+    if [ -n "$MBASIC" ]; then
+        echo "  BASIC programs under $MBASIC"
+        "$emu" --run-tests="$TESTS" "$MBASIC" </dev/null >/dev/null 2>&1
+    fi
+    return 0
+}
+
+# Best MIPS of BENCH_RUNS runs of "cpmemu [options] program", from the
+# --stats report
+mips() {
+    emu=$1
+    shift
+    best=0
+    i=0
+    while [ $i -lt "$BENCH_RUNS" ]; do
+        m=$("$emu" --stats --max-instructions="$BENCH_INSTRUCTIONS" "$@" </dev/null 2>&1 >/dev/null |
+            sed -n 's/.* \([0-9.]*\) MIPS$/\1/p')
+        best=$(awk -v a="$best" -v b="${m:-0}" 'BEGIN { print (b > a) ? b : a }')
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+compare_one() {
+    name=$1
+    shift
+    a=$(mips "$PLAIN" "$@")
+    b=$(mips "$PGO" "$@")
+    awk -v n="$name" -v a="$a" -v b="$b" \
+        'BEGIN { printf "  %-22s %8.1f %8.1f  %6.2fx\n", n, a, b, (a > 0) ? b / a : 0 }'
+}
+
+compare() {
+    PLAIN=$1
+    PGO=$2
+    echo "Guest MIPS, best of $BENCH_RUNS runs of $BENCH_INSTRUCTIONS instructions"
+    echo "  workload                  plain      pgo  speedup"
+    compare_one "zexdoc.com (Z80)" "$TESTS/zexdoc.com"
+    compare_one "8080EXM.COM (8080)" --8080 "$TESTS/8080EXM.COM"
+}
+
+case "$1" in
+    train)
+        [ -x "$2" ] || { echo "pgo.sh: no cpmemu at $2" >&2; exit 1; }
+        train "$2"
+        ;;
+    compare)
+        [ -x "$2" ] && [ -x "$3" ] || { echo "pgo.sh: need two cpmemu builds" >&2; exit 1; }
+        compare "$2" "$3"
+        ;;
+    *)
+        echo "usage: pgo.sh train CPMEMU | pgo.sh compare PLAIN PGO" >&2
+        exit 2
+        ;;
+esac
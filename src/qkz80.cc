@@ -4,16 +4,21 @@
 static qkz80_trace dummy_trace;
 qkz80::qkz80(qkz80_cpu_mem *memory):
   mem(memory),
+  int_listener(nullptr),
   trace(&dummy_trace),
   qkz80_debug(false),
   cpu_mode(MODE_Z80),
   cycles(0),
+  port_ops(0),
   int_pending(false),
   nmi_pending(false),
   int_vector(0xFF),
   ei_delay(false),
   halted_(false) { // Default to Z80 mode
   regs.cpu_mode = qkz80_reg_set::MODE_Z80;
+  for (int i = 0; i < 256; i++) {
+    io_ports[i] = nullptr;
+  }
 }
 
 #define LOW_NIBBLE(xx_foo) ((xx_foo)&0x0f)
@@ -99,6 +104,7 @@ bool qkz80::check_interrupts(void) {
   // NMI has highest priority and cannot be disabled
   if (nmi_pending) {
     nmi_pending = false;
+    halted_ = false;
 
     // Copy IFF1 to IFF2 (so RETN can restore interrupt state)
     regs.IFF2 = regs.IFF1;
@@ -118,11 +124,15 @@ bool qkz80::check_interrupts(void) {
   // Maskable interrupt - only if IFF1 is set
   if (int_pending && regs.IFF1) {
     int_pending = false;
+    halted_ = false;
 
     // Disable interrupts
     regs.IFF1 = 0;
     regs.IFF2 = 0;
 
+    // A daisy chain puts its own vector on the bus
+    qkz80_uint8 vector = int_listener ? int_listener->int_acknowledge(int_vector) : int_vector;
+
     // Push current PC
     push_word(regs.PC.get_pair16());
 
@@ -132,9 +142,9 @@ bool qkz80::check_interrupts(void) {
         // IM 0: Execute instruction on data bus
         // For RST instructions (most common), the vector is the RST opcode
         // RST n = 0xC7 | (n << 3), so address = (vector & 0x38)
-        if ((int_vector & 0xC7) == 0xC7) {
+        if ((vector & 0xC7) == 0xC7) {
           // It's an RST instruction
-          regs.PC.set_pair16(int_vector & 0x38);
+          regs.PC.set_pair16(vector & 0x38);
         } else {
           // For other instructions, just jump to 0x0038 (IM 1 behavior)
           regs.PC.set_pair16(0x0038);
@@ -150,9 +160,9 @@ bool qkz80::check_interrupts(void) {
 
       case 2:
         // IM 2: Vector table lookup
-        // Address = (I register << 8) | int_vector
+        // Address = (I register << 8) | vector
         {
-          qkz80_uint16 vector_addr = (regs.I << 8) | int_vector;
+          qkz80_uint16 vector_addr = (regs.I << 8) | vector;
           qkz80_uint16 jump_addr = read_word(vector_addr);
           regs.PC.set_pair16(jump_addr);
         }
@@ -581,6 +591,7 @@ void qkz80::execute(void) {
     case 0x4d: { // RETI
       qkz80_uint16 addr = pop_word();
       regs.PC.set_pair16(addr);
+      if (int_listener) int_listener->reti();
       trace->asm_op("reti");
       return;
     }
@@ -734,7 +745,31 @@ void qkz80::execute(void) {
       return;
     }
 
-    // Block I/O - simplified (real implementation would need I/O port system)
+    // IN r,(C): 0x40-0x78 step 8; ED 70 only sets flags
+    case 0x40: case 0x48: case 0x50: case 0x58:
+    case 0x60: case 0x68: case 0x70: case 0x78: {
+      qkz80_uint8 reg = (opcode >> 3) & 0x07;
+      qkz80_uint8 dat = port_in(get_reg8(reg_C));
+      port_ops++;
+      regs.set_flags_from_logic8(dat, fetch_carry_as_int(), 0);
+      if (reg != reg_M) {
+        set_reg8(dat, reg);
+      }
+      trace->asm_op("in %s,(c)", reg == reg_M ? "f" : name_reg8(reg));
+      return;
+    }
+
+    // OUT (C),r: 0x41-0x79 step 8; ED 71 outputs 0
+    case 0x41: case 0x49: case 0x51: case 0x59:
+    case 0x61: case 0x69: case 0x71: case 0x79: {
+      qkz80_uint8 reg = (opcode >> 3) & 0x07;
+      port_out(get_reg8(reg_C), reg == reg_M ? 0 : get_reg8(reg));
+      port_ops++;
+      trace->asm_op("out (c),%s", reg == reg_M ? "0" : name_reg8(reg));
+      return;
+    }
+
+    // Block I/O
     case 0xa2: case 0xb2: case 0xaa: case 0xba:
     case 0xa3: case 0xb3: case 0xab: case 0xbb:
       block_io(opcode);
@@ -1975,6 +2010,7 @@ void qkz80::execute(void) {
     qkz80_uint8 port(pull_byte_from_opcode_stream());
     qkz80_uint8 rega(get_reg8(reg_A));
     port_out(port, rega);
+    port_ops++;
     trace->asm_op("out 0x%0x",port);
     trace->add_reg8(reg_A);
     return;
@@ -2013,6 +2049,7 @@ void qkz80::execute(void) {
     qkz80_uint8 port(pull_byte_from_opcode_stream());
     trace->asm_op("in 0x%0x",port);
     qkz80_uint8 dat = port_in(port);
+    port_ops++;
     set_reg8(dat,reg_A);
     return;
   }
@@ -2205,16 +2242,108 @@ qkz80_uint8 qkz80::do_srl(qkz80_uint8 val) {
   return result;
 }
 
-// Default I/O port implementations - override for machine-specific behavior
+// Default I/O port implementations - dispatch to attached devices.
+// Override for machine-specific behavior.
 void qkz80::port_out(qkz80_uint8 port, qkz80_uint8 value) {
-  (void)port;
-  (void)value;
-  // No-op by default - subclass provides machine-specific I/O
+  if (io_ports[port])
+    io_ports[port]->out(port, value);
 }
 
 qkz80_uint8 qkz80::port_in(qkz80_uint8 port) {
-  (void)port;
-  // Return 0xFF (floating bus) by default
+  if (io_ports[port])
+    return io_ports[port]->in(port);
+  // Return 0xFF (floating bus) with no device
   return 0xFF;
 }
 
+void qkz80::attach_io(qkz80_uint8 first, qkz80_io_device *dev, unsigned count) {
+  for (unsigned i = 0; i < count && first + i < 256; i++) {
+    io_ports[first + i] = dev;
+  }
+}
+
+// Try to run all remaining iterations of INIR/INDR/OTIR/OTDR as one bulk
+// transfer on the device at port. Bytes go through fetch_mem/store_mem,
+// as in the single-step path, so memory subclasses see every access (an
+// output reads all count bytes, even if the device then takes fewer).
+// Returns the number of bytes moved, 0 if the device declined, and the
+// last byte moved in *last.
+size_t qkz80::block_io_bulk(bool is_out, bool decrement, qkz80_uint8 port,
+                            qkz80_uint16 hl, size_t count, qkz80_uint8 *last) {
+  qkz80_io_device *dev = io_ports[port];
+  if (!dev)
+    return 0;
+
+  int step = decrement ? -1 : 1;
+  qkz80_uint8 buffer[256];
+  size_t moved;
+
+  if (is_out) {
+    for (size_t i = 0; i < count; i++)
+      buffer[i] = mem->fetch_mem((qkz80_uint16)(hl + step * (int)i));
+    moved = dev->out_block(port, buffer, count);
+    if (moved > count)
+      moved = count;
+  } else {
+    moved = dev->in_block(port, buffer, count);
+    if (moved > count)
+      moved = count;
+    for (size_t i = 0; i < moved; i++)
+      mem->store_mem((qkz80_uint16)(hl + step * (int)i), buffer[i]);
+  }
+  if (moved > 0)
+    *last = buffer[moved - 1];
+  return moved;
+}
+
+void qkz80::block_io(qkz80_uint8 opcode) {
+  bool is_out = (opcode & 0x01) != 0;
+  bool decrement = (opcode & 0x08) != 0;
+  bool repeat = (opcode & 0x10) != 0;
+  qkz80_uint8 port = get_reg8(reg_C);
+  qkz80_uint8 b = get_reg8(reg_B);
+  qkz80_uint16 hl = get_reg16(regp_HL);
+  int step = decrement ? -1 : 1;
+
+  // A repeat runs B times (256 for B=0); move as much as the device will
+  // take in one call and account for it as that many iterations
+  size_t moved = 0;
+  qkz80_uint8 last = 0;
+  if (repeat)
+    moved = block_io_bulk(is_out, decrement, port, hl, b ? b : 256, &last);
+
+  if (moved > 0) {
+    b -= (qkz80_uint8)moved;
+    hl += step * (int)moved;
+    cycles += 5 * (moved - 1);
+    port_ops += moved;
+  } else {
+    // One iteration; OUTI decrements B before the output, INI after
+    moved = 1;
+    if (is_out) {
+      last = mem->fetch_mem(hl);
+      b--;
+      port_out(port, last);
+    } else {
+      last = port_in(port);
+      mem->store_mem(hl, last);
+      b--;
+    }
+    hl += step;
+    port_ops++;
+  }
+
+  set_reg8(b, reg_B);
+  set_reg16(hl, regp_HL);
+
+  qkz80_uint16 k = last + (is_out ? (hl & 0xff) : ((port + step) & 0xff));
+  regs.set_flags_from_block_io(b, last, k);
+
+  // Repeat until B is zero
+  if (repeat && b != 0)
+    regs.PC.set_pair16(regs.PC.get_pair16() - 2);
+
+  static const char *names[] = { "ini", "outi", "ind", "outd", "inir", "otir", "indr", "otdr" };
+  trace->asm_op("%s", names[(is_out ? 1 : 0) | (decrement ? 2 : 0) | (repeat ? 4 : 0)]);
+}
+
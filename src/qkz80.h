@@ -1,6 +1,7 @@
 #ifndef QKZ80_H
 #define QKZ80_H
 
+#include "qkz80_io.h"
 #include "qkz80_mem.h"
 #include "qkz80_reg_set.h"
 #include "qkz80_trace.h"
@@ -37,6 +38,8 @@ class qkz80 {
 
   qkz80_reg_set regs;
   qkz80_cpu_mem *mem;  // Pointer to memory (allows subclassing)
+  qkz80_io_device *io_ports[256];  // Port dispatch table, nullptr = no device
+  qkz80_int_listener *int_listener;  // Interrupt acknowledge/RETI, may be nullptr
   qkz80_trace *trace;
   bool qkz80_debug;
   CPUMode cpu_mode;  // 8080 or Z80 mode
@@ -44,6 +47,9 @@ class qkz80 {
   // Cycle counting for interrupt timing
   unsigned long long cycles;  // Total cycles executed
 
+  // IN/OUT instructions executed, for activity monitoring
+  unsigned long long port_ops;
+
   // Interrupt state (caller sets these, execute() checks them)
   bool int_pending;       // Maskable interrupt pending
   bool nmi_pending;       // Non-maskable interrupt pending
@@ -55,9 +61,10 @@ class qkz80 {
   qkz80(qkz80_cpu_mem *memory);
   virtual ~qkz80() = default;
 
-  virtual void block_io(qkz80_uint8 opcode) {
-    trace->asm_op("ED %02x (block I/O - not implemented)", opcode);
-  }
+  // INI/INIR/IND/INDR/OUTI/OTIR/OUTD/OTDR (opcode is the byte after ED)
+  virtual void block_io(qkz80_uint8 opcode);
+  size_t block_io_bulk(bool is_out, bool decrement, qkz80_uint8 port,
+                       qkz80_uint16 hl, size_t count, qkz80_uint8 *last);
     
   virtual void set_debug(bool new_debug) {
     qkz80_debug=new_debug;
@@ -80,10 +87,16 @@ class qkz80 {
     trace=new_trace;
   }
 
-  // I/O port operations - override in subclass to intercept
+  // I/O port operations - override in subclass to intercept. The
+  // defaults dispatch to the device attached to the port.
   virtual void port_out(qkz80_uint8 port, qkz80_uint8 value);
   virtual qkz80_uint8 port_in(qkz80_uint8 port);
 
+  // Attach dev to count ports starting at first (nullptr detaches).
+  // Devices are not owned by the CPU and must outlive it or be detached.
+  void attach_io(qkz80_uint8 first, qkz80_io_device *dev, unsigned count = 1);
+  qkz80_io_device *get_io(qkz80_uint8 port) const { return io_ports[port]; }
+
   // HALT instruction - sets halted_ flag
   virtual void halt(void);
 
@@ -110,7 +123,7 @@ class qkz80 {
 
   // Check and deliver pending interrupts
   // Call this at instruction boundaries (e.g., in your main loop after execute())
-  // Returns true if an interrupt was delivered
+  // Returns true if an interrupt was delivered; delivery ends a HALT
   bool check_interrupts(void);
 
   // Convenience: request INT using RST number (0-7)
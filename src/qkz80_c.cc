@@ -0,0 +1,633 @@
+#include "qkz80_c.h"
+#include "qkz80.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <new>
+#include <vector>
+
+// Guest RAM. While a lockstep group shares one execution, watch marks the
+// bytes that still differ between its lanes: reading one means the lanes
+// must split. Writes are journaled so that the instruction in progress
+// can be taken back for the other lanes; an instruction and an interrupt
+// entry write at most four bytes.
+class qkz80_c_mem : public qkz80_cpu_mem {
+ public:
+  enum { JOURNAL_SIZE = 8 };
+
+  struct write {
+    qkz80_uint16 addr;
+    qkz80_uint8 old_value;
+    qkz80_uint8 new_value;
+    bool watched;
+  };
+
+  qkz80_c_mem() : ram(get_mem()), watch(nullptr), diverged(false),
+                  journal_len(0) {
+  }
+
+  virtual qkz80_uint8 fetch_mem(qkz80_uint16 addr, bool is_instruction = false) {
+    (void)is_instruction;
+    if (watch && watch[addr]) {
+      diverged = true;
+    }
+    return ram[addr];
+  }
+
+  virtual void store_mem(qkz80_uint16 addr, qkz80_uint8 abyte) {
+    if (watch && journal_len < JOURNAL_SIZE) {
+      write &w = journal[journal_len++];
+      w.addr = addr;
+      w.old_value = ram[addr];
+      w.new_value = abyte;
+      w.watched = watch[addr] != 0;
+      watch[addr] = 0;  // Every lane now holds the same value
+    }
+    ram[addr] = abyte;
+  }
+
+  qkz80_uint8 *ram;
+  qkz80_uint8 *watch;      // Lockstep only: bytes that differ between lanes
+  bool diverged;           // A watched byte was read, or a port was used
+  write journal[JOURNAL_SIZE];
+  int journal_len;
+};
+
+// The CPU of a machine: sends port I/O to the host's callbacks and
+// reports opcodes the core does not implement
+class qkz80_c_cpu : public qkz80 {
+ public:
+  qkz80_c_cpu(qkz80_machine *owner, qkz80_cpu_mem *memory)
+    : qkz80(memory), machine(owner), unimplemented(false) {
+  }
+
+  virtual void port_out(qkz80_uint8 port, qkz80_uint8 value);
+  virtual qkz80_uint8 port_in(qkz80_uint8 port);
+  virtual void unimplemented_opcode(qkz80_uint8 opcode, qkz80_uint16 pc) {
+    (void)opcode;
+    (void)pc;
+    unimplemented = true;
+  }
+
+  qkz80_machine *machine;
+  bool unimplemented;
+};
+
+struct qkz80_machine {
+  struct trap {
+    qkz80_trap_fn fn;
+    void *user;
+  };
+
+  qkz80_c_mem ram;
+  qkz80_c_cpu cpu;
+
+  qkz80_uint8 trapped[0x10000];       // Nonzero where traps has an entry
+  std::map<qkz80_uint16, trap> traps;
+  int trap_stop_pc;                   // PC of the last run's trap stop, or -1
+
+  qkz80_in_fn in_fn;
+  qkz80_out_fn out_fn;
+  void *io_user;
+
+  bool stop_requested;
+
+  qkz80_machine() : cpu(this, &ram), trap_stop_pc(-1), in_fn(nullptr),
+                    out_fn(nullptr), io_user(nullptr), stop_requested(false) {
+    memset(trapped, 0, sizeof(trapped));
+  }
+};
+
+// Port callbacks are the lanes' own, so a lockstep group splits on I/O
+void qkz80_c_cpu::port_out(qkz80_uint8 port, qkz80_uint8 value) {
+  if (machine->ram.watch) {
+    machine->ram.diverged = true;
+  }
+  if (machine->out_fn) {
+    machine->out_fn(machine, port, value, machine->io_user);
+    return;
+  }
+  qkz80::port_out(port, value);
+}
+
+qkz80_uint8 qkz80_c_cpu::port_in(qkz80_uint8 port) {
+  if (machine->ram.watch) {
+    machine->ram.diverged = true;
+  }
+  if (machine->in_fn) {
+    return machine->in_fn(machine, port, machine->io_user);
+  }
+  return qkz80::port_in(port);
+}
+
+// CPU state beyond RAM, saved and copied between the lanes of a group
+struct qkz80_c_state {
+  qkz80_reg_set regs;
+  qkz80::CPUMode mode;
+  unsigned long long cycles;
+  unsigned long long port_ops;
+  bool int_pending;
+  bool nmi_pending;
+  qkz80_uint8 int_vector;
+  bool ei_delay;
+  bool halted;
+  int trap_stop_pc;
+};
+
+static void save_state(const qkz80_machine *m, qkz80_c_state *s) {
+  const qkz80_c_cpu &cpu = m->cpu;
+  s->regs = cpu.regs;
+  s->mode = cpu.get_cpu_mode();
+  s->cycles = cpu.cycles;
+  s->port_ops = cpu.port_ops;
+  s->int_pending = cpu.int_pending;
+  s->nmi_pending = cpu.nmi_pending;
+  s->int_vector = cpu.int_vector;
+  s->ei_delay = cpu.ei_delay;
+  s->halted = cpu.is_halted();
+  s->trap_stop_pc = m->trap_stop_pc;
+}
+
+static void load_state(qkz80_machine *m, const qkz80_c_state &s) {
+  qkz80_c_cpu &cpu = m->cpu;
+  cpu.set_cpu_mode(s.mode);
+  cpu.regs = s.regs;
+  cpu.cycles = s.cycles;
+  cpu.port_ops = s.port_ops;
+  cpu.int_pending = s.int_pending;
+  cpu.nmi_pending = s.nmi_pending;
+  cpu.int_vector = s.int_vector;
+  cpu.ei_delay = s.ei_delay;
+  if (s.halted) {
+    cpu.set_halted();
+  } else {
+    cpu.clear_halted();
+  }
+  m->trap_stop_pc = s.trap_stop_pc;
+}
+
+// Whether two machines would execute alike given the same RAM
+static bool same_state(qkz80_machine *a, qkz80_machine *b) {
+  if (memcmp(a->trapped, b->trapped, sizeof(a->trapped)) != 0) {
+    return false;
+  }
+  qkz80_regs ra, rb;
+  qkz80_get_regs(a, &ra);
+  qkz80_get_regs(b, &rb);
+  return memcmp(&ra, &rb, sizeof(ra)) == 0 &&
+         a->cpu.get_cpu_mode() == b->cpu.get_cpu_mode() &&
+         a->cpu.cycles == b->cpu.cycles &&
+         a->cpu.int_pending == b->cpu.int_pending &&
+         a->cpu.nmi_pending == b->cpu.nmi_pending &&
+         a->cpu.int_vector == b->cpu.int_vector &&
+         a->cpu.ei_delay == b->cpu.ei_delay &&
+         a->trap_stop_pc == b->trap_stop_pc;
+}
+
+int qkz80_api_version(void) {
+  return QKZ80_C_API_VERSION;
+}
+
+qkz80_machine *qkz80_create(int cpu) {
+  if (cpu != QKZ80_CPU_8080 && cpu != QKZ80_CPU_Z80) {
+    return nullptr;
+  }
+  qkz80_machine *m = new (std::nothrow) qkz80_machine;
+  if (!m) {
+    return nullptr;
+  }
+  m->cpu.set_cpu_mode(cpu == QKZ80_CPU_8080 ? qkz80::MODE_8080 : qkz80::MODE_Z80);
+  return m;
+}
+
+void qkz80_destroy(qkz80_machine *m) {
+  delete m;
+}
+
+qkz80_machine *qkz80_clone(qkz80_machine *m) {
+  qkz80_machine *c = new (std::nothrow) qkz80_machine;
+  if (!c) {
+    return nullptr;
+  }
+  memcpy(c->ram.ram, m->ram.ram, 0x10000);
+  qkz80_c_state s;
+  save_state(m, &s);
+  load_state(c, s);
+  memcpy(c->trapped, m->trapped, sizeof(c->trapped));
+  c->traps = m->traps;
+  c->in_fn = m->in_fn;
+  c->out_fn = m->out_fn;
+  c->io_user = m->io_user;
+  return c;
+}
+
+void qkz80_reset(qkz80_machine *m) {
+  qkz80_reg_set &r = m->cpu.regs;
+  r.AF.set_pair16(0);
+  r.BC.set_pair16(0);
+  r.DE.set_pair16(0);
+  r.HL.set_pair16(0);
+  r.SP.set_pair16(0);
+  r.PC.set_pair16(0);
+  r.IX.set_pair16(0);
+  r.IY.set_pair16(0);
+  r.AF_.set_pair16(0);
+  r.BC_.set_pair16(0);
+  r.DE_.set_pair16(0);
+  r.HL_.set_pair16(0);
+  r.I = 0;
+  r.R = 0;
+  r.IFF1 = 0;
+  r.IFF2 = 0;
+  r.IM = 0;
+  m->cpu.cycles = 0;
+  m->cpu.port_ops = 0;
+  m->cpu.int_pending = false;
+  m->cpu.nmi_pending = false;
+  m->cpu.ei_delay = false;
+  m->cpu.clear_halted();
+  m->trap_stop_pc = -1;
+}
+
+long qkz80_load(qkz80_machine *m, const char *path, uint16_t addr) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    return -1;
+  }
+  size_t room = 0x10000 - addr;
+  size_t got = fread(m->ram.get_mem() + addr, 1, room, fp);
+  bool fits = !ferror(fp) && (got < room || fgetc(fp) == EOF);
+  fclose(fp);
+  return fits ? (long)got : -1;
+}
+
+void qkz80_read_memory(qkz80_machine *m, uint16_t addr, void *dest, size_t len) {
+  const qkz80_uint8 *mem = m->ram.get_mem();
+  qkz80_uint8 *out = (qkz80_uint8 *)dest;
+  if (len > 0x10000) {
+    len = 0x10000;
+  }
+  size_t first = 0x10000 - addr;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(out, mem + addr, first);
+  memcpy(out + first, mem, len - first);
+}
+
+void qkz80_write_memory(qkz80_machine *m, uint16_t addr, const void *src,
+                        size_t len) {
+  qkz80_uint8 *mem = m->ram.get_mem();
+  const qkz80_uint8 *in = (const qkz80_uint8 *)src;
+  if (len > 0x10000) {
+    len = 0x10000;
+  }
+  size_t first = 0x10000 - addr;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(mem + addr, in, first);
+  memcpy(mem, in + first, len - first);
+}
+
+uint8_t *qkz80_memory(qkz80_machine *m) {
+  return m->ram.get_mem();
+}
+
+void qkz80_get_regs(qkz80_machine *m, qkz80_regs *regs) {
+  const qkz80_reg_set &r = m->cpu.regs;
+  regs->af = r.AF.get_pair16();
+  regs->bc = r.BC.get_pair16();
+  regs->de = r.DE.get_pair16();
+  regs->hl = r.HL.get_pair16();
+  regs->af_alt = r.AF_.get_pair16();
+  regs->bc_alt = r.BC_.get_pair16();
+  regs->de_alt = r.DE_.get_pair16();
+  regs->hl_alt = r.HL_.get_pair16();
+  regs->ix = r.IX.get_pair16();
+  regs->iy = r.IY.get_pair16();
+  regs->sp = r.SP.get_pair16();
+  regs->pc = r.PC.get_pair16();
+  regs->i = r.I;
+  regs->r = r.R;
+  regs->iff1 = r.IFF1;
+  regs->iff2 = r.IFF2;
+  regs->im = r.IM;
+  regs->halted = m->cpu.is_halted() ? 1 : 0;
+}
+
+void qkz80_set_regs(qkz80_machine *m, const qkz80_regs *regs) {
+  qkz80_reg_set &r = m->cpu.regs;
+  r.AF.set_pair16(regs->af);
+  r.set_flags(r.AF.get_low());  // Fixed bits of the 8080 flag register
+  r.BC.set_pair16(regs->bc);
+  r.DE.set_pair16(regs->de);
+  r.HL.set_pair16(regs->hl);
+  r.AF_.set_pair16(regs->af_alt);
+  r.BC_.set_pair16(regs->bc_alt);
+  r.DE_.set_pair16(regs->de_alt);
+  r.HL_.set_pair16(regs->hl_alt);
+  r.IX.set_pair16(regs->ix);
+  r.IY.set_pair16(regs->iy);
+  r.SP.set_pair16(regs->sp);
+  r.PC.set_pair16(regs->pc);
+  r.I = regs->i;
+  r.R = regs->r;
+  r.IFF1 = regs->iff1 ? 1 : 0;
+  r.IFF2 = regs->iff2 ? 1 : 0;
+  r.IM = regs->im;
+  if (regs->halted) {
+    m->cpu.set_halted();
+  } else {
+    m->cpu.clear_halted();
+  }
+  m->trap_stop_pc = -1;
+}
+
+uint64_t qkz80_cycles(qkz80_machine *m) {
+  return m->cpu.cycles;
+}
+
+void qkz80_set_trap(qkz80_machine *m, uint16_t addr, qkz80_trap_fn fn,
+                    void *user) {
+  if (fn) {
+    qkz80_machine::trap t = { fn, user };
+    m->traps[addr] = t;
+    m->trapped[addr] = 1;
+  } else {
+    m->traps.erase(addr);
+    m->trapped[addr] = 0;
+  }
+}
+
+void qkz80_set_io(qkz80_machine *m, qkz80_in_fn in, qkz80_out_fn out,
+                  void *user) {
+  m->in_fn = in;
+  m->out_fn = out;
+  m->io_user = user;
+}
+
+void qkz80_request_int(qkz80_machine *m, uint8_t vector) {
+  m->cpu.request_int(vector);
+}
+
+void qkz80_request_nmi(qkz80_machine *m) {
+  m->cpu.request_nmi();
+}
+
+void qkz80_stop(qkz80_machine *m) {
+  m->stop_requested = true;
+}
+
+qkz80_exit qkz80_run(qkz80_machine *m, uint64_t max_instructions,
+                     uint64_t max_cycles, qkz80_run_result *result) {
+  qkz80_c_cpu &cpu = m->cpu;
+  uint64_t start_cycles = cpu.cycles;
+  uint64_t executed = 0;
+  qkz80_exit why = QKZ80_EXIT_INSTRUCTIONS;
+
+  // The trap that stopped the last run has had its turn
+  int skip_pc = m->trap_stop_pc;
+  m->trap_stop_pc = -1;
+  m->stop_requested = false;
+  cpu.unimplemented = false;
+
+  for (;;) {
+    if (max_instructions && executed >= max_instructions) {
+      why = QKZ80_EXIT_INSTRUCTIONS;
+      break;
+    }
+    if (max_cycles && cpu.cycles - start_cycles >= max_cycles) {
+      why = QKZ80_EXIT_CYCLES;
+      break;
+    }
+
+    cpu.check_interrupts();
+    if (cpu.is_halted()) {
+      why = QKZ80_EXIT_HALT;
+      break;
+    }
+
+    // A callback that moves PC may land on another trap
+    qkz80_uint16 pc = cpu.regs.PC.get_pair16();
+    bool stopped = false;
+    while (m->trapped[pc] && pc != skip_pc) {
+      qkz80_machine::trap t = m->traps[pc];
+      int action = t.fn(m, pc, t.user);
+      qkz80_uint16 now = cpu.regs.PC.get_pair16();
+      if (action == QKZ80_TRAP_STOP) {
+        m->trap_stop_pc = (now == pc) ? pc : -1;
+        why = QKZ80_EXIT_TRAP;
+        stopped = true;
+        break;
+      }
+      if (m->stop_requested) {
+        why = QKZ80_EXIT_STOP;
+        stopped = true;
+        break;
+      }
+      if (now == pc) {
+        break;
+      }
+      pc = now;
+      skip_pc = -1;
+    }
+    if (stopped) {
+      break;
+    }
+
+    cpu.execute();
+    executed++;
+    skip_pc = -1;
+
+    if (cpu.unimplemented) {
+      why = QKZ80_EXIT_UNIMPLEMENTED;
+      break;
+    }
+    if (m->stop_requested) {
+      why = QKZ80_EXIT_STOP;
+      break;
+    }
+  }
+
+  if (result) {
+    result->instructions = executed;
+    result->cycles = cpu.cycles - start_cycles;
+  }
+  return why;
+}
+
+// Run machines of identical CPU state as one: the first (the leader)
+// executes for all while the others only differ in bytes it has not read.
+// At the first instruction that needs a lane's own data or callbacks the
+// other lanes take the state from before it and every lane goes on alone.
+static void run_group(qkz80_machine **group, int count, uint64_t max_instructions,
+                      uint64_t max_cycles, qkz80_exit *exits,
+                      qkz80_run_result *results, uint64_t *shared) {
+  qkz80_machine *lead = group[0];
+  qkz80_c_cpu &cpu = lead->cpu;
+  qkz80_c_mem &mem = lead->ram;
+
+  std::vector<qkz80_uint8> watch(0x10000, 0);
+  for (int k = 1; k < count; k++) {
+    const qkz80_uint8 *lane = group[k]->ram.ram;
+    for (int a = 0; a < 0x10000; a++) {
+      watch[a] |= lane[a] != mem.ram[a];
+    }
+  }
+
+  uint64_t start_cycles = cpu.cycles;
+  uint64_t executed = 0;
+  int skip_pc = lead->trap_stop_pc;
+  bool budget_used = false;     // Stopped on a budget: no lane goes on
+  bool mid_instruction = false; // The leader has executed the split one
+  qkz80_exit why = QKZ80_EXIT_INSTRUCTIONS;
+  qkz80_c_state before;
+
+  lead->stop_requested = false;
+  cpu.unimplemented = false;
+  mem.watch = watch.data();
+  mem.diverged = false;
+
+  for (;;) {
+    save_state(lead, &before);
+    mem.journal_len = 0;
+
+    if (max_instructions && executed >= max_instructions) {
+      why = QKZ80_EXIT_INSTRUCTIONS;
+      budget_used = true;
+      break;
+    }
+    if (max_cycles && cpu.cycles - start_cycles >= max_cycles) {
+      why = QKZ80_EXIT_CYCLES;
+      budget_used = true;
+      break;
+    }
+
+    // Halts and traps are each lane's own business
+    cpu.check_interrupts();
+    if (cpu.is_halted() || mem.diverged) {
+      break;
+    }
+    qkz80_uint16 pc = cpu.regs.PC.get_pair16();
+    if (lead->trapped[pc] && pc != skip_pc) {
+      break;
+    }
+
+    cpu.execute();
+    if (mem.diverged || cpu.unimplemented) {
+      mid_instruction = true;
+      break;
+    }
+    executed++;
+    skip_pc = -1;
+  }
+  mem.watch = nullptr;
+
+  // Back to the state before the last instruction; bytes written by it
+  // are watched again if they were before
+  for (int j = mem.journal_len - 1; j >= 0; j--) {
+    const qkz80_c_mem::write &w = mem.journal[j];
+    mem.ram[w.addr] = w.old_value;
+    watch[w.addr] = w.watched;
+  }
+  if (executed > 0) {
+    before.trap_stop_pc = -1;
+  }
+  for (int k = 1; k < count; k++) {
+    qkz80_uint8 *lane = group[k]->ram.ram;
+    for (int a = 0; a < 0x10000; a++) {
+      if (!watch[a]) {
+        lane[a] = mem.ram[a];
+      }
+    }
+    load_state(group[k], before);
+  }
+  if (mid_instruction) {
+    for (int j = 0; j < mem.journal_len; j++) {
+      mem.ram[mem.journal[j].addr] = mem.journal[j].new_value;
+    }
+    lead->trap_stop_pc = -1;
+  } else {
+    load_state(lead, before);
+  }
+  if (shared) {
+    *shared += executed;
+  }
+
+  for (int k = 0; k < count; k++) {
+    qkz80_machine *m = group[k];
+    uint64_t done = executed + ((k == 0 && mid_instruction) ? 1 : 0);
+    qkz80_exit exit_reason = why;
+    uint64_t used = m->cpu.cycles - start_cycles;
+
+    if (k == 0 && mid_instruction && lead->stop_requested) {
+      exit_reason = QKZ80_EXIT_STOP;
+    } else if (k == 0 && mid_instruction && cpu.unimplemented) {
+      exit_reason = QKZ80_EXIT_UNIMPLEMENTED;
+    } else if (max_instructions && done >= max_instructions) {
+      exit_reason = QKZ80_EXIT_INSTRUCTIONS;
+    } else if (max_cycles && used >= max_cycles) {
+      exit_reason = QKZ80_EXIT_CYCLES;
+    } else if (!budget_used) {
+      qkz80_run_result r;
+      exit_reason = qkz80_run(m, max_instructions ? max_instructions - done : 0,
+                              max_cycles ? max_cycles - used : 0, &r);
+      done += r.instructions;
+    }
+
+    exits[k] = exit_reason;
+    if (results) {
+      results[k].instructions = done;
+      results[k].cycles = m->cpu.cycles - start_cycles;
+    }
+  }
+}
+
+void qkz80_run_lanes(qkz80_machine **lanes, int count, uint64_t max_instructions,
+                     uint64_t max_cycles, qkz80_exit *exits,
+                     qkz80_run_result *results, uint64_t *shared) {
+  if (shared) {
+    *shared = 0;
+  }
+
+  // Lanes in the same CPU state with the same traps form a group; the
+  // rest run alone
+  std::vector<bool> placed(count, false);
+  std::vector<qkz80_machine *> group;
+  std::vector<int> index;
+  std::vector<qkz80_exit> group_exits;
+  std::vector<qkz80_run_result> group_results;
+  for (int i = 0; i < count; i++) {
+    if (placed[i]) {
+      continue;
+    }
+    group.assign(1, lanes[i]);
+    index.assign(1, i);
+    for (int j = i + 1; j < count; j++) {
+      if (!placed[j] && same_state(lanes[i], lanes[j])) {
+        placed[j] = true;
+        group.push_back(lanes[j]);
+        index.push_back(j);
+      }
+    }
+
+    int n = (int)group.size();
+    group_exits.resize(n);
+    group_results.resize(n);
+    if (n == 1) {
+      group_exits[0] = qkz80_run(lanes[i], max_instructions, max_cycles,
+                                 &group_results[0]);
+    } else {
+      run_group(group.data(), n, max_instructions, max_cycles,
+                group_exits.data(), group_results.data(), shared);
+    }
+    for (int k = 0; k < n; k++) {
+      exits[index[k]] = group_exits[k];
+      if (results) {
+        results[index[k]] = group_results[k];
+      }
+    }
+  }
+}
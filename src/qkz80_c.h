@@ -0,0 +1,149 @@
+#ifndef QKZ80_C_H
+#define QKZ80_C_H
+/*
+ * Stable C interface to the qkz80 CPU core
+ *
+ * For embedding the core from C or through a foreign function interface
+ * (Python ctypes/cffi, Go cgo, Rust) without subclassing C++ classes or
+ * crossing the language boundary once per instruction. A machine is a
+ * CPU plus 64K of flat RAM. The host moves memory and registers in
+ * blocks and runs the machine for a budget of instructions or cycles.
+ * Control comes back early when a trap fires, the CPU halts or a
+ * callback asks to stop.
+ *
+ * Only plain C types cross this interface. Structures only gain fields
+ * at the end, and QKZ80_C_API_VERSION goes up when they do. No function
+ * throws; failures are reported by return value.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define QKZ80_C_API_VERSION 2
+
+typedef struct qkz80_machine qkz80_machine;
+
+/* CPU models for qkz80_create() */
+#define QKZ80_CPU_8080 0
+#define QKZ80_CPU_Z80  1
+
+/* Register block. Flags are the low byte of af. halted is set while the
+ * CPU waits in HALT; clearing it resumes after the HALT instruction. */
+typedef struct qkz80_regs {
+  uint16_t af, bc, de, hl;
+  uint16_t af_alt, bc_alt, de_alt, hl_alt;
+  uint16_t ix, iy, sp, pc;
+  uint8_t i, r;
+  uint8_t iff1, iff2;
+  uint8_t im;
+  uint8_t halted;
+} qkz80_regs;
+
+/* Why qkz80_run() returned */
+typedef enum qkz80_exit {
+  QKZ80_EXIT_INSTRUCTIONS = 0,  /* Instruction budget used up */
+  QKZ80_EXIT_CYCLES = 1,        /* Cycle budget used up */
+  QKZ80_EXIT_TRAP = 2,          /* A trap callback returned QKZ80_TRAP_STOP */
+  QKZ80_EXIT_HALT = 3,          /* HALT with no interrupt pending */
+  QKZ80_EXIT_STOP = 4,          /* qkz80_stop() was called */
+  QKZ80_EXIT_UNIMPLEMENTED = 5  /* Opcode the core does not implement */
+} qkz80_exit;
+
+/* What a run did */
+typedef struct qkz80_run_result {
+  uint64_t instructions;  /* Instructions executed by this run */
+  uint64_t cycles;        /* Cycles used by this run */
+} qkz80_run_result;
+
+/* Trap callback: PC reached a trapped address, before the instruction
+ * there executes. Return QKZ80_TRAP_CONTINUE to go on from the current
+ * PC (the callback may have changed it, e.g. to emulate a RET) or
+ * QKZ80_TRAP_STOP to end the run with PC unchanged. */
+#define QKZ80_TRAP_CONTINUE 0
+#define QKZ80_TRAP_STOP     1
+typedef int (*qkz80_trap_fn)(qkz80_machine *m, uint16_t pc, void *user);
+
+/* Port callbacks for IN and OUT. Without them ports read 0xFF and
+ * ignore writes. */
+typedef uint8_t (*qkz80_in_fn)(qkz80_machine *m, uint8_t port, void *user);
+typedef void (*qkz80_out_fn)(qkz80_machine *m, uint8_t port, uint8_t value,
+                             void *user);
+
+/* QKZ80_C_API_VERSION of the library actually linked */
+int qkz80_api_version(void);
+
+/* New machine with zeroed RAM and registers, or NULL on failure */
+qkz80_machine *qkz80_create(int cpu);
+void qkz80_destroy(qkz80_machine *m);
+
+/* Copy of a machine: RAM, registers, traps and port callbacks. NULL on
+ * failure. (Version 2) */
+qkz80_machine *qkz80_clone(qkz80_machine *m);
+
+/* Zero the registers, cycle count and pending interrupts; RAM is kept */
+void qkz80_reset(qkz80_machine *m);
+
+/* Load a file image at addr. Returns the bytes loaded, or -1 if the file
+ * cannot be read or does not fit below 64K. */
+long qkz80_load(qkz80_machine *m, const char *path, uint16_t addr);
+
+/* Copy guest memory. Ranges wrap at 64K; len is at most 65536. */
+void qkz80_read_memory(qkz80_machine *m, uint16_t addr, void *dest, size_t len);
+void qkz80_write_memory(qkz80_machine *m, uint16_t addr, const void *src,
+                        size_t len);
+
+/* The machine's 64K of RAM, valid until qkz80_destroy() */
+uint8_t *qkz80_memory(qkz80_machine *m);
+
+void qkz80_get_regs(qkz80_machine *m, qkz80_regs *regs);
+void qkz80_set_regs(qkz80_machine *m, const qkz80_regs *regs);
+
+/* Total cycles since create or reset (the core's approximate timing) */
+uint64_t qkz80_cycles(qkz80_machine *m);
+
+/* Trap execution at addr; fn NULL removes the trap */
+void qkz80_set_trap(qkz80_machine *m, uint16_t addr, qkz80_trap_fn fn,
+                    void *user);
+
+/* Port handlers for all 256 ports; NULL restores the default */
+void qkz80_set_io(qkz80_machine *m, qkz80_in_fn in, qkz80_out_fn out,
+                  void *user);
+
+/* Interrupt requests, delivered at the next instruction boundary */
+void qkz80_request_int(qkz80_machine *m, uint8_t vector);
+void qkz80_request_nmi(qkz80_machine *m);
+
+/* Run until max_instructions or max_cycles (0 = no limit) are used, or
+ * another exit occurs. A run that starts where the previous one stopped
+ * on a trap executes that instruction without firing the trap again.
+ * result may be NULL. */
+qkz80_exit qkz80_run(qkz80_machine *m, uint64_t max_instructions,
+                     uint64_t max_cycles, qkz80_run_result *result);
+
+/* From a callback: end the run at the next instruction boundary */
+void qkz80_stop(qkz80_machine *m);
+
+/* Lockstep lanes (experimental, version 2)
+ *
+ * Runs count distinct machines as qkz80_run() would run each of them, for
+ * farms that run one program many times with different inputs. Machines
+ * whose CPU state and traps are identical and whose RAM differs only in a
+ * few bytes share one execution until an instruction reads one of those
+ * bytes, does port I/O, reaches a trap or halts. Each machine then
+ * continues from the state before that instruction on its own, so results
+ * are exactly those of separate runs. exits (and results, if not NULL)
+ * have count entries. shared, if not NULL, receives the instructions
+ * executed once on behalf of a whole group. */
+void qkz80_run_lanes(qkz80_machine **lanes, int count, uint64_t max_instructions,
+                     uint64_t max_cycles, qkz80_exit *exits,
+                     qkz80_run_result *results, uint64_t *shared);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QKZ80_C_H */
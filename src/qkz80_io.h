@@ -0,0 +1,57 @@
+#ifndef QKZ80_IO
+#define QKZ80_IO 1
+// I/O devices attached to the CPU's 256 ports
+//
+// A device is registered for one or more ports with qkz80::attach_io().
+// IN and OUT instructions on those ports call in() and out(); ports with
+// no device read 0xFF and ignore writes.
+//
+// The repeating block instructions (INIR/INDR/OTIR/OTDR) first offer the
+// whole transfer to in_block()/out_block(), so a disk controller or
+// serial card can move a sector with one call instead of one interpreted
+// iteration per byte.
+//
+// Z80-family peripherals (CTC, SIO, PIO) also take part in interrupt
+// acknowledge and RETI. A qkz80_int_listener set on the CPU sees both, so
+// a daisy chain can supply the IM 2 vector of the highest priority
+// requester and end its service routine.
+
+#include "qkz80_types.h"
+#include <stddef.h>
+
+class qkz80_io_device {
+ public:
+  virtual ~qkz80_io_device() {}
+
+  virtual qkz80_uint8 in(qkz80_uint8 port) = 0;
+  virtual void out(qkz80_uint8 port, qkz80_uint8 value) = 0;
+
+  // Bulk transfers: move up to count bytes in port order (the first byte
+  // is the one a single INI/OUTI would move) and return how many were
+  // moved. Returning 0 makes the CPU fall back to in()/out() per byte.
+  virtual size_t in_block(qkz80_uint8 port, qkz80_uint8 *dest, size_t count) {
+    (void)port;
+    (void)dest;
+    (void)count;
+    return 0;
+  }
+  virtual size_t out_block(qkz80_uint8 port, const qkz80_uint8 *src, size_t count) {
+    (void)port;
+    (void)src;
+    (void)count;
+    return 0;
+  }
+};
+
+class qkz80_int_listener {
+ public:
+  virtual ~qkz80_int_listener() {}
+
+  // A maskable interrupt is being accepted. Returns the byte to put on
+  // the data bus; vector is the one given to request_int().
+  virtual qkz80_uint8 int_acknowledge(qkz80_uint8 vector) { return vector; }
+
+  // RETI executed
+  virtual void reti() {}
+};
+#endif
@@ -3,13 +3,18 @@
 #include <string.h>
 
 #define MEM_SIZE (0x010000)
-qkz80_cpu_mem::qkz80_cpu_mem():dat(0) {
+qkz80_cpu_mem::qkz80_cpu_mem():dat(0),owns_dat(true) {
   dat=(qkz80_uint8 *)new char[MEM_SIZE];
   memset(dat,0,MEM_SIZE);
 };
 
+qkz80_cpu_mem::qkz80_cpu_mem(qkz80_uint8 *storage):dat(storage),owns_dat(false) {
+}
+
 qkz80_cpu_mem::~qkz80_cpu_mem() {
-  delete dat;
+  if (owns_dat) {
+    delete[] dat;
+  }
   dat=0;
 }
 
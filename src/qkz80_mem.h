@@ -4,6 +4,10 @@
 
 class qkz80_cpu_mem {
   qkz80_uint8 *dat;
+  bool owns_dat;
+ protected:
+  // Use caller-provided 64K storage; it is not freed by this class
+  explicit qkz80_cpu_mem(qkz80_uint8 *storage);
  public:
   virtual qkz80_uint8 *get_mem(void) {
     return dat;
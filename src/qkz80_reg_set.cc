@@ -455,6 +455,34 @@ void qkz80_reg_set::set_flags_from_block_ld(qkz80_uint8 a_val, qkz80_uint8 copie
   set_flags(flags);
 }
 
+// INI/IND/OUTI/OUTD and repeats (undocumented behaviour as measured on
+// real Z80s). k is the byte moved plus C+1 or C-1 for input, or plus L
+// (after the HL update) for output.
+void qkz80_reg_set::set_flags_from_block_io(qkz80_uint8 b_after, qkz80_uint8 io_byte, qkz80_uint16 k) {
+  qkz80_uint8 flags = fix_flags(0);
+
+  // S, Z, X, Y from B like DEC B
+  if (b_after == 0)
+    flags |= qkz80_cpu_flags::Z;
+  if (b_after & 0x80)
+    flags |= qkz80_cpu_flags::S;
+  if (cpu_mode == MODE_Z80) {
+    flags |= b_after & (qkz80_cpu_flags::X | qkz80_cpu_flags::Y);
+  }
+
+  // N is bit 7 of the byte transferred
+  if (io_byte & 0x80)
+    flags |= qkz80_cpu_flags::N;
+
+  // H and C are the carry out of k, P/V the parity of (k & 7) ^ B
+  if (k > 0xff)
+    flags |= qkz80_cpu_flags::H | qkz80_cpu_flags::CY;
+  if (parity_info.get_parity_of_byte((k & 0x07) ^ b_after))
+    flags |= qkz80_cpu_flags::P;
+
+  set_flags(flags);
+}
+
 // Block Compare Instructions (CPI/CPIR/CPD/CPDR) - Flag updates
 // Performs A - (HL) comparison and sets flags accordingly
 // S, Z, H: From comparison (A - (HL))
@@ -0,0 +1,164 @@
+; Loops that --loop-idioms runs in batches (Z80)
+;
+; Each case runs one recognized loop, then save appends the registers to
+; a table at regs. "make loop-check" runs this with and without
+; --loop-idioms and compares the console output and all of memory.
+
+BDOS    equ 5
+stack   equ 0x1000
+regs    equ 0x1000
+buf     equ 0x1200
+msglen  equ msgend-msg
+
+        org 0x100
+
+        ld sp, stack
+
+        ; DJNZ delay, 256 iterations
+        ld b, 0
+delay:  djnz delay
+        call save
+
+        ; BC countdown with JR NZ
+        ld bc, 1000
+count1: dec bc
+        ld a, b
+        or c
+        jr nz, count1
+        call save
+
+        ; BC countdown with JP NZ, testing C first, 65536 iterations
+        ld bc, 0
+count2: dec bc
+        ld a, c
+        or b
+        jp nz, count2
+        call save
+
+        ; Fill from a register, counted by DJNZ
+        ld hl, buf
+        ld a, 0x55
+        ld b, 200
+fill1:  ld (hl), a
+        inc hl
+        djnz fill1
+        call save
+
+        ; Fill with an immediate, counted by BC and JR NZ
+        ld hl, buf+200
+        ld bc, 600
+fill2:  ld (hl), 0xaa
+        inc hl
+        dec bc
+        ld a, b
+        or c
+        jr nz, fill2
+        call save
+
+        ; Fill from E, counted by BC and JP NZ
+        ld hl, buf+800
+        ld e, 0x3c
+        ld bc, 256
+fill3:  ld (hl), e
+        inc hl
+        dec bc
+        ld a, c
+        or b
+        jp nz, fill3
+        call save
+
+        ; Copy (HL) to (DE), no overlap
+        ld hl, msg
+        ld de, buf+1100
+        ld bc, msglen
+copy1:  ld a, (hl)
+        ld (de), a
+        inc hl
+        inc de
+        dec bc
+        ld a, b
+        or c
+        jr nz, copy1
+        call save
+
+        ; Overlapping copy down, (DE) to (HL), counted by DJNZ
+        ld de, buf+1103
+        ld hl, buf+1100
+        ld b, 20
+copy2:  ld a, (de)
+        ld (hl), a
+        inc hl
+        inc de
+        djnz copy2
+        call save
+
+        ; Overlapping copy up by two, (DE) to (HL): the first two bytes repeat
+        ld de, buf+1100
+        ld hl, buf+1102
+        ld bc, 40
+copy3:  ld a, (de)
+        ld (hl), a
+        inc de
+        inc hl
+        dec bc
+        ld a, c
+        or b
+        jp nz, copy3
+        call save
+
+        ; Overlapping copy up by one, (HL) to (DE): the first byte repeats
+        ld hl, buf+1200
+        ld (hl), 0x5a
+        ld de, buf+1201
+        ld bc, 500
+copy4:  ld a, (hl)
+        ld (de), a
+        inc de
+        inc hl
+        dec bc
+        ld a, b
+        or c
+        jp nz, copy4
+        call save
+
+        ld de, done
+        ld c, 9                 ; Print String
+        call BDOS
+        rst 0
+
+; Append DE, BC, AF and HL to the table at regs
+save:   ld (savehl), hl
+        push af
+        push bc
+        push de
+        ld hl, (ptr)
+        pop de
+        ld (hl), e
+        inc hl
+        ld (hl), d
+        inc hl
+        pop de
+        ld (hl), e
+        inc hl
+        ld (hl), d
+        inc hl
+        pop de
+        ld (hl), e
+        inc hl
+        ld (hl), d
+        inc hl
+        ex de, hl
+        ld hl, (savehl)
+        ex de, hl
+        ld (hl), e
+        inc hl
+        ld (hl), d
+        inc hl
+        ld (ptr), hl
+        ret
+
+ptr:    dw regs
+savehl: dw 0
+msg:    db "Loop idioms copy this text."
+msgend:
+done:   db "Loops done", 13, 10, "$"
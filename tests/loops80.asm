@@ -0,0 +1,131 @@
+; Loops that --loop-idioms runs in batches (8080, run with --8080)
+;
+; Only the BC countdown with JP NZ exists on the 8080. Each case runs one
+; recognized loop, then save appends the registers to a table at regs.
+; "make loop-check" runs this with and without --loop-idioms and
+; compares the console output and all of memory.
+
+BDOS    equ 5
+stack   equ 0x1000
+regs    equ 0x1000
+buf     equ 0x1200
+msglen  equ msgend-msg
+
+        org 0x100
+
+        ld sp, stack
+
+        ; BC countdown
+        ld bc, 1000
+count1: dec bc
+        ld a, b
+        or c
+        jp nz, count1
+        call save
+
+        ; Fill with an immediate
+        ld hl, buf
+        ld bc, 600
+fill1:  ld (hl), 0xaa
+        inc hl
+        dec bc
+        ld a, c
+        or b
+        jp nz, fill1
+        call save
+
+        ; Fill from D
+        ld hl, buf+600
+        ld d, 0x3c
+        ld bc, 300
+fill2:  ld (hl), d
+        inc hl
+        dec bc
+        ld a, b
+        or c
+        jp nz, fill2
+        call save
+
+        ; Copy (HL) to (DE), no overlap
+        ld hl, msg
+        ld de, buf+1100
+        ld bc, msglen
+copy1:  ld a, (hl)
+        ld (de), a
+        inc hl
+        inc de
+        dec bc
+        ld a, b
+        or c
+        jp nz, copy1
+        call save
+
+        ; Overlapping copy down, (DE) to (HL)
+        ld de, buf+1103
+        ld hl, buf+1100
+        ld bc, 20
+copy2:  ld a, (de)
+        ld (hl), a
+        inc hl
+        inc de
+        dec bc
+        ld a, b
+        or c
+        jp nz, copy2
+        call save
+
+        ; Overlapping copy up by one, (HL) to (DE): the first byte repeats
+        ld hl, buf+1100
+        ld de, buf+1101
+        ld bc, 500
+copy3:  ld a, (hl)
+        ld (de), a
+        inc de
+        inc hl
+        dec bc
+        ld a, c
+        or b
+        jp nz, copy3
+        call save
+
+        ld de, done
+        ld c, 9                 ; Print String
+        call BDOS
+        rst 0
+
+; Append DE, BC, AF and HL to the table at regs
+save:   ld (savehl), hl
+        push af
+        push bc
+        push de
+        ld hl, (ptr)
+        pop de
+        ld (hl), e
+        inc hl
+        ld (hl), d
+        inc hl
+        pop de
+        ld (hl), e
+        inc hl
+        ld (hl), d
+        inc hl
+        pop de
+        ld (hl), e
+        inc hl
+        ld (hl), d
+        inc hl
+        ex de, hl
+        ld hl, (savehl)
+        ex de, hl
+        ld (hl), e
+        inc hl
+        ld (hl), d
+        inc hl
+        ld (ptr), hl
+        ret
+
+ptr:    dw regs
+savehl: dw 0
+msg:    db "Loop idioms copy this text."
+msgend:
+done:   db "Loops done", 13, 10, "$"
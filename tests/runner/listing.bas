@@ -0,0 +1,5 @@
+10 REM LINE 1 OF A LISTING LONGER THAN ONE RECORD
+20 REM LINE 2 OF A LISTING LONGER THAN ONE RECORD
+30 REM LINE 3 OF A LISTING LONGER THAN ONE RECORD
+40 REM LINE 4 OF A LISTING LONGER THAN ONE RECORD
+50 REM LINE 5 OF A LISTING LONGER THAN ONE RECORD
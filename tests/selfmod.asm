@@ -0,0 +1,23 @@
+; Self-modifying code for the AOT compiler
+;
+; Each store patches the immediate operand of a later instruction in the
+; same straight-line block. Should print "XY" whether run interpreted or
+; from blocks compiled by cpmaot ("make aot-selfmod-check").
+
+BDOS    equ 5
+
+        org 0x100
+
+        ld a, 'X'
+        ld (patch1+1), a        ; Direct store
+        ld c, 2                 ; Console Output
+patch1: ld e, 'A'
+        call BDOS
+
+        ld hl, patch2+1
+        ld (hl), 'Y'            ; Indirect store
+        ld c, 2                 ; Console Output
+patch2: ld e, 'B'
+        call BDOS
+
+        rst 0
@@ -0,0 +1,248 @@
+/*
+ * Test of the qkz80 C interface (src/qkz80_c.h), compiled as C.
+ * Built and run by "make test" in src/.
+ */
+
+#include "qkz80_c.h"
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if (!(cond)) { \
+      failures++; \
+      printf("FAIL line %d: %s\n", __LINE__, #cond); \
+    } \
+  } while (0)
+
+/* 0100: LD A,12h / LD B,3 / loop: INC A / DJNZ loop / OUT (10h),A /
+ *       IN A,(11h) / CALL 0200h / HALT
+ * 0200: RET */
+static const uint8_t program[] = {
+  0x3e, 0x12, 0x06, 0x03, 0x3c, 0x10, 0xfd, 0xd3, 0x10, 0xdb, 0x11,
+  0xcd, 0x00, 0x02, 0x76
+};
+
+static int out_port = -1;
+static int out_value = -1;
+static int stop_on_out = 0;
+
+static uint8_t port_in(qkz80_machine *m, uint8_t port, void *user) {
+  (void)m;
+  (void)user;
+  return port == 0x11 ? 0x42 : 0x00;
+}
+
+static void port_out(qkz80_machine *m, uint8_t port, uint8_t value, void *user) {
+  (void)user;
+  out_port = port;
+  out_value = value;
+  if (stop_on_out) {
+    qkz80_stop(m);
+  }
+}
+
+static int trap_calls = 0;
+
+static int stop_trap(qkz80_machine *m, uint16_t pc, void *user) {
+  (void)m;
+  (void)pc;
+  (void)user;
+  trap_calls++;
+  return QKZ80_TRAP_STOP;
+}
+
+/* Stands in for the subroutine: pops the return address */
+static int ret_trap(qkz80_machine *m, uint16_t pc, void *user) {
+  qkz80_regs r;
+  uint8_t ret[2];
+  (void)pc;
+  (void)user;
+  trap_calls++;
+  qkz80_get_regs(m, &r);
+  qkz80_read_memory(m, r.sp, ret, 2);
+  r.sp += 2;
+  r.pc = ret[0] | (ret[1] << 8);
+  qkz80_set_regs(m, &r);
+  return QKZ80_TRAP_CONTINUE;
+}
+
+static qkz80_machine *setup(void) {
+  qkz80_machine *m = qkz80_create(QKZ80_CPU_Z80);
+  qkz80_regs r;
+  static const uint8_t ret = 0xc9;
+  qkz80_write_memory(m, 0x0100, program, sizeof(program));
+  qkz80_write_memory(m, 0x0200, &ret, 1);
+  qkz80_get_regs(m, &r);
+  r.pc = 0x0100;
+  r.sp = 0xf000;
+  qkz80_set_regs(m, &r);
+  qkz80_set_io(m, port_in, port_out, NULL);
+  return m;
+}
+
+static void test_create_and_load(void) {
+  const char *path = "test_c_api.tmp";
+  qkz80_machine *m;
+  FILE *fp;
+  uint8_t back[sizeof(program)];
+
+  CHECK(qkz80_api_version() == QKZ80_C_API_VERSION);
+  CHECK(qkz80_create(7) == NULL);
+
+  m = qkz80_create(QKZ80_CPU_8080);
+  CHECK(m != NULL);
+  fp = fopen(path, "wb");
+  CHECK(fp != NULL);
+  if (fp) {
+    fwrite(program, 1, sizeof(program), fp);
+    fclose(fp);
+  }
+  CHECK(qkz80_load(m, path, 0x0100) == (long)sizeof(program));
+  qkz80_read_memory(m, 0x0100, back, sizeof(back));
+  CHECK(memcmp(back, program, sizeof(program)) == 0);
+  CHECK(qkz80_load(m, path, 0xfff8) == -1);  /* Would run past FFFF */
+  CHECK(qkz80_load(m, "no such file", 0x0100) == -1);
+  remove(path);
+  qkz80_destroy(m);
+}
+
+static void test_run_and_budgets(void) {
+  qkz80_machine *m = setup();
+  qkz80_run_result res;
+  qkz80_regs r;
+  uint64_t before;
+
+  /* LD, LD, then INC/DJNZ pairs */
+  CHECK(qkz80_run(m, 5, 0, &res) == QKZ80_EXIT_INSTRUCTIONS);
+  CHECK(res.instructions == 5);
+  qkz80_get_regs(m, &r);
+  CHECK(r.pc == 0x0105);
+  CHECK((r.af >> 8) == 0x14);
+
+  /* A cycle budget ends on the first instruction that reaches it */
+  before = qkz80_cycles(m);
+  CHECK(qkz80_run(m, 0, 1, &res) == QKZ80_EXIT_CYCLES);
+  CHECK(res.instructions == 1);
+  CHECK(res.cycles >= 1);
+  CHECK(qkz80_cycles(m) - before == res.cycles);
+
+  /* On to the HALT, through OUT, IN and the CALL/RET */
+  CHECK(qkz80_run(m, 0, 0, &res) == QKZ80_EXIT_HALT);
+  qkz80_get_regs(m, &r);
+  CHECK(out_port == 0x10 && out_value == 0x15);
+  CHECK((r.af >> 8) == 0x42);
+  CHECK(r.halted == 1);
+  CHECK(r.sp == 0xf000);
+
+  /* Clearing halted goes on after the HALT */
+  r.halted = 0;
+  qkz80_set_regs(m, &r);
+  CHECK(qkz80_run(m, 1, 0, &res) == QKZ80_EXIT_INSTRUCTIONS);
+  qkz80_get_regs(m, &r);
+  CHECK(r.pc == 0x0110);
+  qkz80_destroy(m);
+}
+
+static void test_traps(void) {
+  qkz80_machine *m = setup();
+  qkz80_run_result res;
+  qkz80_regs r;
+
+  /* A stop leaves PC on the trap; the next run executes that
+   * instruction without firing the trap again */
+  trap_calls = 0;
+  qkz80_set_trap(m, 0x0200, stop_trap, NULL);
+  CHECK(qkz80_run(m, 0, 0, &res) == QKZ80_EXIT_TRAP);
+  qkz80_get_regs(m, &r);
+  CHECK(r.pc == 0x0200);
+  CHECK(trap_calls == 1);
+  CHECK(qkz80_run(m, 0, 0, &res) == QKZ80_EXIT_HALT);
+  CHECK(res.instructions == 2);  /* RET, HALT */
+  CHECK(trap_calls == 1);
+
+  /* A trap that moves PC replaces the instruction */
+  qkz80_destroy(m);
+  m = setup();
+  trap_calls = 0;
+  qkz80_set_trap(m, 0x0200, ret_trap, NULL);
+  CHECK(qkz80_run(m, 0, 0, &res) == QKZ80_EXIT_HALT);
+  CHECK(trap_calls == 1);
+  CHECK(res.instructions == 12);  /* The RET at 0200 never ran */
+
+  /* Removing it lets the RET run */
+  qkz80_destroy(m);
+  m = setup();
+  trap_calls = 0;
+  qkz80_set_trap(m, 0x0200, ret_trap, NULL);
+  qkz80_set_trap(m, 0x0200, NULL, NULL);
+  CHECK(qkz80_run(m, 0, 0, &res) == QKZ80_EXIT_HALT);
+  CHECK(trap_calls == 0);
+  CHECK(res.instructions == 13);
+
+  /* qkz80_stop() from a port callback */
+  qkz80_destroy(m);
+  m = setup();
+  stop_on_out = 1;
+  CHECK(qkz80_run(m, 0, 0, &res) == QKZ80_EXIT_STOP);
+  stop_on_out = 0;
+  qkz80_get_regs(m, &r);
+  CHECK(r.pc == 0x0109);
+  qkz80_destroy(m);
+}
+
+static void test_memory_wrap(void) {
+  qkz80_machine *m = qkz80_create(QKZ80_CPU_Z80);
+  static const uint8_t data[4] = { 0x11, 0x22, 0x33, 0x44 };
+  uint8_t back[4];
+  uint8_t *ram = qkz80_memory(m);
+
+  qkz80_write_memory(m, 0xfffe, data, sizeof(data));
+  CHECK(ram[0xfffe] == 0x11 && ram[0xffff] == 0x22);
+  CHECK(ram[0x0000] == 0x33 && ram[0x0001] == 0x44);
+  qkz80_read_memory(m, 0xffff, back, 3);
+  CHECK(back[0] == 0x22 && back[1] == 0x33 && back[2] == 0x44);
+  qkz80_destroy(m);
+}
+
+static void test_clone(void) {
+  qkz80_machine *m = setup();
+  qkz80_machine *c;
+  qkz80_run_result res;
+  qkz80_regs rm, rc;
+
+  qkz80_set_trap(m, 0x0200, stop_trap, NULL);
+  CHECK(qkz80_run(m, 4, 0, &res) == QKZ80_EXIT_INSTRUCTIONS);
+  c = qkz80_clone(m);
+  CHECK(c != NULL);
+  CHECK(qkz80_cycles(c) == qkz80_cycles(m));
+
+  /* Separate RAM */
+  qkz80_memory(c)[0x8000] = 0x99;
+  CHECK(qkz80_memory(m)[0x8000] == 0x00);
+
+  /* Same registers, traps and callbacks: both stop at the trap alike */
+  trap_calls = 0;
+  CHECK(qkz80_run(m, 0, 0, &res) == QKZ80_EXIT_TRAP);
+  CHECK(qkz80_run(c, 0, 0, &res) == QKZ80_EXIT_TRAP);
+  CHECK(trap_calls == 2);
+  qkz80_get_regs(m, &rm);
+  qkz80_get_regs(c, &rc);
+  CHECK(memcmp(&rm, &rc, sizeof(rm)) == 0);
+  CHECK(qkz80_run(c, 0, 0, &res) == QKZ80_EXIT_HALT);
+  qkz80_destroy(c);
+  qkz80_destroy(m);
+}
+
+int main(void) {
+  test_create_and_load();
+  test_run_and_budgets();
+  test_traps();
+  test_memory_wrap();
+  test_clone();
+  printf("C interface: %d checks, %d failed\n", checks, failures);
+  return failures ? 1 : 0;
+}
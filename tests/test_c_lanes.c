@@ -0,0 +1,220 @@
+/*
+ * Test of qkz80_run_lanes() (src/qkz80_c.h), compiled as C.
+ * Built and run by "make test" in src/.
+ *
+ * Each case runs the same program on several lanes whose input bytes at
+ * 0080h differ, once with qkz80_run_lanes() and once as separate
+ * qkz80_run() calls on copies, and requires the same exits, counts,
+ * registers, RAM and callbacks after every step.
+ */
+
+#include "qkz80_c.h"
+#include <stdio.h>
+#include <string.h>
+
+#define LANES 5
+#define INPUT 0x0080
+#define MAX_EVENTS 64
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(cond, name) do { \
+    checks++; \
+    if (!(cond)) { \
+      failures++; \
+      printf("FAIL %s line %d: %s\n", name, __LINE__, #cond); \
+    } \
+  } while (0)
+
+/* What the callbacks of one machine saw */
+typedef struct events {
+  int count;
+  uint16_t what[MAX_EVENTS];  /* Port and value for OUT, FFxx for a trap */
+  int lane;
+} events;
+
+static void record(events *e, uint16_t what) {
+  if (e->count < MAX_EVENTS) {
+    e->what[e->count] = what;
+  }
+  e->count++;
+}
+
+static uint8_t lane_in(qkz80_machine *m, uint8_t port, void *user) {
+  events *e = (events *)user;
+  (void)m;
+  record(e, 0xfe00 | port);
+  return (uint8_t)(0x30 + e->lane + port);
+}
+
+static void lane_out(qkz80_machine *m, uint8_t port, uint8_t value, void *user) {
+  (void)m;
+  record((events *)user, (uint16_t)(port << 8 | value));
+}
+
+static int trap_continue(qkz80_machine *m, uint16_t pc, void *user) {
+  (void)m;
+  record((events *)user, (uint16_t)(0xff00 | (pc & 0xff)));
+  return QKZ80_TRAP_CONTINUE;
+}
+
+static int trap_stop(qkz80_machine *m, uint16_t pc, void *user) {
+  (void)m;
+  record((events *)user, (uint16_t)(0xff00 | (pc & 0xff)));
+  return QKZ80_TRAP_STOP;
+}
+
+typedef struct lane_case {
+  const char *name;
+  const uint8_t *code;
+  size_t length;
+  uint64_t step_instructions;  /* Budgets of each step, 0 = none */
+  uint64_t step_cycles;
+  int trap_addr;               /* -1 = no trap */
+  qkz80_trap_fn trap;
+  int trap_lane;               /* Lane that gets the trap, -1 = all */
+  int lane_sp;                 /* Lane whose SP differs, -1 = none */
+  int expect_shared;           /* Some instructions must run once for a group */
+} lane_case;
+
+static void run_case(const lane_case *c) {
+  qkz80_machine *base = qkz80_create(QKZ80_CPU_Z80);
+  qkz80_machine *lanes[LANES];
+  qkz80_machine *refs[LANES];
+  events lane_events[LANES], ref_events[LANES];
+  qkz80_exit exits[LANES];
+  qkz80_run_result results[LANES];
+  uint64_t shared_total = 0;
+  qkz80_regs r;
+  int i, step, running = 1;
+
+  qkz80_write_memory(base, 0x0100, c->code, c->length);
+  qkz80_get_regs(base, &r);
+  r.pc = 0x0100;
+  r.sp = 0xf000;
+  qkz80_set_regs(base, &r);
+
+  for (i = 0; i < LANES; i++) {
+    /* Lanes 0 and 1 get the same input */
+    uint8_t input[4];
+    int k;
+    for (k = 0; k < 4; k++) {
+      input[k] = (uint8_t)((i < 2 ? 0 : i) * 7 + k);
+    }
+    lanes[i] = qkz80_clone(base);
+    refs[i] = qkz80_clone(base);
+    memset(&lane_events[i], 0, sizeof(events));
+    memset(&ref_events[i], 0, sizeof(events));
+    lane_events[i].lane = ref_events[i].lane = i;
+    qkz80_write_memory(lanes[i], INPUT, input, sizeof(input));
+    qkz80_write_memory(refs[i], INPUT, input, sizeof(input));
+    qkz80_set_io(lanes[i], lane_in, lane_out, &lane_events[i]);
+    qkz80_set_io(refs[i], lane_in, lane_out, &ref_events[i]);
+    if (c->trap_addr >= 0 && (c->trap_lane < 0 || c->trap_lane == i)) {
+      qkz80_set_trap(lanes[i], (uint16_t)c->trap_addr, c->trap, &lane_events[i]);
+      qkz80_set_trap(refs[i], (uint16_t)c->trap_addr, c->trap, &ref_events[i]);
+    }
+    if (c->lane_sp == i) {
+      qkz80_get_regs(lanes[i], &r);
+      r.sp = 0xe000;
+      qkz80_set_regs(lanes[i], &r);
+      qkz80_set_regs(refs[i], &r);
+    }
+  }
+
+  for (step = 0; running && step < 1000; step++) {
+    uint64_t shared = 0;
+    qkz80_run_lanes(lanes, LANES, c->step_instructions, c->step_cycles,
+                    exits, results, &shared);
+    shared_total += shared;
+    running = 0;
+    for (i = 0; i < LANES; i++) {
+      qkz80_run_result want;
+      qkz80_regs rl, rr;
+      qkz80_exit why = qkz80_run(refs[i], c->step_instructions, c->step_cycles, &want);
+      CHECK(exits[i] == why, c->name);
+      CHECK(results[i].instructions == want.instructions, c->name);
+      CHECK(results[i].cycles == want.cycles, c->name);
+      qkz80_get_regs(lanes[i], &rl);
+      qkz80_get_regs(refs[i], &rr);
+      CHECK(memcmp(&rl, &rr, sizeof(rl)) == 0, c->name);
+      CHECK(qkz80_cycles(lanes[i]) == qkz80_cycles(refs[i]), c->name);
+      CHECK(memcmp(qkz80_memory(lanes[i]), qkz80_memory(refs[i]), 0x10000) == 0,
+            c->name);
+      if (why != QKZ80_EXIT_HALT) {
+        running = 1;
+      }
+    }
+  }
+  CHECK(!running, c->name);
+  if (c->expect_shared) {
+    CHECK(shared_total > 0, c->name);
+  }
+
+  for (i = 0; i < LANES; i++) {
+    CHECK(lane_events[i].count == ref_events[i].count, c->name);
+    CHECK(memcmp(lane_events[i].what, ref_events[i].what,
+                 sizeof(lane_events[i].what)) == 0, c->name);
+    qkz80_destroy(lanes[i]);
+    qkz80_destroy(refs[i]);
+  }
+  qkz80_destroy(base);
+}
+
+/* LD HL,0 / LD B,200 / loop: INC HL / DJNZ loop / LD A,(0080h) / ADD A,L /
+ * OUT (1),A / IN A,(2) / OUT (3),A / HALT */
+static const uint8_t prefix_code[] = {
+  0x21, 0x00, 0x00, 0x06, 0xc8, 0x23, 0x10, 0xfd, 0x3a, 0x80, 0x00, 0x85,
+  0xd3, 0x01, 0xdb, 0x02, 0xd3, 0x03, 0x76
+};
+#define PREFIX_LOOP 0x0105
+#define PREFIX_READ 0x0108
+
+/* LD HL,1234h / LD SP,0080h / EX (SP),HL / LD A,L / OUT (1),A / LD A,H /
+ * OUT (1),A / HALT */
+static const uint8_t xthl_code[] = {
+  0x21, 0x34, 0x12, 0x31, 0x80, 0x00, 0xe3, 0x7d, 0xd3, 0x01, 0x7c, 0xd3,
+  0x01, 0x76
+};
+
+/* LD A,55h / LD (0080h),A / LD B,50 / loop: INC A / DJNZ loop /
+ * LD A,(0080h) / OUT (1),A / HALT */
+static const uint8_t overwrite_code[] = {
+  0x3e, 0x55, 0x32, 0x80, 0x00, 0x06, 0x32, 0x3c, 0x10, 0xfd, 0x3a, 0x80,
+  0x00, 0xd3, 0x01, 0x76
+};
+
+/* LD SP,0082h / LD BC,1234h / PUSH BC / POP DE / LD A,E / OUT (1),A /
+ * LD A,(0082h) / OUT (1),A / HALT */
+static const uint8_t push_pop_code[] = {
+  0x31, 0x82, 0x00, 0x01, 0x34, 0x12, 0xc5, 0xd1, 0x7b, 0xd3, 0x01, 0x3a,
+  0x82, 0x00, 0xd3, 0x01, 0x76
+};
+
+int main(void) {
+  static const lane_case cases[] = {
+    { "shared prefix", prefix_code, sizeof(prefix_code), 0, 0, -1, NULL, -1, -1, 1 },
+    { "stepped instructions", prefix_code, sizeof(prefix_code), 7, 0, -1, NULL, -1, -1, 1 },
+    { "stepped cycles", prefix_code, sizeof(prefix_code), 0, 13, -1, NULL, -1, -1, 1 },
+    { "trap on all lanes", prefix_code, sizeof(prefix_code), 0, 0,
+      PREFIX_LOOP, trap_continue, -1, -1, 0 },
+    { "trap stop on all lanes", prefix_code, sizeof(prefix_code), 0, 0,
+      PREFIX_READ, trap_stop, -1, -1, 1 },
+    { "trap on one lane", prefix_code, sizeof(prefix_code), 0, 0,
+      PREFIX_LOOP, trap_continue, 3, -1, 1 },
+    { "one lane with other registers", prefix_code, sizeof(prefix_code), 0, 0,
+      -1, NULL, -1, 2, 1 },
+    { "EX (SP),HL on the input", xthl_code, sizeof(xthl_code), 0, 0, -1, NULL, -1, -1, 1 },
+    { "overwritten input", overwrite_code, sizeof(overwrite_code), 0, 0, -1, NULL, -1, -1, 1 },
+    { "PUSH/POP over the input", push_pop_code, sizeof(push_pop_code), 0, 0,
+      -1, NULL, -1, -1, 1 },
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    run_case(&cases[i]);
+  }
+  printf("Lockstep lanes: %d checks, %d failed\n", checks, failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+; Record counts of a text file, as the guest sees it
+;
+; Run as "cpmemu textrec.com FILE.TXT". Prints the records read with
+; Read Sequential, the size from Compute File Size, and the return codes
+; of Read Random for the last record and for the one after it.
+; textrec1.txt (12 bytes) should print "1 1 0 1",
+; textrec2.txt (300 bytes) should print "3 3 0 1".
+
+BDOS    equ 5
+FCB     equ 0x5c
+RANREC  equ FCB+33
+
+        org 0x100
+
+        ld de, FCB
+        ld c, 15                ; Open File
+        call BDOS
+
+        ld b, 0                 ; Records read
+next:   push bc
+        ld de, FCB
+        ld c, 20                ; Read Sequential
+        call BDOS
+        pop bc
+        or a
+        jr nz, counted
+        inc b
+        jr next
+
+counted:
+        ld a, b
+        call digit
+
+        ld de, FCB
+        ld c, 35                ; Compute File Size
+        call BDOS
+        ld a, (RANREC)
+        call digit
+
+        ld hl, RANREC           ; Last record
+        dec (hl)
+        ld de, FCB
+        ld c, 33                ; Read Random
+        call BDOS
+        call digit
+
+        ld hl, RANREC           ; Past the end
+        inc (hl)
+        ld de, FCB
+        ld c, 33
+        call BDOS
+        call digit
+
+        rst 0
+
+; Print A (0-9) and a space
+digit:  add a, '0'
+        ld e, a
+        ld c, 2
+        call BDOS
+        ld e, ' '
+        ld c, 2
+        jp BDOS
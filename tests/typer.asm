@@ -0,0 +1,51 @@
+; Tiny stand-in interpreter for the --run-tests fixtures in runner/
+;
+; Run as "cpmemu --run-tests=../tests/runner ../tests/typer.com". Types
+; the file named on the command line to the console, then copies each
+; console input character to the printer until the script runs out.
+
+BDOS    equ 5
+FCB     equ 0x5c
+DMA     equ 0x80
+
+        org 0x100
+
+        ld de, FCB
+        ld c, 15                ; Open File
+        call BDOS
+        inc a
+        jr z, lines             ; Not found: nothing to type
+
+read:   ld de, FCB
+        ld c, 20                ; Read Sequential
+        call BDOS
+        or a
+        jr nz, lines
+        ld hl, DMA
+        ld b, 128
+type:   ld a, (hl)
+        cp 0x1a                 ; ^Z ends the text
+        jr z, lines
+        push hl
+        push bc
+        ld e, a
+        ld c, 2                 ; Console Output
+        call BDOS
+        pop bc
+        pop hl
+        inc hl
+        djnz type
+        jr read
+
+lines:  ld c, 1                 ; Console Input
+        call BDOS
+        cp 0x0d                 ; Input lines arrive ending in CR
+        jr nz, put
+        ld e, a
+        ld c, 5                 ; List Output
+        call BDOS
+        ld a, 0x0a
+put:    ld e, a
+        ld c, 5                 ; List Output
+        call BDOS
+        jr lines